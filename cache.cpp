@@ -0,0 +1,288 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "simulator.h"
+
+using namespace std;
+typedef unsigned long long ull;
+
+// Bump whenever the layout of the image or of DecodedInstruction changes
+const uint32_t cacheVersion = 7;
+const char cacheMagic[8] = {'R', 'V', 'S', 'I', 'M', 'P', 'C', '\0'};
+
+// Fixed header at the start of every cached image
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t instructionSize; // sizeof(DecodedInstruction) of the writer
+    uint64_t hashLow;
+    uint64_t hashHigh;
+    uint64_t sourceSize;
+    uint64_t instructionCount;
+    uint64_t labelCount;
+    uint64_t labelNameCount;
+    uint64_t pageCount;
+    int64_t extraLines;
+    uint64_t dataStart; // The data section was placed for this start address
+    uint64_t dataEnd;
+};
+
+// Piece of the source file, stored as an offset so views can be rebuilt on a hit
+struct SourceSpan
+{
+    uint64_t offset;
+    uint32_t length;
+    int32_t line;
+};
+
+// One page of the initialized data section
+struct CachedPage
+{
+    uint64_t pageNumber;
+    unsigned char bytes[pageSize];
+};
+
+uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t finalizeHash(uint64_t value)
+{
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+// Function to hash the file eight bytes at a time into two independent 64 bit lanes
+SourceHash hashContents(const char *data, size_t size)
+{
+    uint64_t low = 0x9E3779B97F4A7C15ULL ^ size;
+    uint64_t high = 0xC2B2AE3D27D4EB4FULL + size;
+    size_t i = 0;
+    while (i < size)
+    {
+        uint64_t word = 0;
+        size_t chunk = size - i < 8 ? size - i : 8;
+        memcpy(&word, data + i, chunk);
+        low = rotateLeft(low ^ (word * 0x87C37B91114253D5ULL), 31) * 0x4CF5AD432745937FULL;
+        high = rotateLeft(high + (word * 0xFF51AFD7ED558CCDULL), 27) * 0x9E3779B97F4A7C15ULL + low;
+        i += chunk;
+    }
+    return {finalizeHash(low), finalizeHash(high ^ low)};
+}
+
+// Function to find the cache directory, an empty RISCV_SIM_CACHE_DIR disables caching
+string cacheDirectory()
+{
+    const char *dir = getenv("RISCV_SIM_CACHE_DIR");
+    if (dir != nullptr)
+        return dir;
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != nullptr && *xdg != '\0')
+        return string(xdg) + "/riscv_sim";
+    const char *home = getenv("HOME");
+    if (home != nullptr && *home != '\0')
+        return string(home) + "/.cache/riscv_sim";
+    return "";
+}
+
+string cachePath(const SourceHash &hash)
+{
+    string dir = cacheDirectory();
+    if (dir.empty())
+        return "";
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx%016llx.rvc", (ull)hash.high, (ull)hash.low);
+    return dir + name;
+}
+
+bool validSpan(const SourceSpan &span, size_t sourceSize)
+{
+    return span.offset <= sourceSize && span.length <= sourceSize - span.offset;
+}
+
+// Function to rebuild the decoded program from its cached image, returns false on a miss
+bool loadProgramCache(const SourceHash &hash, const char *source, size_t sourceSize,
+                      vector<DecodedInstruction> &decodedProgram, vector<string_view> &instructionList,
+                      unordered_map<string_view, int> &labelAddresses, vector<string_view> &labelNames, int &extraLines, Memory &memory,
+                      ull dataStart, ull &dataEnd)
+{
+    string path = cachePath(hash);
+    if (path.empty())
+        return false;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) < 0 || (size_t)fileInfo.st_size < sizeof(CacheHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t imageSize = fileInfo.st_size;
+    void *data = mmap(nullptr, imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+
+    const char *image = (const char *)data;
+    CacheHeader header;
+    memcpy(&header, image, sizeof(header));
+
+    // Anything unexpected is treated as a miss, the image is then rewritten
+    bool valid = memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) == 0 && header.version == cacheVersion &&
+                 header.instructionSize == sizeof(DecodedInstruction) && header.hashLow == hash.low &&
+                 header.hashHigh == hash.high && header.sourceSize == sourceSize && header.dataStart == dataStart &&
+                 header.instructionCount <= imageSize && header.labelCount <= imageSize &&
+                 header.labelNameCount <= imageSize && header.pageCount <= imageSize;
+    size_t instructionsAt = sizeof(CacheHeader);
+    size_t textAt = instructionsAt + header.instructionCount * sizeof(DecodedInstruction);
+    size_t labelsAt = textAt + header.instructionCount * sizeof(SourceSpan);
+    size_t labelNamesAt = labelsAt + header.labelCount * sizeof(SourceSpan);
+    size_t pagesAt = labelNamesAt + header.labelNameCount * sizeof(SourceSpan);
+    size_t expectedSize = pagesAt + header.pageCount * sizeof(CachedPage);
+    if (!valid || expectedSize != imageSize)
+    {
+        munmap(data, imageSize);
+        return false;
+    }
+
+    // Lines, targets and registers are used as indices without further checks, a label
+    // may point one past the last instruction
+    const DecodedInstruction *instructions = (const DecodedInstruction *)(image + instructionsAt);
+    const SourceSpan *text = (const SourceSpan *)(image + textAt);
+    const SourceSpan *labels = (const SourceSpan *)(image + labelsAt);
+    const SourceSpan *names = (const SourceSpan *)(image + labelNamesAt);
+    for (size_t i = 0; i < header.instructionCount; i++)
+    {
+        const DecodedInstruction &decoded = instructions[i];
+        valid = valid && validSpan(text[i], sourceSize) && decoded.rd < 32 && decoded.rs1 < 32 && decoded.rs2 < 32 &&
+                decoded.target >= -1 && decoded.target <= (ll)header.instructionCount;
+    }
+    for (size_t i = 0; i < header.labelCount; i++)
+        valid = valid && validSpan(labels[i], sourceSize) && labels[i].line >= 0 && labels[i].line <= (ll)header.instructionCount;
+    for (size_t i = 0; i < header.labelNameCount; i++)
+        valid = valid && validSpan(names[i], sourceSize);
+    if (!valid)
+    {
+        munmap(data, imageSize);
+        return false;
+    }
+
+    decodedProgram.assign(instructions, instructions + header.instructionCount);
+    instructionList.resize(header.instructionCount);
+    for (size_t i = 0; i < header.instructionCount; i++)
+        instructionList[i] = string_view(source + text[i].offset, text[i].length);
+    labelAddresses.reserve(header.labelCount);
+    for (size_t i = 0; i < header.labelCount; i++)
+        labelAddresses[string_view(source + labels[i].offset, labels[i].length)] = labels[i].line;
+    labelNames.resize(header.labelNameCount);
+    for (size_t i = 0; i < header.labelNameCount; i++)
+        labelNames[i] = string_view(source + names[i].offset, names[i].length);
+    const CachedPage *pages = (const CachedPage *)(image + pagesAt);
+    for (size_t i = 0; i < header.pageCount; i++)
+        memory.copyIn(pages[i].pageNumber << pageBits, pages[i].bytes, pageSize);
+    extraLines = header.extraLines;
+    dataEnd = header.dataEnd;
+
+    munmap(data, imageSize);
+    return true;
+}
+
+template <typename T>
+void appendBytes(vector<char> &buffer, const T *items, size_t count)
+{
+    const char *start = (const char *)items;
+    buffer.insert(buffer.end(), start, start + count * sizeof(T));
+}
+
+// Function to write the decoded program next to other cached images. Every writer
+// uses its own temporary file and renames it into place, so parallel simulator
+// processes never observe a partially written image
+void saveProgramCache(const SourceHash &hash, const char *source, size_t sourceSize,
+                      const vector<DecodedInstruction> &decodedProgram, const vector<string_view> &instructionList,
+                      const unordered_map<string_view, int> &labelAddresses, const vector<string_view> &labelNames, int extraLines,
+                      const Memory &memory, ull dataStart, ull dataEnd)
+{
+    string path = cachePath(hash);
+    if (path.empty())
+        return;
+
+    // Create the cache directory and its parents if needed
+    string dir = path.substr(0, path.rfind('/'));
+    for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1))
+    {
+        mkdir(dir.substr(0, slash).c_str(), 0755);
+        if (slash == string::npos)
+            break;
+    }
+
+    vector<SourceSpan> text(instructionList.size());
+    for (size_t i = 0; i < instructionList.size(); i++)
+        text[i] = {(uint64_t)(instructionList[i].data() - source), (uint32_t)instructionList[i].length(), (int32_t)i};
+    vector<SourceSpan> labels;
+    labels.reserve(labelAddresses.size());
+    for (auto &label : labelAddresses)
+        labels.push_back({(uint64_t)(label.first.data() - source), (uint32_t)label.first.length(), label.second});
+    vector<SourceSpan> names(labelNames.size());
+    for (size_t i = 0; i < labelNames.size(); i++)
+        names[i] = {(uint64_t)(labelNames[i].data() - source), (uint32_t)labelNames[i].length(), 0};
+
+    CacheHeader header = {};
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.instructionSize = sizeof(DecodedInstruction);
+    header.hashLow = hash.low;
+    header.hashHigh = hash.high;
+    header.sourceSize = sourceSize;
+    header.instructionCount = decodedProgram.size();
+    header.labelCount = labels.size();
+    header.labelNameCount = names.size();
+    header.pageCount = memory.allPages().size();
+    header.extraLines = extraLines;
+    header.dataStart = dataStart;
+    header.dataEnd = dataEnd;
+
+    vector<char> buffer;
+    appendBytes(buffer, &header, 1);
+    appendBytes(buffer, decodedProgram.data(), decodedProgram.size());
+    appendBytes(buffer, text.data(), text.size());
+    appendBytes(buffer, labels.data(), labels.size());
+    appendBytes(buffer, names.data(), names.size());
+    for (auto &page : memory.allPages())
+    {
+        uint64_t pageNumber = page.first;
+        appendBytes(buffer, &pageNumber, 1);
+        appendBytes(buffer, page.second->bytes, pageSize);
+    }
+
+    static atomic<unsigned> tempCounter(0);
+    string tempPath = path + ".tmp." + to_string(getpid()) + "." + to_string(tempCounter++);
+    int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_EXCL, 0644);
+    if (fd < 0)
+        return;
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t result = write(fd, buffer.data() + written, buffer.size() - written);
+        if (result <= 0)
+            break;
+        written += result;
+    }
+    close(fd);
+    if (written != buffer.size() || rename(tempPath.c_str(), path.c_str()) != 0)
+        unlink(tempPath.c_str());
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "decoder.h"
+#include "memory.h"
+
+using namespace std;
+
+// Content hash of a source file, used as the key of its cached decoded image
+struct SourceHash
+{
+    uint64_t low;
+    uint64_t high;
+};
+
+SourceHash hashContents(const char *data, size_t size);
+bool loadProgramCache(const SourceHash &hash, const char *source, size_t sourceSize,
+                      vector<DecodedInstruction> &decodedProgram, vector<string_view> &instructionList,
+                      unordered_map<string_view, int> &labelAddresses, vector<string_view> &labelNames, int &extraLines, Memory &memory,
+                      ull dataStart, ull &dataEnd);
+void saveProgramCache(const SourceHash &hash, const char *source, size_t sourceSize,
+                      const vector<DecodedInstruction> &decodedProgram, const vector<string_view> &instructionList,
+                      const unordered_map<string_view, int> &labelAddresses, const vector<string_view> &labelNames, int extraLines,
+                      const Memory &memory, ull dataStart, ull dataEnd);
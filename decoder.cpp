@@ -0,0 +1,435 @@
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "decoder.h"
+#include "parallel.h"
+#include "simulator.h"
+
+using namespace std;
+typedef unsigned long long ull;
+typedef long long ll;
+
+// Store instruction names and their decoded operations
+const unordered_map<string_view, Opcode> opcodeMap = {
+    {"add", OP_ADD},
+    {"sub", OP_SUB},
+    {"xor", OP_XOR},
+    {"or", OP_OR},
+    {"and", OP_AND},
+    {"sll", OP_SLL},
+    {"srl", OP_SRL},
+    {"sra", OP_SRA},
+    {"addi", OP_ADDI},
+    {"xori", OP_XORI},
+    {"ori", OP_ORI},
+    {"andi", OP_ANDI},
+    {"slli", OP_SLLI},
+    {"srli", OP_SRLI},
+    {"srai", OP_SRAI},
+    {"lb", OP_LB},
+    {"lh", OP_LH},
+    {"lw", OP_LW},
+    {"ld", OP_LD},
+    {"lbu", OP_LBU},
+    {"lhu", OP_LHU},
+    {"lwu", OP_LWU},
+    {"jalr", OP_JALR},
+    {"sb", OP_SB},
+    {"sh", OP_SH},
+    {"sw", OP_SW},
+    {"sd", OP_SD},
+    {"beq", OP_BEQ},
+    {"bne", OP_BNE},
+    {"blt", OP_BLT},
+    {"bge", OP_BGE},
+    {"bltu", OP_BLTU},
+    {"bgeu", OP_BGEU},
+    {"jal", OP_JAL},
+    {"lui", OP_LUI},
+    {"sfence.vma", OP_SFENCE_VMA},
+    {"csrrw", OP_CSRRW},
+    {"csrrs", OP_CSRRS},
+    {"csrrc", OP_CSRRC},
+    {"csrrwi", OP_CSRRWI},
+    {"csrrsi", OP_CSRRSI},
+    {"csrrci", OP_CSRRCI},
+    {"csrr", OP_CSRRS},
+    {"rdcycle", OP_CSRRS},
+    {"rdtime", OP_CSRRS},
+    {"rdinstret", OP_CSRRS},
+    {"add.uw", OP_ADD_UW},
+    {"sh1add", OP_SH1ADD},
+    {"sh2add", OP_SH2ADD},
+    {"sh3add", OP_SH3ADD},
+    {"sh1add.uw", OP_SH1ADD_UW},
+    {"sh2add.uw", OP_SH2ADD_UW},
+    {"sh3add.uw", OP_SH3ADD_UW},
+    {"andn", OP_ANDN},
+    {"orn", OP_ORN},
+    {"xnor", OP_XNOR},
+    {"max", OP_MAX},
+    {"maxu", OP_MAXU},
+    {"min", OP_MIN},
+    {"minu", OP_MINU},
+    {"rol", OP_ROL},
+    {"rolw", OP_ROLW},
+    {"ror", OP_ROR},
+    {"rorw", OP_RORW},
+    {"slli.uw", OP_SLLI_UW},
+    {"rori", OP_RORI},
+    {"roriw", OP_RORIW},
+    {"clz", OP_CLZ},
+    {"clzw", OP_CLZW},
+    {"ctz", OP_CTZ},
+    {"ctzw", OP_CTZW},
+    {"cpop", OP_CPOP},
+    {"cpopw", OP_CPOPW},
+    {"sext.b", OP_SEXT_B},
+    {"sext.h", OP_SEXT_H},
+    {"zext.h", OP_ZEXT_H},
+    {"orc.b", OP_ORC_B},
+    {"rev8", OP_REV8},
+    {"zext.w", OP_ADD_UW}};
+
+// Function to read the text up to the delimiter and move past it
+bool readField(string_view instruction, size_t &start, char delimiter, string_view &field)
+{
+    size_t end = instruction.find(delimiter, start);
+    if (end == string_view::npos)
+        return false;
+    field = instruction.substr(start, end - start);
+    start = end + 1;
+    return true;
+}
+
+// Function to skip the space expected after a comma
+bool skipSpace(string_view instruction, size_t &start)
+{
+    if (start >= instruction.length() || instruction[start] != ' ')
+        return false;
+    start++;
+    return true;
+}
+
+// Function to parse a decimal immediate that fits in an int, like stoi would
+bool parseImmediate(string_view immediateStr, ll &value)
+{
+    size_t i = 0;
+    bool negative = false;
+    if (!immediateStr.empty() && immediateStr[0] == '-')
+    {
+        negative = true;
+        i = 1;
+    }
+    if (i == immediateStr.length() || immediateStr.length() - i > 10)
+        return false;
+
+    ll result = 0;
+    for (; i < immediateStr.length(); i++)
+    {
+        if (!isdigit((unsigned char)immediateStr[i]))
+            return false;
+        result = result * 10 + (immediateStr[i] - '0');
+    }
+    value = negative ? -result : result;
+    return value >= -2147483648LL && value <= 2147483647LL;
+}
+
+// Function to split "imm(reg)" into the immediate and base register
+bool splitOffset(string_view operand, ll &immediate, int &baseIndex)
+{
+    size_t openParenPos = operand.find('(');
+    size_t closeParenPos = operand.find(')');
+    if (openParenPos == string_view::npos || closeParenPos == string_view::npos || openParenPos >= closeParenPos)
+        return false;
+    // The "reg(imm)" spelling is left to the text based path
+    if (operand[0] == 'x')
+        return false;
+    if (!parseImmediate(operand.substr(0, openParenPos), immediate) || immediate < -2048 || immediate > 2047)
+        return false;
+    baseIndex = findRegister(operand.substr(openParenPos + 1, closeParenPos - openParenPos - 1));
+    return baseIndex != -1;
+}
+
+// Function to decode one instruction, anything unusual is left as OP_FALLBACK so that
+// runInstruction reports exactly the same errors as before
+DecodedInstruction decodeInstruction(string_view instruction, const unordered_map<string_view, int> &labelAddresses, vector<string_view> &labelNames)
+{
+    DecodedInstruction decoded = {OP_FALLBACK, 0, 0, 0, -1, 0};
+    DecodedInstruction fallback = decoded;
+
+    // sfence.vma and ecall are the only instructions that may come without operands
+    if (instruction == "sfence.vma")
+    {
+        decoded.op = OP_SFENCE_VMA;
+        return decoded;
+    }
+    if (instruction == "ecall")
+    {
+        decoded.op = OP_ECALL;
+        return decoded;
+    }
+
+    size_t start = instruction.find(' ');
+    if (start == string_view::npos)
+        return fallback;
+    auto it = opcodeMap.find(instruction.substr(0, start));
+    if (it == opcodeMap.end())
+        return fallback;
+    Opcode op = it->second;
+    string_view name = instruction.substr(0, start);
+    start++;
+
+    string_view rd, rs1, rs2;
+    ll immediate = 0;
+    int rdIndex = -1, rs1Index = -1, rs2Index = -1;
+
+    if ((op >= OP_CLZ && op <= OP_REV8) || name == "zext.w")
+    {
+        // Zbb unary operations: op rd, rs1, zext.w rd, rs1 is add.uw rd, rs1, x0
+        if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start))
+            return fallback;
+        rs1 = instruction.substr(start);
+        if (rs1.empty() || rs1.find(' ') != string_view::npos)
+            return fallback;
+        rdIndex = findRegister(rd);
+        rs1Index = findRegister(rs1);
+        if (rdIndex == -1 || rs1Index == -1)
+            return fallback;
+    }
+    else if ((op >= OP_ADD && op <= OP_SRA) || (op >= OP_ADD_UW && op <= OP_RORW))
+    {
+        // R format: op rd, rs1, rs2
+        if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start) ||
+            !readField(instruction, start, ',', rs1) || !skipSpace(instruction, start))
+            return fallback;
+        rs2 = instruction.substr(start);
+        if (rs2.empty() || rs2.find(' ') != string_view::npos)
+            return fallback;
+        rdIndex = findRegister(rd);
+        rs1Index = findRegister(rs1);
+        rs2Index = findRegister(rs2);
+        if (rdIndex == -1 || rs1Index == -1 || rs2Index == -1)
+            return fallback;
+    }
+    else if ((op >= OP_ADDI && op <= OP_SRAI) || (op >= OP_SLLI_UW && op <= OP_RORIW))
+    {
+        // I format arithmetic: op rd, rs1, imm
+        if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start) ||
+            !readField(instruction, start, ',', rs1) || !skipSpace(instruction, start))
+            return fallback;
+        size_t end = instruction.find(' ', start);
+        if (!parseImmediate(instruction.substr(start, end - start), immediate) || immediate < -2048 || immediate > 2047)
+            return fallback;
+        if ((op == OP_SLLI || op == OP_SRLI || op == OP_SRAI || op == OP_SLLI_UW || op == OP_RORI) && (immediate < 0 || immediate > 63))
+            return fallback;
+        if (op == OP_RORIW && (immediate < 0 || immediate > 31))
+            return fallback;
+        rdIndex = findRegister(rd);
+        rs1Index = findRegister(rs1);
+        if (rdIndex == -1 || rs1Index == -1)
+            return fallback;
+    }
+    else if ((op >= OP_LB && op <= OP_JALR) || (op >= OP_SB && op <= OP_SD))
+    {
+        // Loads, jalr and stores: op reg, imm(rs1)
+        if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start))
+            return fallback;
+        if (!splitOffset(instruction.substr(start), immediate, rs1Index))
+            return fallback;
+        if (op >= OP_SB)
+        {
+            rs2Index = findRegister(rd);
+            if (rs2Index == -1)
+                return fallback;
+            rdIndex = 0;
+        }
+        else
+        {
+            rdIndex = findRegister(rd);
+            if (rdIndex == -1)
+                return fallback;
+        }
+    }
+    else if (op >= OP_BEQ && op <= OP_BGEU)
+    {
+        // B format: op rs1, rs2, label
+        if (!readField(instruction, start, ',', rs1) || !skipSpace(instruction, start) ||
+            !readField(instruction, start, ',', rs2) || !skipSpace(instruction, start))
+            return fallback;
+        auto label = labelAddresses.find(instruction.substr(start));
+        if (label == labelAddresses.end())
+            return fallback;
+        rs1Index = findRegister(rs1);
+        rs2Index = findRegister(rs2);
+        if (rs1Index == -1 || rs2Index == -1)
+            return fallback;
+        rdIndex = 0;
+        decoded.target = label->second;
+    }
+    else if (op == OP_JAL)
+    {
+        // J format: jal rd, label
+        if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start))
+            return fallback;
+        auto label = labelAddresses.find(instruction.substr(start));
+        if (label == labelAddresses.end())
+            return fallback;
+        rdIndex = findRegister(rd);
+        if (rdIndex == -1)
+            return fallback;
+        decoded.target = label->second;
+        immediate = labelNames.size();
+        labelNames.push_back(label->first);
+    }
+    else if (op >= OP_CSRRW && op <= OP_CSRRCI)
+    {
+        // Zicsr: op rd, csr, rs1 or op rd, csr, uimm. The pseudo-instructions csrr rd, csr
+        // and rdcycle, rdtime and rdinstret rd read without writing, like csrrs with x0
+        string_view csr;
+        if (name.substr(0, 2) == "rd")
+        {
+            rd = instruction.substr(start);
+            csr = name.substr(2);
+            rs1Index = 0;
+        }
+        else if (name == "csrr")
+        {
+            if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start))
+                return fallback;
+            csr = instruction.substr(start);
+            rs1Index = 0;
+        }
+        else
+        {
+            if (!readField(instruction, start, ',', rd) || !skipSpace(instruction, start) ||
+                !readField(instruction, start, ',', csr) || !skipSpace(instruction, start))
+                return fallback;
+            if (op >= OP_CSRRWI)
+            {
+                if (!parseImmediate(instruction.substr(start), immediate) || immediate < 0 || immediate > 31)
+                    return fallback;
+                rs1Index = immediate;
+            }
+            else
+            {
+                rs1Index = findRegister(instruction.substr(start));
+            }
+        }
+        rdIndex = findRegister(rd);
+        immediate = findCsr(csr);
+        if (rdIndex == -1 || rs1Index == -1 || immediate == -1)
+            return fallback;
+    }
+    else if (op == OP_SFENCE_VMA)
+    {
+        // sfence.vma rs1, rs2
+        if (!readField(instruction, start, ',', rs1) || !skipSpace(instruction, start))
+            return fallback;
+        rs1Index = findRegister(rs1);
+        rs2Index = findRegister(instruction.substr(start));
+        if (rs1Index == -1 || rs2Index == -1)
+            return fallback;
+        rdIndex = 0;
+    }
+    else
+    {
+        // U format: lui rd, 0ximm
+        if (!readField(instruction, start, ',', rd))
+            return fallback;
+        start++;
+        if (start + 2 > instruction.length())
+            return fallback;
+        ull immediateValue = (ull)hexToDecimal(string(instruction.substr(start + 2)));
+        if (immediateValue > 1048575)
+            return fallback;
+        rdIndex = findRegister(rd);
+        if (rdIndex == -1)
+            return fallback;
+        immediate = immediateValue;
+    }
+
+    decoded.op = op;
+    decoded.rd = rdIndex;
+    decoded.rs1 = rs1Index == -1 ? 0 : rs1Index;
+    decoded.rs2 = rs2Index == -1 ? 0 : rs2Index;
+    decoded.imm = immediate;
+    return decoded;
+}
+
+// Instructions a thread decodes at least, smaller programs decode on the calling thread
+const size_t decodeRange = 16384;
+
+// Function to decode every instruction of the loaded program, each host thread decodes
+// one range. jal label names are collected per range and appended in program order,
+// so the result is the same as decoding front to back
+void decodeProgram(const vector<string_view> &instructionList, const unordered_map<string_view, int> &labelAddresses,
+                   vector<DecodedInstruction> &decodedProgram, vector<string_view> &labelNames)
+{
+    decodedProgram.resize(instructionList.size());
+    size_t ranges = max<size_t>(1, min(hostThreads(), instructionList.size() / decodeRange));
+    vector<vector<string_view>> rangeNames(ranges);
+    parallelFor(ranges, 1, [&](size_t first, size_t last)
+                {
+                    for (size_t range = first; range < last; range++)
+                    {
+                        size_t end = instructionList.size() * (range + 1) / ranges;
+                        for (size_t i = instructionList.size() * range / ranges; i < end; i++)
+                            decodedProgram[i] = decodeInstruction(instructionList[i], labelAddresses, rangeNames[range]);
+                    }
+                });
+    for (size_t range = 0; range < ranges; range++)
+    {
+        size_t offset = labelNames.size();
+        size_t end = instructionList.size() * (range + 1) / ranges;
+        for (size_t i = instructionList.size() * range / ranges; offset > 0 && i < end; i++)
+        {
+            if (decodedProgram[i].op == OP_JAL)
+                decodedProgram[i].imm += offset;
+        }
+        labelNames.insert(labelNames.end(), rangeNames[range].begin(), rangeNames[range].end());
+    }
+}
+
+// Function to find the fusion of two adjacent instructions, if any
+uint8_t fusionOf(const DecodedInstruction &first, const DecodedInstruction &second)
+{
+    bool secondIsLoad = second.op >= OP_LB && second.op <= OP_LWU;
+    bool secondIsBranch = second.op >= OP_BEQ && second.op <= OP_BGEU;
+
+    if (first.op == OP_LUI && second.op == OP_ADDI && second.rd == first.rd && second.rs1 == first.rd)
+        return FUSE_LUI_ADDI;
+    if (first.op == OP_SLLI && second.op == OP_ADD && (second.rs1 == first.rd || second.rs2 == first.rd))
+        return FUSE_SLLI_ADD;
+    if (first.op == OP_ADDI && secondIsLoad && second.rs1 == first.rd)
+        return FUSE_ADDI_LOAD;
+    if (first.op == OP_ADD && secondIsLoad && second.rs1 == first.rd)
+        return FUSE_ADD_LOAD;
+    if (first.op == OP_ADDI && secondIsBranch && (second.rs1 == first.rd || second.rs2 == first.rd))
+        return FUSE_ADDI_BRANCH;
+    return FUSE_NONE;
+}
+
+// Function to mark the instruction pairs that can run fused. A pair is only fused when
+// nothing but the first instruction can reach the second, so no label may point at it
+void fuseProgram(const vector<DecodedInstruction> &decodedProgram, const unordered_map<string_view, int> &labelAddresses,
+                 vector<uint8_t> &fusion)
+{
+    vector<bool> isTarget(decodedProgram.size() + 1, false);
+    for (auto &label : labelAddresses)
+    {
+        if (label.second >= 0 && label.second < (int)isTarget.size())
+            isTarget[label.second] = true;
+    }
+
+    fusion.assign(decodedProgram.size(), FUSE_NONE);
+    for (size_t i = 0; i + 1 < decodedProgram.size(); i++)
+    {
+        if (!isTarget[i + 1])
+            fusion[i] = fusionOf(decodedProgram[i], decodedProgram[i + 1]);
+        // The second instruction of a pair never starts another one
+        if (fusion[i] != FUSE_NONE)
+            i++;
+    }
+}
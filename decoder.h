@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+typedef long long ll;
+
+// Operations understood by the pre-decoded execution engine
+enum Opcode : uint8_t
+{
+    OP_FALLBACK, // Could not be decoded, executed from its text by runInstruction
+    OP_ADD,
+    OP_SUB,
+    OP_XOR,
+    OP_OR,
+    OP_AND,
+    OP_SLL,
+    OP_SRL,
+    OP_SRA,
+    OP_ADDI,
+    OP_XORI,
+    OP_ORI,
+    OP_ANDI,
+    OP_SLLI,
+    OP_SRLI,
+    OP_SRAI,
+    OP_LB,
+    OP_LH,
+    OP_LW,
+    OP_LD,
+    OP_LBU,
+    OP_LHU,
+    OP_LWU,
+    OP_JALR,
+    OP_SB,
+    OP_SH,
+    OP_SW,
+    OP_SD,
+    OP_BEQ,
+    OP_BNE,
+    OP_BLT,
+    OP_BGE,
+    OP_BLTU,
+    OP_BGEU,
+    OP_JAL,
+    OP_LUI,
+    OP_SFENCE_VMA,
+    OP_ECALL,
+    OP_CSRRW, // The CSR number is in imm
+    OP_CSRRS,
+    OP_CSRRC,
+    OP_CSRRWI, // rs1 holds the 5 bit immediate of the immediate forms
+    OP_CSRRSI,
+    OP_CSRRCI,
+    // Zba and Zbb: op rd, rs1, rs2
+    OP_ADD_UW,
+    OP_SH1ADD,
+    OP_SH2ADD,
+    OP_SH3ADD,
+    OP_SH1ADD_UW,
+    OP_SH2ADD_UW,
+    OP_SH3ADD_UW,
+    OP_ANDN,
+    OP_ORN,
+    OP_XNOR,
+    OP_MAX,
+    OP_MAXU,
+    OP_MIN,
+    OP_MINU,
+    OP_ROL,
+    OP_ROLW,
+    OP_ROR,
+    OP_RORW,
+    // Zba and Zbb: op rd, rs1, shamt
+    OP_SLLI_UW,
+    OP_RORI,
+    OP_RORIW,
+    // Zbb: op rd, rs1
+    OP_CLZ,
+    OP_CLZW,
+    OP_CTZ,
+    OP_CTZW,
+    OP_CPOP,
+    OP_CPOPW,
+    OP_SEXT_B,
+    OP_SEXT_H,
+    OP_ZEXT_H,
+    OP_ORC_B,
+    OP_REV8
+};
+
+// Counter CSRs of Zicntr, readable from user mode
+const int CSR_CYCLE = 0xC00;
+const int CSR_TIME = 0xC01;
+const int CSR_INSTRET = 0xC02;
+
+// Adjacent instruction pairs that run as a single superinstruction
+enum Fusion : uint8_t
+{
+    FUSE_NONE,
+    FUSE_LUI_ADDI,   // lui rd, hi; addi rd, rd, lo
+    FUSE_SLLI_ADD,   // slli t, a, n; add d, b, t
+    FUSE_ADDI_LOAD,  // addi t, a, imm; load d, off(t)
+    FUSE_ADD_LOAD,   // add t, a, b; load d, off(t)
+    FUSE_ADDI_BRANCH // addi t, t, imm; branch on t
+};
+
+// Instruction decoded once at load time so that execution does not parse text
+struct DecodedInstruction
+{
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int32_t target; // Line of the branch/jump target
+    ll imm;         // Immediate value, or index into labelNames for jal
+};
+
+DecodedInstruction decodeInstruction(string_view instruction, const unordered_map<string_view, int> &labelAddresses, vector<string_view> &labelNames);
+void decodeProgram(const vector<string_view> &instructionList, const unordered_map<string_view, int> &labelAddresses,
+                   vector<DecodedInstruction> &decodedProgram, vector<string_view> &labelNames);
+void fuseProgram(const vector<DecodedInstruction> &decodedProgram, const unordered_map<string_view, int> &labelAddresses,
+                 vector<uint8_t> &fusion);
@@ -0,0 +1,153 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "dump.h"
+#include "simulator.h"
+
+using namespace std;
+typedef long long ll;
+
+// Function to check whether the dump should be written as JSON
+bool isJsonDump(const string &file)
+{
+    return file.empty() || file == "-" || (file.size() >= 5 && file.compare(file.size() - 5, 5, ".json") == 0);
+}
+
+// Function to append bytes as lowercase hex
+void appendHexBytes(string &out, const unsigned char *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t position = out.size();
+    out.resize(position + 2 * size);
+    for (size_t i = 0; i < size; i++)
+    {
+        out[position + 2 * i] = digits[data[i] >> 4];
+        out[position + 2 * i + 1] = digits[data[i] & 15];
+    }
+}
+
+// Function to append a 64 bit value as a quoted big-endian hex string
+void appendHexValue(string &out, ull value)
+{
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = value >> (56 - 8 * i);
+    out += "\"0x";
+    appendHexBytes(out, bytes, 8);
+    out += '"';
+}
+
+// Function to send a finished dump to its destination
+bool writeDump(const string &file, const string &contents)
+{
+    if (file.empty() || file == "-")
+    {
+        cout << contents;
+        return true;
+    }
+    ofstream output(file, ios::binary | ios::trunc);
+    if (!output.write(contents.data(), contents.size()))
+    {
+        cerr << "Error: Cannot write " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+// Function to dump x0 to x31 followed by the pc
+bool dumpRegisters(const string &file, const vector<ll> &registers, ull pc)
+{
+    string contents;
+    if (isJsonDump(file))
+    {
+        contents = "{\"pc\":";
+        appendHexValue(contents, pc);
+        contents += ",\"x\":[";
+        for (int i = 0; i < 32; i++)
+        {
+            if (i > 0)
+                contents += ',';
+            appendHexValue(contents, registers[i]);
+        }
+        contents += "]}\n";
+    }
+    else
+    {
+        contents.resize(33 * 8);
+        for (int i = 0; i < 32; i++)
+            memcpy(&contents[8 * i], &registers[i], 8);
+        memcpy(&contents[8 * 32], &pc, 8);
+    }
+    return writeDump(file, contents);
+}
+
+// Function to dump a range of guest virtual memory, translated through the MMU the way
+// a load would be without touching the A bits. Pages are streamed to the output one at
+// a time, untouched ones are written as zeros and are not allocated
+bool dumpMemory(Mmu &mmu, Memory &memory, ull start, ull length, const string &file)
+{
+    if (length > 0 && start + (length - 1) < start)
+    {
+        cerr << "Error: The range runs past the end of the address space" << endl;
+        return false;
+    }
+    bool json = isJsonDump(file);
+    ofstream fileOutput;
+    if (!file.empty() && file != "-")
+    {
+        fileOutput.open(file, ios::binary | ios::trunc);
+        if (!fileOutput)
+        {
+            cerr << "Error: Cannot write " << file << endl;
+            return false;
+        }
+    }
+    ostream &output = fileOutput.is_open() ? fileOutput : cout;
+
+    string contents;
+    if (json)
+    {
+        contents = "{\"start\":";
+        appendHexValue(contents, start);
+        contents += ",\"length\":" + to_string(length) + ",\"data\":\"";
+    }
+
+    static const unsigned char zeroPage[pageSize] = {};
+    ull address = start;
+    ull remaining = length;
+    while (remaining > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        ull chunk = pageSize - offset < remaining ? pageSize - offset : remaining;
+        ull physicalAddress;
+        if (!mmu.translateAddress(address, ACCESS_LOAD, physicalAddress, false))
+        {
+            cerr << "Error: Address 0x" << decimalToHex(address, 16) << " is not mapped" << endl;
+            return false;
+        }
+        const unsigned char *page = memory.pageData(physicalAddress >> pageBits, false);
+        const unsigned char *source = (page ? page : zeroPage) + offset;
+        if (json)
+            appendHexBytes(contents, source, chunk);
+        else
+            contents.append((const char *)source, chunk);
+        if (!output.write(contents.data(), contents.size()))
+        {
+            cerr << "Error: Cannot write " << (file.empty() ? "-" : file) << endl;
+            return false;
+        }
+        contents.clear();
+        address += chunk;
+        remaining -= chunk;
+    }
+
+    if (json)
+        contents += "\"}\n";
+    if (!output.write(contents.data(), contents.size()))
+    {
+        cerr << "Error: Cannot write " << (file.empty() ? "-" : file) << endl;
+        return false;
+    }
+    return true;
+}
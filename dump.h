@@ -0,0 +1,15 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "memory.h"
+#include "mmu.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Dumps go to a file, raw little-endian binary unless the name ends in .json.
+// An empty name or "-" writes JSON to standard output
+bool dumpRegisters(const string &file, const vector<ll> &registers, ull pc);
+bool dumpMemory(Mmu &mmu, Memory &memory, ull start, ull length, const string &file);
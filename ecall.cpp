@@ -0,0 +1,402 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/random.h>
+#include "ecall.h"
+#include "simulator.h"
+
+using namespace std;
+typedef unsigned long long ull;
+
+// Linux system call numbers of the RISC-V ABI
+const ll SYS_READ = 63;
+const ll SYS_WRITE = 64;
+const ll SYS_EXIT = 93;
+const ll SYS_EXIT_GROUP = 94;
+const ll SYS_CLOCK_GETTIME = 113;
+const ll SYS_BRK = 214;
+const ll SYS_GETRANDOM = 278;
+
+const ll ERROR_BADF = -9;
+const ll ERROR_NOSYS = -38;
+
+// Largest transfer of a single read, write or getrandom
+const ull maxTransfer = 1 << 20;
+
+const uint32_t inputLogVersion = 1;
+const char inputLogMagic[8] = {'R', 'V', 'S', 'I', 'M', 'R', 'R', '\0'};
+
+// Fixed header at the start of every record/replay log
+struct InputLogHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t hashLow;
+    uint64_t hashHigh;
+};
+
+// Function to write an unsigned LEB128 number
+void writeVarint(FILE *file, ull value)
+{
+    do
+    {
+        unsigned char byte = value & 0x7F;
+        value >>= 7;
+        fputc(byte | (value ? 0x80 : 0), file);
+    } while (value);
+}
+
+bool readVarint(const vector<unsigned char> &log, size_t &position, ull &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && position < log.size(); shift += 7)
+    {
+        unsigned char byte = log[position++];
+        value |= (ull)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Function to add a live input to the log being recorded and to the captured inputs.
+// Events are stored as kind, line, zigzag encoded result and the data with its length
+void Simulator::logInput(const InputEvent &event)
+{
+    if (recordFile)
+    {
+        fputc(event.kind, recordFile);
+        writeVarint(recordFile, event.line);
+        writeVarint(recordFile, ((ull)event.result << 1) ^ (ull)(event.result >> 63));
+        writeVarint(recordFile, event.data.size());
+        fwrite(event.data.data(), 1, event.data.size(), recordFile);
+    }
+    if (capturing)
+    {
+        inputLog.push_back(event);
+        inputPosition++;
+    }
+}
+
+// Function to stop the program when it no longer consumes the inputs of the log
+void Simulator::stopReplay(int &lineNumber, const string &reason)
+{
+    cerr << "Error: Replay diverged at PC=0x" << decimalToHex((ll)4 * lineNumber, 8) << ", " << reason << endl;
+    stopInputLog();
+    guestExited = true;
+    exitCode = -1;
+    lineNumber = exitLine;
+}
+
+// Function to take the next input from the log, returns false when it has to be read live
+bool Simulator::replayInput(uint8_t kind, int &lineNumber, InputEvent &event, bool &diverged)
+{
+    diverged = false;
+    if (inputPosition < inputLog.size())
+    {
+        const InputEvent &logged = inputLog[inputPosition];
+        if (logged.kind != kind || logged.line != lineNumber)
+        {
+            stopReplay(lineNumber, "the log expects input at PC=0x" + decimalToHex((ll)4 * logged.line, 8));
+            diverged = true;
+            return false;
+        }
+        event = logged;
+        inputPosition++;
+        return true;
+    }
+    if (replaying)
+    {
+        stopReplay(lineNumber, "the log has no more input");
+        diverged = true;
+    }
+    return false;
+}
+
+// Function to check that a guest buffer can be written before any input is consumed
+bool Simulator::guestWritable(ull address, ull size)
+{
+    for (ull offset = 0; offset < size; offset = ((address + offset) | (pageSize - 1)) + 1 - address)
+    {
+        ull physicalAddress;
+        if (!mmu.translateAddress(address + offset, ACCESS_STORE, physicalAddress, false) ||
+            memory.readOnly(physicalAddress >> pageBits))
+        {
+            mmu.raiseFault(address + offset, ACCESS_STORE);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to read one line of standard input, like a terminal does
+void Simulator::readLive(ull count, InputEvent &event)
+{
+    if (pendingInput.empty())
+    {
+        string line;
+        if (readLine ? readLine(line) : (bool)getline(cin, line))
+            pendingInput = line + "\n";
+    }
+    size_t size = min((size_t)count, pendingInput.size());
+    event.data = pendingInput.substr(0, size);
+    event.result = size;
+    pendingInput.erase(0, size);
+}
+
+void readClock(ll clockId, InputEvent &event)
+{
+    timespec now;
+    clock_gettime(clockId == CLOCK_MONOTONIC ? CLOCK_MONOTONIC : CLOCK_REALTIME, &now);
+    ll fields[2] = {(ll)now.tv_sec, (ll)now.tv_nsec};
+    event.data.assign((const char *)fields, sizeof(fields));
+    event.result = 0;
+}
+
+void readRandom(ull count, InputEvent &event)
+{
+    event.data.resize(count);
+    ssize_t size = count ? getrandom(&event.data[0], count, 0) : 0;
+    event.data.resize(size > 0 ? size : 0);
+    event.result = size;
+}
+
+// Function to run a system call that returns nondeterministic data into a guest buffer
+void Simulator::runInputCall(uint8_t kind, int &lineNumber, ull buffer, ull count, ll argument)
+{
+    if (!guestWritable(buffer, count))
+        return;
+    InputEvent event;
+    bool diverged;
+    if (!replayInput(kind, lineNumber, event, diverged))
+    {
+        if (diverged)
+            return;
+        event.kind = kind;
+        event.line = lineNumber;
+        if (kind == INPUT_READ)
+            readLive(count, event);
+        else if (kind == INPUT_CLOCK)
+            readClock(argument, event);
+        else
+            readRandom(count, event);
+        logInput(event);
+    }
+    // One page at a time, a store touches at most two pages
+    for (size_t offset = 0; offset < event.data.size(); offset += pageSize)
+        mmu.writeGuest(buffer + offset, &event.data[offset], min(event.data.size() - offset, (size_t)pageSize));
+    registers[10] = event.result;
+}
+
+// Function to read the time CSR, either cycles divided by cyclesPerTick or the host
+// monotonic clock in 100 ns ticks. Host time is an input and is recorded and replayed
+bool Simulator::readTimer(int &lineNumber, ll &value)
+{
+    if (!hostTimer)
+    {
+        value = (retiredCount + modelledCycles) / cyclesPerTick;
+        return true;
+    }
+    InputEvent event;
+    bool diverged;
+    if (!replayInput(INPUT_TIMER, lineNumber, event, diverged))
+    {
+        if (diverged)
+            return false;
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        event.kind = INPUT_TIMER;
+        event.line = lineNumber;
+        event.result = (ll)now.tv_sec * 10000000 + now.tv_nsec / 100;
+        logInput(event);
+    }
+    value = event.result;
+    return true;
+}
+
+// Function to copy a guest buffer to standard output or error
+void Simulator::runWrite(ll fd, ull buffer, ull count)
+{
+    if (fd != 1 && fd != 2)
+    {
+        registers[10] = ERROR_BADF;
+        return;
+    }
+    string text(count, '\0');
+    for (ull offset = 0; offset < count; offset += pageSize)
+    {
+        if (!mmu.readGuest(buffer + offset, &text[offset], min(count - offset, pageSize)))
+            return;
+    }
+    if (!outputMuted && outputCapture)
+        outputCapture->append(text);
+    else if (!outputMuted)
+        (fd == 1 ? cout : cerr) << text << flush;
+    registers[10] = count;
+}
+
+// Function to run ecall as a Linux system call, a7 holds the number and a0 to a2 the
+// arguments. Inputs from the host are recorded or replayed so that runs can be repeated
+void Simulator::runEcall(int &lineNumber)
+{
+    ll number = registers[17];
+    ll a0 = registers[10];
+    ull a1 = registers[11];
+    ull a2 = registers[12];
+
+    switch (number)
+    {
+    case SYS_READ:
+        if (a0 != 0)
+            registers[10] = ERROR_BADF;
+        else
+            runInputCall(INPUT_READ, lineNumber, a1, min(a2, maxTransfer), 0);
+        break;
+    case SYS_WRITE:
+        runWrite(a0, a1, min(a2, maxTransfer));
+        break;
+    case SYS_EXIT:
+    case SYS_EXIT_GROUP:
+        guestExited = true;
+        exitCode = a0;
+        lineNumber = exitLine;
+        break;
+    case SYS_CLOCK_GETTIME:
+        runInputCall(INPUT_CLOCK, lineNumber, a1, 16, a0);
+        break;
+    case SYS_BRK:
+        // The heap grows from the end of the data section up to the lowest stack address,
+        // other requests only return the current break
+        if ((ull)a0 >= heapStart && (ull)a0 <= stackTop - stackSize)
+            programBreak = a0;
+        registers[10] = programBreak;
+        break;
+    case SYS_GETRANDOM:
+        runInputCall(INPUT_RANDOM, lineNumber, a0, min(a1, maxTransfer), 0);
+        break;
+    default:
+        registers[10] = ERROR_NOSYS;
+        break;
+    }
+}
+
+// Function to start logging every input the program reads from the host
+bool Simulator::startRecording(const string &file)
+{
+    stopInputLog();
+    recordFile = fopen(file.c_str(), "wb");
+    if (!recordFile)
+    {
+        cerr << "Error: Cannot create " << file << endl;
+        return false;
+    }
+    InputLogHeader header = {};
+    memcpy(header.magic, inputLogMagic, sizeof(inputLogMagic));
+    header.version = inputLogVersion;
+    header.hashLow = program->programHash.low;
+    header.hashHigh = program->programHash.high;
+    fwrite(&header, sizeof(header), 1, recordFile);
+    return true;
+}
+
+// Function to load a log so that the program reads exactly the recorded inputs
+bool Simulator::startReplay(const string &file)
+{
+    stopInputLog();
+    FILE *input = fopen(file.c_str(), "rb");
+    if (!input)
+    {
+        cerr << "Error: Cannot open " << file << endl;
+        return false;
+    }
+    vector<unsigned char> log;
+    unsigned char chunk[65536];
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), input)) > 0)
+        log.insert(log.end(), chunk, chunk + size);
+    fclose(input);
+
+    InputLogHeader header;
+    if (log.size() < sizeof(header))
+    {
+        cerr << "Error: " << file << " is not a replay log" << endl;
+        return false;
+    }
+    memcpy(&header, log.data(), sizeof(header));
+    if (memcmp(header.magic, inputLogMagic, sizeof(inputLogMagic)) != 0 || header.version != inputLogVersion)
+    {
+        cerr << "Error: " << file << " is not a replay log" << endl;
+        return false;
+    }
+    if (header.hashLow != program->programHash.low || header.hashHigh != program->programHash.high)
+        cerr << "Warning: " << file << " was recorded with a different program" << endl;
+
+    vector<InputEvent> events;
+    size_t position = sizeof(header);
+    while (position < log.size())
+    {
+        InputEvent event;
+        ull line, result, length;
+        event.kind = log[position++];
+        if (!readVarint(log, position, line) || !readVarint(log, position, result) ||
+            !readVarint(log, position, length) || length > log.size() - position)
+        {
+            cerr << "Error: " << file << " is truncated" << endl;
+            return false;
+        }
+        event.line = line;
+        event.result = (ll)(result >> 1) ^ -(ll)(result & 1);
+        event.data.assign((const char *)log.data() + position, length);
+        position += length;
+        events.push_back(event);
+    }
+    inputLog = move(events);
+    inputPosition = 0;
+    replaying = true;
+    return true;
+}
+
+// Function to finish recording or replaying, inputs captured from the host are kept
+void Simulator::stopInputLog()
+{
+    if (recordFile)
+    {
+        fclose(recordFile);
+        recordFile = nullptr;
+    }
+    if (replaying)
+    {
+        inputLog.clear();
+        inputPosition = 0;
+        replaying = false;
+    }
+}
+
+void Simulator::captureInputs(bool capture)
+{
+    capturing = capture;
+}
+
+size_t Simulator::inputMark()
+{
+    return inputPosition;
+}
+
+void Simulator::rewindInputs(size_t mark)
+{
+    inputPosition = mark;
+}
+
+// Function to drop captured inputs that were consumed and are not needed again
+void Simulator::releaseInputs()
+{
+    if (!replaying)
+    {
+        inputLog.erase(inputLog.begin(), inputLog.begin() + inputPosition);
+        inputPosition = 0;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <climits>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+typedef long long ll;
+
+// Line an exiting program jumps to, past the end of any program
+const int exitLine = INT_MAX - 1;
+
+// Kinds of nondeterministic input kept in a record/replay log
+enum InputKind : uint8_t
+{
+    INPUT_READ = 1,   // Bytes returned by read
+    INPUT_CLOCK = 2,  // Time returned by clock_gettime
+    INPUT_RANDOM = 3, // Bytes returned by getrandom
+    INPUT_TIMER = 4   // Host time read by the time CSR
+};
+
+// One nondeterministic input and the instruction that consumed it
+struct InputEvent
+{
+    uint8_t kind;
+    int line;
+    ll result;
+    string data;
+};
@@ -0,0 +1,1093 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <thread>
+#include "simulator.h"
+#include "locality.h"
+#include "parallel.h"
+#include "profile.h"
+#include "ring.h"
+#include "selfprofile.h"
+#include "timing.h"
+#include "ooo.h"
+
+using namespace std;
+typedef long long ll;
+
+Simulator::Simulator() : registers(32, 0), mmu(memory), program(make_shared<Program>())
+{
+}
+
+Simulator::~Simulator()
+{
+    stopInputLog();
+}
+
+// Function to map a host file into guest memory, see Memory::mapFile
+bool Simulator::mapFile(const string &path, ull address, bool writable)
+{
+    if (!memory.mapFile(path, address, writable))
+        return false;
+    mmu.flushTlb();
+    return true;
+}
+
+// Function to clone this machine. Guest memory is shared copy-on-write and the program
+// is shared as is, so a fork costs a copy of the page map plus every page either of
+// the two machines writes afterwards. The child does not record inputs, but replays
+// the rest of a log that is being replayed
+unique_ptr<Simulator> Simulator::fork()
+{
+    unique_ptr<Simulator> child = make_unique<Simulator>();
+    child->fusionEnabled = fusionEnabled;
+    child->trace = trace;
+    child->checkEnabled = checkEnabled;
+    child->checkInterval = checkInterval;
+    child->readLine = readLine;
+    child->breakpoints = breakpoints;
+    child->atBreak = atBreak;
+    child->registers = registers;
+    child->memory.shareFrom(memory);
+    child->mmu.satp = mmu.satp;
+    child->mmu.privilegeMode = mmu.privilegeMode;
+    child->mmu.statusSum = mmu.statusSum;
+    child->mmu.statusMxr = mmu.statusMxr;
+    child->mmu.watchpoints = mmu.watchpoints;
+    child->mmu.updateWatchedPages();
+    child->currentLine = currentLine;
+    child->funStack = funStack;
+    child->program = program;
+    child->guestExited = guestExited;
+    child->exitCode = exitCode;
+    child->dataStart = dataStart;
+    child->stackTop = stackTop;
+    child->stackSize = stackSize;
+    child->dataAddress = dataAddress;
+    child->heapStart = heapStart;
+    child->programBreak = programBreak;
+    child->retiredCount = retiredCount;
+    child->modelledCycles = modelledCycles;
+    child->hostTimer = hostTimer;
+    child->cyclesPerTick = cyclesPerTick;
+    child->inputLog = vector<InputEvent>(inputLog.begin() + inputPosition, inputLog.end());
+    child->replaying = replaying;
+    child->pendingInput = pendingInput;
+
+    // The store TLB of this machine points straight at pages that are now shared
+    mmu.flushTlb();
+    return child;
+}
+
+ll Simulator::readRegister(int index) const
+{
+    return registers[index];
+}
+
+// Function to set a register, x0 is hardwired to zero
+void Simulator::writeRegister(int index, ll value)
+{
+    if (index != 0)
+        registers[index] = value;
+}
+
+ull Simulator::readPc() const
+{
+    return (ull)currentLine * 4;
+}
+
+void Simulator::writePc(ull pc)
+{
+    currentLine = pc / 4;
+    atBreak = false;
+}
+
+// Function to access guest memory the way the program sees it, without faults or A/D updates
+bool Simulator::accessMemory(ull address, unsigned char *data, size_t size, bool write)
+{
+    while (size > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        size_t chunk = pageSize - offset < size ? pageSize - offset : size;
+        ull physicalAddress;
+        if (!mmu.translateAddress(address, write ? ACCESS_STORE : ACCESS_LOAD, physicalAddress, false))
+            return false;
+        if (write)
+        {
+            memory.copyIn(physicalAddress, data, chunk);
+            mmu.dropStaleEntries();
+        }
+        else
+            memory.copyOut(physicalAddress, data, chunk);
+        address += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool Simulator::readMemory(ull address, void *data, size_t size)
+{
+    return accessMemory(address, (unsigned char *)data, size, false);
+}
+
+bool Simulator::writeMemory(ull address, const void *data, size_t size)
+{
+    return accessMemory(address, (unsigned char *)data, size, true);
+}
+
+// Function to print an executed instruction with its PC
+void Simulator::printExecuted(int line)
+{
+    if (!trace)
+        return;
+    PhaseScope scope(PHASE_OUTPUT);
+    // Convert PC to hexadecimal
+    string PCHex = decimalToHex((ll)4 * line, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        if (isalpha(PCHex[i]))
+            PCHex[i] = tolower(PCHex[i]);
+    }
+    cout << "Executed " << program->instructionList[line] << "; PC=0x" << PCHex << endl;
+}
+
+// Function to stop execution at an instruction whose memory access faulted,
+// it has not been executed and runs again when execution resumes
+void Simulator::stopAtFault(int line)
+{
+    mmu.memoryFault = false;
+    currentLine = line;
+    if (!trace)
+        return;
+    cerr << "Error: " << mmu.describeFault() << endl;
+    cout << "Execution stopped at page fault on line " << line + program->extraLines + 1 << endl;
+}
+
+// Function to report the watched access of the instruction on line, which completed
+void Simulator::stopAtWatch(int line)
+{
+    mmu.watchHit = false;
+    if (!trace)
+        return;
+    const WatchHit &hit = mmu.lastWatch;
+    cout << "Watchpoint " << hit.id << " hit on line " << line + program->extraLines + 1 << " by "
+         << program->instructionList[line] << ": " << (hit.access == ACCESS_LOAD ? "load" : "store") << " of "
+         << hit.size << " bytes at 0x" << decimalToHex(hit.address, 16);
+    if (hit.access == ACCESS_STORE)
+        cout << ", old value 0x" << decimalToHex(hit.oldValue, 16) << ", new value 0x" << decimalToHex(hit.newValue, 16) << endl;
+    else
+        cout << ", value 0x" << decimalToHex(hit.newValue, 16) << endl;
+}
+
+// Function to finish the program once it ran past its last instruction or called exit
+void Simulator::finishProgram()
+{
+    currentLine = program->instructionList.size();
+    deleteStack();
+    if (guestExited)
+    {
+        if (trace)
+            cout << "Program exited with code " << exitCode << endl;
+        guestExited = false;
+    }
+}
+
+// Function to run instructions continuosly, stopping once budget instructions ran
+StopReason Simulator::run(ll budget)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    ll executed = 0;
+    mmu.watchHit = false;
+    for (int i = currentLine; i < program->instructionList.size(); i++)
+    {
+        int j = i;
+
+        if (find(breakpoints.begin(), breakpoints.end(), j) != breakpoints.end())
+        {
+            if (trace)
+                cout << "Execution stopped at breakpoint" << endl;
+            currentLine = i;
+            atBreak = true;
+            return STOP_BREAKPOINT;
+        }
+        // One cheap check covers pause requests and the targets of runUntil and finish
+        if (pauseRequested.load(memory_order_relaxed) || (j == stopLine && executed > 0) || funStack.size() < stopDepth)
+        {
+            currentLine = i;
+            if (pauseRequested.exchange(false))
+            {
+                if (trace)
+                    cout << "Execution paused at line " << i + program->extraLines + 1 << endl;
+                return STOP_PAUSED;
+            }
+            if (trace)
+                cout << "Execution stopped at line " << i + program->extraLines + 1 << endl;
+            return STOP_TARGET;
+        }
+        if (executed >= budget)
+        {
+            currentLine = i;
+            return STOP_BUDGET;
+        }
+        // Run the instruction together with the next one when they were fused, unless
+        // execution has to stop in between them
+        if (fusionEnabled && program->fusion[j] != FUSE_NONE && executed + 2 <= budget && j + 1 != stopLine &&
+            find(breakpoints.begin(), breakpoints.end(), j + 1) == breakpoints.end())
+        {
+            handleStack(i + 2);
+            runFused(program->fusion[j], program->decodedProgram[i], program->decodedProgram[i + 1], j);
+            dispatchCount++;
+            printExecuted(i);
+            // Only the second instruction of a pair can access memory
+            if (mmu.memoryFault)
+            {
+                retiredCount++;
+                stopAtFault(i + 1);
+                return STOP_FAULT;
+            }
+            retiredCount += 2;
+            executed += 2;
+            printExecuted(i + 1);
+            if (mmu.watchHit)
+            {
+                stopAtWatch(i + 1);
+                currentLine = j + 1;
+                return STOP_WATCHPOINT;
+            }
+            i = j;
+            continue;
+        }
+
+        handleStack(i + 1);
+        // Function present in simulator.cpp to run the instruction
+        runDecoded(program->decodedProgram[j], program->instructionList[j], j);
+        dispatchCount++;
+        if (mmu.memoryFault)
+        {
+            stopAtFault(i);
+            return STOP_FAULT;
+        }
+        retiredCount++;
+        executed++;
+        printExecuted(i);
+        if (mmu.watchHit)
+        {
+            stopAtWatch(i);
+            currentLine = j + 1;
+            return STOP_WATCHPOINT;
+        }
+
+        // Update the currentLine if it was changed by a branch/jump instruction
+        i = j;
+    }
+    finishProgram();
+    return STOP_EXITED;
+}
+
+// Function to run until line is about to run again, stopping earlier at breakpoints
+StopReason Simulator::runUntil(int line)
+{
+    stopLine = line;
+    StopReason reason = run();
+    stopLine = -1;
+    return reason;
+}
+
+// Function to run until the function on top of the call stack returns
+StopReason Simulator::finish()
+{
+    // Without a frame to return from there is nothing left to run to
+    if (funStack.empty() || funStack.top().first == "main")
+    {
+        cerr << "Error: Not inside a function" << endl;
+        return STOP_TARGET;
+    }
+    stopDepth = funStack.size();
+    StopReason reason = run();
+    stopDepth = 0;
+    return reason;
+}
+
+Simulator::EngineState Simulator::captureState(bool faulted)
+{
+    return {registers, currentLine, faulted, funStack, retiredCount};
+}
+
+void Simulator::restoreState(const EngineState &state)
+{
+    registers = state.registers;
+    currentLine = state.line;
+    funStack = state.callStack;
+    retiredCount = state.retired;
+}
+
+bool Simulator::isBreakpoint(int line)
+{
+    return find(breakpoints.begin(), breakpoints.end(), line) != breakpoints.end();
+}
+
+// Function to run at least limit instructions with one engine, stopping early at a
+// breakpoint, a fault or the end of the program. The pre-decoded engine fuses pairs
+// like run does, the reference engine interprets the source text one line at a time
+int Simulator::runEngine(bool reference, int limit, vector<int> &executed, bool &faulted, ll &dispatches)
+{
+    int count = 0;
+    faulted = false;
+    while (count < limit && currentLine >= 0 && currentLine < (int)program->instructionList.size() && !isBreakpoint(currentLine))
+    {
+        int i = currentLine;
+        int j = i;
+        dispatches++;
+        if (!reference && fusionEnabled && program->fusion[i] != FUSE_NONE && !isBreakpoint(i + 1))
+        {
+            handleStack(i + 2);
+            runFused(program->fusion[i], program->decodedProgram[i], program->decodedProgram[i + 1], j);
+            executed.push_back(i);
+            count++;
+            retiredCount++;
+            if (mmu.memoryFault)
+            {
+                mmu.memoryFault = false;
+                faulted = true;
+                currentLine = i + 1;
+                break;
+            }
+            executed.push_back(i + 1);
+            count++;
+            retiredCount++;
+        }
+        else
+        {
+            handleStack(i + 1);
+            if (reference)
+                runInstruction(program->instructionList[i], j);
+            else
+                runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+            if (mmu.memoryFault)
+            {
+                mmu.memoryFault = false;
+                faulted = true;
+                break;
+            }
+            executed.push_back(i);
+            count++;
+            retiredCount++;
+        }
+        currentLine = j + 1;
+    }
+    return count;
+}
+
+// Function to find the first byte where the pages written by the two engines differ.
+// testPages holds what the pre-decoded engine left in the pages it wrote, memory holds
+// the result of the reference engine and its journal the contents both started from
+bool Simulator::findMemoryDifference(const unordered_map<ull, unique_ptr<Page>> &testPages, ull &address,
+                                     unsigned char &testByte, unsigned char &referenceByte)
+{
+    static const Page zeroPage = {};
+    bool found = false;
+    auto compare = [&](ull pageNumber, const Page *testPage)
+    {
+        const unsigned char *referencePage = memory.pageData(pageNumber, false);
+        const unsigned char *current = referencePage ? referencePage : zeroPage.bytes;
+        const unsigned char *expected = testPage ? testPage->bytes : zeroPage.bytes;
+        for (ull offset = 0; offset < pageSize; offset++)
+        {
+            ull byteAddress = (pageNumber << pageBits) | offset;
+            if (current[offset] != expected[offset] && (!found || byteAddress < address))
+            {
+                found = true;
+                address = byteAddress;
+                testByte = expected[offset];
+                referenceByte = current[offset];
+                break;
+            }
+        }
+    };
+    for (auto &[pageNumber, page] : testPages)
+        compare(pageNumber, page.get());
+    for (auto &[pageNumber, original] : memory.journaledPages())
+    {
+        if (testPages.find(pageNumber) == testPages.end())
+            compare(pageNumber, original.get());
+    }
+    return found;
+}
+
+// Function to print the instructions both engines were running and where their states differ
+void Simulator::reportDivergence(const EngineState &start, const EngineState &test, const vector<int> &executed,
+                                 bool referenceFault, bool memoryDiffers, ull address, unsigned char testByte, unsigned char referenceByte)
+{
+    int line = executed.empty() ? start.line : executed[0];
+    cout << "Engines diverged at line " << line + program->extraLines + 1 << ": " << program->instructionList[line];
+    if (executed.size() > 1)
+        cout << "; " << program->instructionList[executed[1]] << " (fused)";
+    cout << endl;
+    bool header = false;
+    auto row = [&header](const string &name, ull testValue, ull referenceValue)
+    {
+        if (!header)
+            cout << "     decoded            reference" << endl;
+        header = true;
+        cout << name << string(5 - name.size(), ' ') << "0x" << decimalToHex(testValue, 16)
+             << " 0x" << decimalToHex(referenceValue, 16) << endl;
+    };
+    if (test.line != currentLine)
+        row("pc", (ull)test.line * 4, (ull)currentLine * 4);
+    for (int i = 0; i < 32; i++)
+    {
+        if (test.registers[i] != registers[i])
+            row("x" + to_string(i), test.registers[i], registers[i]);
+    }
+    if (test.faulted != referenceFault)
+        cout << (test.faulted ? "Decoded" : "Reference") << " engine faulted: " << mmu.describeFault() << endl;
+    if (memoryDiffers)
+        cout << "Memory[0x" << decimalToHex(address, 16) << "] = 0x" << decimalToHex(testByte, 2)
+             << " (decoded), 0x" << decimalToHex(referenceByte, 2) << " (reference)" << endl;
+}
+
+// Function to run with both engines, each interval is run by the pre-decoded engine,
+// undone and run again by the string engine before their states are compared. After a
+// mismatch the interval is replayed one step at a time to find the first diverging one
+void Simulator::runChecked()
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    int narrowing = 0; // Instructions left to replay one step at a time
+    memory.startJournal();
+    captureInputs(true);
+    while (true)
+    {
+        if (pauseRequested.load(memory_order_relaxed))
+        {
+            pauseRequested = false;
+            memory.stopJournal();
+            captureInputs(false);
+            mmu.flushTlb();
+            cout << "Execution paused at line " << currentLine + program->extraLines + 1 << endl;
+            return;
+        }
+        // Pages written during the interval have to go through the journal first
+        mmu.flushTlb();
+        EngineState start = captureState(false);
+        vector<int> executed, referenceExecuted;
+        bool testFault, referenceFault;
+        ll dispatches = 0, referenceDispatches = 0;
+        // Output is produced by the reference run, which is fed the inputs the first run read
+        size_t inputStart = inputMark();
+        bool muted = outputMuted;
+        outputMuted = true;
+        int count = runEngine(false, narrowing > 0 ? 1 : checkInterval, executed, testFault, dispatches);
+        outputMuted = muted;
+        if (count == 0 && !testFault)
+            break;
+        EngineState test = captureState(testFault);
+        unordered_map<ull, unique_ptr<Page>> testPages;
+        for (auto &[pageNumber, original] : memory.journaledPages())
+        {
+            unique_ptr<Page> &page = testPages[pageNumber];
+            page = make_unique<Page>();
+            memcpy(page->bytes, memory.pageData(pageNumber, false), pageSize);
+        }
+
+        // Run the same instructions again from the same state with the reference engine
+        memory.rollbackJournal();
+        mmu.flushTlb();
+        restoreState(start);
+        rewindInputs(inputStart);
+        guestExited = false;
+        runEngine(true, testFault ? count + 1 : count, referenceExecuted, referenceFault, referenceDispatches);
+
+        ull address = 0;
+        unsigned char testByte = 0, referenceByte = 0;
+        bool memoryDiffers = findMemoryDifference(testPages, address, testByte, referenceByte);
+        if (memoryDiffers || test.registers != registers || test.line != currentLine || testFault != referenceFault)
+        {
+            if (count > 1 && narrowing == 0)
+            {
+                memory.rollbackJournal();
+                restoreState(start);
+                rewindInputs(inputStart);
+                guestExited = false;
+                narrowing = count;
+                continue;
+            }
+            reportDivergence(start, test, executed, referenceFault, memoryDiffers, address, testByte, referenceByte);
+            memory.stopJournal();
+            captureInputs(false);
+            mmu.flushTlb();
+            cout << "Execution stopped, state is the one of the reference engine" << endl;
+            return;
+        }
+
+        memory.commitJournal();
+        releaseInputs();
+        narrowing = max(narrowing - count, 0);
+        dispatchCount += dispatches;
+        for (int line : referenceExecuted)
+            printExecuted(line);
+        if (referenceFault)
+        {
+            memory.stopJournal();
+            captureInputs(false);
+            stopAtFault(currentLine);
+            return;
+        }
+    }
+    memory.stopJournal();
+    captureInputs(false);
+    mmu.flushTlb();
+
+    if (currentLine >= 0 && currentLine < (int)program->instructionList.size())
+    {
+        cout << "Execution stopped at breakpoint" << endl;
+        atBreak = true;
+        return;
+    }
+    finishProgram();
+}
+
+// Function to run single instruction at a time, returns false when execution stopped
+// at a breakpoint, fault or watchpoint instead of moving on
+bool Simulator::stepInstruction()
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    mmu.watchHit = false;
+    if (currentLine < program->instructionList.size())
+    {
+        // Execute only one instruction
+        int j = currentLine;
+        if (find(breakpoints.begin(), breakpoints.end(), j) != breakpoints.end())
+        {
+            // Case 1 when execution resumes from breakpoint
+            if (atBreak)
+            {
+                atBreak = false;
+            }
+            // Case 2 when execution stops at breakpoint
+            else
+            {
+                cout << "Execution stopped at breakpoint" << endl;
+                atBreak = true;
+                return false;
+            }
+        }
+        handleStack(currentLine + 1);
+        // Function present in simulator.cpp to run the instruction
+        // Stepping always runs a single instruction, even the first one of a fused pair
+        runDecoded(program->decodedProgram[j], program->instructionList[j], j);
+        dispatchCount++;
+        if (mmu.memoryFault)
+        {
+            stopAtFault(currentLine);
+            return false;
+        }
+        retiredCount++;
+        printExecuted(currentLine);
+        bool watched = mmu.watchHit;
+        if (watched)
+            stopAtWatch(currentLine);
+
+        // Increment the current line
+        currentLine = j + 1;
+        if (currentLine >= (int)program->instructionList.size())
+            finishProgram();
+        return !watched;
+    }
+    else
+    {
+        cout << "Nothing to step" << endl;
+        return false;
+    }
+}
+
+// Function to run count instructions, the first one even if execution stopped at
+// its breakpoint, later ones stop at breakpoints as run does
+void Simulator::stepInstructions(ll count)
+{
+    if (stepInstruction() && count > 1 && running())
+        run(count - 1);
+}
+
+// Function to run one instruction without printing it, for debuggers and programs
+// that embed the simulator and report progress themselves
+StepResult Simulator::step()
+{
+    if (currentLine < 0 || currentLine >= (int)program->instructionList.size())
+        return STEP_EXITED;
+    int j = currentLine;
+    handleStack(currentLine + 1);
+    runDecoded(program->decodedProgram[j], program->instructionList[j], j);
+    dispatchCount++;
+    mmu.watchHit = false;
+    if (mmu.memoryFault)
+    {
+        mmu.memoryFault = false;
+        return STEP_FAULT;
+    }
+    retiredCount++;
+    currentLine = j + 1;
+    if (currentLine >= (int)program->instructionList.size())
+    {
+        finishProgram();
+        return STEP_EXITED;
+    }
+    return STEP_OK;
+}
+
+// Function to run up to count instructions as fast as possible, fusing pairs and
+// without printing or stopping at breakpoints. Returns the instructions retired
+ll Simulator::fastForward(ll count)
+{
+    ll executed = 0;
+    while (executed < count && currentLine >= 0 && currentLine < (int)program->instructionList.size())
+    {
+        int i = currentLine;
+        int j = i;
+        if (fusionEnabled && program->fusion[i] != FUSE_NONE && executed + 2 <= count)
+        {
+            handleStack(i + 2);
+            runFused(program->fusion[i], program->decodedProgram[i], program->decodedProgram[i + 1], j);
+            dispatchCount++;
+            if (mmu.memoryFault)
+            {
+                executed++;
+                retiredCount++;
+                currentLine = i + 1;
+                break;
+            }
+            executed += 2;
+            retiredCount += 2;
+        }
+        else
+        {
+            handleStack(i + 1);
+            runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+            dispatchCount++;
+            if (mmu.memoryFault)
+                break;
+            executed++;
+            retiredCount++;
+        }
+        currentLine = j + 1;
+    }
+    return executed;
+}
+
+// Function to run up to count instructions one at a time, feeding each one to the
+// timing models and the block profiler when they are given
+ll Simulator::stepRun(ll count, TimingModel *model, BlockProfiler *profiler, OutOfOrderModel *core)
+{
+    ll executed = 0;
+    while (executed < count && currentLine >= 0 && currentLine < (int)program->instructionList.size())
+    {
+        int i = currentLine;
+        int j = i;
+        // The cycle CSR counts what the models charged, one cycle per instruction without them
+        if (model || core)
+        {
+            RetiredInstruction instruction = describeInstruction(program->decodedProgram[i], i, registers,
+                                                                 funStack.empty() ? nullptr : &funStack.top().first);
+            if (model)
+            {
+                ull cycles = model->stats.cycles;
+                model->execute(instruction);
+                modelledCycles += (ll)(model->stats.cycles - cycles) - 1;
+            }
+            if (core)
+            {
+                ull cycles = core->cycles();
+                core->execute(instruction);
+                modelledCycles += (ll)(core->cycles() - cycles) - 1;
+            }
+        }
+        handleStack(i + 1);
+        runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+        dispatchCount++;
+        if (mmu.memoryFault)
+            break;
+        executed++;
+        retiredCount++;
+        currentLine = j + 1;
+        if (profiler)
+            profiler->retire(i, currentLine);
+    }
+    return executed;
+}
+
+// Function to run up to count instructions one at a time through the in-order model
+// alone. Unlike stepRun it leaves the cycle CSR counting as in functional runs, so the
+// program takes the same path it took when it was run functionally
+ll Simulator::modelRun(ll count, TimingModel &model)
+{
+    ll executed = 0;
+    while (executed < count && running())
+    {
+        int i = currentLine;
+        int j = i;
+        model.execute(describeInstruction(program->decodedProgram[i], i, registers,
+                                          funStack.empty() ? nullptr : &funStack.top().first));
+        handleStack(i + 1);
+        runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+        dispatchCount++;
+        if (mmu.memoryFault)
+            break;
+        executed++;
+        retiredCount++;
+        currentLine = j + 1;
+    }
+    return executed;
+}
+
+bool Simulator::running() const
+{
+    return currentLine >= 0 && currentLine < (int)program->instructionList.size() && !mmu.memoryFault;
+}
+
+// Function to print the mean and confidence interval of a metric sampled per window
+void printSampled(const string &name, const vector<double> &samples, double scale, const string &unit)
+{
+    SampleSummary summary = summarizeSamples(samples);
+    cout << name << ": " << summary.mean * scale << unit << " +- " << summary.halfWidth * scale << unit << endl;
+}
+
+// Function to run the rest of the program sampled: fast-forward with the functional
+// engine, warm up the timing model, measure a window with it, and repeat. Whole
+// program figures are extrapolated from the windows
+void Simulator::sample(ll skip, ll warm, ll measure)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    TimingModel model;
+    vector<double> cpi, dataMissRate, instructionMissRate, mispredictRate;
+    ll total = 0;
+    while (running())
+    {
+        total += fastForward(skip);
+        if (!running())
+            break;
+        total += stepRun(warm, &model, nullptr);
+        if (!running())
+            break;
+        model.clearStats();
+        ll measured = stepRun(measure, &model, nullptr);
+        total += measured;
+        // Only complete windows are used, a partial one at the end would skew the mean
+        if (measured < measure)
+            break;
+        const TimingStats &stats = model.stats;
+        cpi.push_back((double)stats.cycles / stats.instructions);
+        instructionMissRate.push_back((double)stats.instructionMisses / stats.instructions);
+        if (stats.memoryAccesses > 0)
+            dataMissRate.push_back((double)stats.dataMisses / stats.memoryAccesses);
+        if (stats.branches > 0)
+            mispredictRate.push_back((double)stats.mispredictions / stats.branches);
+    }
+
+    if (cpi.empty())
+    {
+        cout << "No complete measurement window in " << total << " instructions" << endl;
+    }
+    else
+    {
+        SampleSummary cpiSummary = summarizeSamples(cpi);
+        cout << "Measured " << cpi.size() << " windows of " << measure << " instructions out of " << total
+             << " (" << 100.0 * cpi.size() * measure / total << "%)" << endl;
+        printSampled("CPI", cpi, 1, "");
+        cout << "Estimated cycles: " << (ll)(cpiSummary.mean * total) << " +- " << (ll)(cpiSummary.halfWidth * total) << endl;
+        printSampled("L1 instruction miss rate", instructionMissRate, 100, "%");
+        printSampled("L1 data miss rate", dataMissRate, 100, "%");
+        printSampled("Branch misprediction rate", mispredictRate, 100, "%");
+        cout << "Intervals are 95% confidence intervals" << endl;
+    }
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else if (!running())
+        finishProgram();
+}
+
+// Function to run the rest of the program through the out-of-order core model and
+// report where its cycles went
+void Simulator::simulateOutOfOrder(const OutOfOrderConfig &config)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    OutOfOrderModel core(config);
+    stepRun(LLONG_MAX, nullptr, nullptr, &core);
+    core.printReport();
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else
+        finishProgram();
+}
+
+// Function to run the rest of the program with the timing models decoupled from the
+// functional engine: this thread runs the program and publishes every instruction into
+// one ring per model, and each model consumes its ring on a thread of its own. The
+// engine runs ahead until a ring fills, so the cycle CSR cannot include the models'
+// cycles and counts one per instruction as in functional runs
+void Simulator::simulateDecoupled(const OutOfOrderConfig &config, size_t ringSize)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    typedef chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    TimingModel model;
+    OutOfOrderModel core(config);
+    SpscRing<RetiredInstruction> modelRing(ringSize), coreRing(ringSize);
+    double modelSeconds = 0, coreSeconds = 0;
+    thread modelThread([&]
+                       {
+                           RetiredInstruction instruction;
+                           while (modelRing.pop(instruction))
+                               model.execute(instruction);
+                           modelSeconds = chrono::duration<double>(Clock::now() - start).count(); });
+    thread coreThread([&]
+                      {
+                          RetiredInstruction instruction;
+                          while (coreRing.pop(instruction))
+                              core.execute(instruction);
+                          coreSeconds = chrono::duration<double>(Clock::now() - start).count(); });
+
+    // Function names live here until the models are done, so records can point at them
+    set<string> functionNames;
+    const string *function = nullptr;
+    ll executed = 0;
+    while (running())
+    {
+        int i = currentLine;
+        int j = i;
+        if (funStack.empty())
+            function = nullptr;
+        else if (!function || *function != funStack.top().first)
+            function = &*functionNames.insert(funStack.top().first).first;
+        RetiredInstruction instruction = describeInstruction(program->decodedProgram[i], i, registers, function);
+        handleStack(i + 1);
+        runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+        dispatchCount++;
+        // A faulting instruction did not retire, so the models never see it
+        if (mmu.memoryFault)
+            break;
+        modelRing.push(instruction);
+        coreRing.push(instruction);
+        executed++;
+        retiredCount++;
+        currentLine = j + 1;
+    }
+    double functionalSeconds = chrono::duration<double>(Clock::now() - start).count();
+    modelRing.close();
+    coreRing.close();
+    modelThread.join();
+    coreThread.join();
+
+    const TimingStats &stats = model.stats;
+    cout << "In-order: instructions: " << stats.instructions << ", cycles: " << stats.cycles << ", CPI: "
+         << (stats.instructions ? (double)stats.cycles / stats.instructions : 0) << endl;
+    cout << "L1 misses: " << stats.instructionMisses << " instruction, " << stats.dataMisses << " data of "
+         << stats.memoryAccesses << " accesses" << endl;
+    cout << "Branches: " << stats.branches << ", mispredicted: " << stats.mispredictions << endl;
+    cout << endl;
+    core.printReport();
+    cout << endl;
+    cout << "Decoupled run of " << executed << " instructions through rings of " << modelRing.capacity() << " entries" << endl;
+    cout << "Functional engine done after " << functionalSeconds << " s, waited on a full ring "
+         << modelRing.producerWaits() + coreRing.producerWaits() << " times" << endl;
+    cout << "In-order model done after " << modelSeconds << " s, waited on an empty ring " << modelRing.consumerWaits()
+         << " times" << endl;
+    cout << "Out-of-order model done after " << coreSeconds << " s, waited on an empty ring " << coreRing.consumerWaits()
+         << " times" << endl;
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else
+        finishProgram();
+}
+
+// Function to run the rest of the program through the in-order model in intervals of
+// length instructions simulated in parallel. A functional pass forks a checkpoint warm
+// instructions before each interval, capturing the inputs the program reads. Each
+// checkpoint then replays those inputs on a host thread, warming the model up before
+// measuring its interval, and the statistics of all intervals are added up
+void Simulator::simulateIntervals(ll length, ll warm)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    typedef chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    struct Interval
+    {
+        unique_ptr<Simulator> checkpoint;
+        ll warm;          // Instructions between the checkpoint and the interval
+        size_t inputMark; // First input the checkpoint reads
+        ll instructions = 0;
+        TimingStats stats = {};
+    };
+    vector<Interval> intervals;
+    captureInputs(true);
+    ll functional = 0;
+    while (running())
+    {
+        ll intervalStart = (ll)intervals.size() * length;
+        if (functional < intervalStart - warm)
+        {
+            functional += fastForward(intervalStart - warm - functional);
+            continue;
+        }
+        unique_ptr<Simulator> checkpoint = fork();
+        checkpoint->trace = false;
+        checkpoint->outputMuted = true;
+        checkpoint->checkEnabled = false;
+        intervals.push_back({move(checkpoint), intervalStart - functional, inputMark()});
+        functional += fastForward(intervalStart + length - warm - functional);
+    }
+    // Checkpoints taken for warming up intervals the program ended before
+    while (!intervals.empty() && (ll)(intervals.size() - 1) * length >= functional)
+        intervals.pop_back();
+    // The inputs each checkpoint reads are only known now, and it reads nothing else
+    for (Interval &interval : intervals)
+    {
+        interval.checkpoint->inputLog.assign(inputLog.begin() + interval.inputMark, inputLog.end());
+        interval.checkpoint->inputPosition = 0;
+        interval.checkpoint->replaying = true;
+    }
+    captureInputs(false);
+    releaseInputs();
+    double functionalSeconds = chrono::duration<double>(Clock::now() - start).count();
+
+    parallelFor(intervals.size(), 1, [&](size_t begin, size_t end)
+                {
+                    for (size_t k = begin; k < end; k++)
+                    {
+                        Interval &interval = intervals[k];
+                        TimingModel model;
+                        interval.checkpoint->modelRun(interval.warm, model);
+                        model.clearStats();
+                        interval.instructions = interval.checkpoint->modelRun(length, model);
+                        interval.stats = model.stats;
+                        interval.checkpoint.reset();
+                    } });
+    double detailedSeconds = chrono::duration<double>(Clock::now() - start).count() - functionalSeconds;
+
+    TimingStats total = {};
+    size_t slowest = 0, fastest = 0;
+    for (size_t k = 0; k < intervals.size(); k++)
+    {
+        const TimingStats &stats = intervals[k].stats;
+        total.instructions += stats.instructions;
+        total.cycles += stats.cycles;
+        total.memoryAccesses += stats.memoryAccesses;
+        total.dataMisses += stats.dataMisses;
+        total.instructionMisses += stats.instructionMisses;
+        total.branches += stats.branches;
+        total.mispredictions += stats.mispredictions;
+        // Comparing CPIs as cycles1 / instructions1 > cycles2 / instructions2 without dividing
+        if (stats.cycles * intervals[slowest].stats.instructions > intervals[slowest].stats.cycles * stats.instructions)
+            slowest = k;
+        if (stats.cycles * intervals[fastest].stats.instructions < intervals[fastest].stats.cycles * stats.instructions)
+            fastest = k;
+    }
+
+    if (total.instructions == 0)
+    {
+        cout << "No instructions to simulate" << endl;
+    }
+    else
+    {
+        cout << "Simulated " << intervals.size() << " intervals of " << length << " instructions with " << warm
+             << " instructions of warm-up each" << endl;
+        cout << "Instructions: " << total.instructions << ", cycles: " << total.cycles << ", CPI: "
+             << (double)total.cycles / total.instructions << endl;
+        cout << "L1 misses: " << total.instructionMisses << " instruction, " << total.dataMisses << " data of "
+             << total.memoryAccesses << " accesses" << endl;
+        cout << "Branches: " << total.branches << ", mispredicted: " << total.mispredictions << endl;
+        cout << "Slowest interval: " << slowest << " (CPI " << (double)intervals[slowest].stats.cycles / intervals[slowest].stats.instructions
+             << "), fastest: " << fastest << " (CPI " << (double)intervals[fastest].stats.cycles / intervals[fastest].stats.instructions
+             << ")" << endl;
+        cout << "Functional pass: " << functionalSeconds << " s, detailed intervals on " << hostThreads() << " threads: "
+             << detailedSeconds << " s" << endl;
+    }
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else
+        finishProgram();
+}
+
+// Function to run the rest of the program measuring the reuse distance of every load
+// and store and the working set of every window of instructions. The working sets are
+// also written to file as CSV unless it is empty
+bool Simulator::analyzeLocality(ll window, const string &file)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    FILE *output = nullptr;
+    if (!file.empty() && !(output = fopen(file.c_str(), "w")))
+    {
+        cerr << "Error: Cannot create " << file << endl;
+        return false;
+    }
+
+    // Accesses are seen by the MMU, so loads and stores run by the string engine and the
+    // buffers of system calls count as well
+    LocalityProfiler profiler(window);
+    mmu.observeAccesses([&](ull address, int size)
+                        { profiler.accessRange(address, size, funStack.empty() ? nullptr : &funStack.top().first); });
+    while (running())
+    {
+        int i = currentLine;
+        int j = i;
+        handleStack(i + 1);
+        runDecoded(program->decodedProgram[i], program->instructionList[i], j);
+        dispatchCount++;
+        // A faulting access never reached memory
+        if (mmu.memoryFault)
+            break;
+        profiler.retire();
+        retiredCount++;
+        currentLine = j + 1;
+    }
+    mmu.observeAccesses(nullptr);
+    profiler.finish();
+    profiler.printReport();
+    if (output)
+    {
+        profiler.writeWorkingSets(output);
+        fclose(output);
+        cout << "Wrote working sets to " << file << endl;
+    }
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else
+        finishProgram();
+    return true;
+}
+
+// Function to run the rest of the program collecting basic block vectors, then pick
+// the intervals that best represent the whole run
+bool Simulator::profileBlocks(ll interval, const string &file, int clusters)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    FILE *output = fopen(file.c_str(), "w");
+    if (!output)
+    {
+        cerr << "Error: Cannot create " << file << endl;
+        return false;
+    }
+
+    BlockProfiler profiler(interval, output);
+    stepRun(LLONG_MAX, nullptr, &profiler);
+    profiler.finish();
+    fclose(output);
+
+    cout << "Wrote " << profiler.intervalCount() << " intervals of " << interval << " instructions to " << file << endl;
+    cout << "Simulation points (interval, weight):" << endl;
+    for (const SimPoint &point : profiler.chooseSimPoints(clusters))
+        cout << point.interval << " " << point.weight << endl;
+
+    if (mmu.memoryFault)
+        stopAtFault(currentLine);
+    else
+        finishProgram();
+    return true;
+}
@@ -0,0 +1,216 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include "fuzz.h"
+
+using namespace std;
+
+// Instructions a case may run before it counts as a hang
+const ll caseBudget = 1000000;
+
+// Values that often hit boundary conditions
+const uint8_t interestingBytes[] = {0, 1, 0x7F, 0x80, 0xFF, '0', '9', 'A', 'z', ' ', '\n', ','};
+
+// Function to map a hit count to one bit, so that only changes of magnitude count as new
+uint8_t countBucket(uint8_t count)
+{
+    if (count <= 3)
+        return count == 3 ? 4 : count;
+    if (count <= 7)
+        return 8;
+    if (count <= 15)
+        return 16;
+    if (count <= 31)
+        return 32;
+    return count <= 127 ? 64 : 128;
+}
+
+Fuzzer::Fuzzer(Simulator &machine, const string &entry, int entryLine, ull inputAddress, size_t maxLength, const string &directory)
+    : inputAddress(inputAddress), maxLength(maxLength), directory(directory), trace(coverageSize), seen(coverageSize), random(1)
+{
+    snapshot = machine.fork();
+    snapshot->trace = false;
+    snapshot->outputMuted = true;
+    snapshot->breakpoints.clear();
+    snapshot->mmu.watchpoints.clear();
+    snapshot->mmu.updateWatchedPages();
+    snapshot->guestExited = false;
+    snapshot->exitCode = 0;
+    snapshot->writePc((ull)entryLine * 4);
+    // Returning from the routine jumps just past the last instruction, which ends the case
+    snapshot->writeRegister(1, (ll)snapshot->program->instructionList.size() * 4);
+    snapshot->funStack.push({entry, entryLine});
+}
+
+// Function to compare the coverage of the last case with everything seen so far
+bool Fuzzer::newCoverage()
+{
+    bool found = false;
+    const uint64_t *words = (const uint64_t *)trace.data();
+    for (int word = 0; word < coverageSize / 8; word++)
+    {
+        // Most of the map is untouched, skip it eight entries at a time
+        if (words[word] == 0)
+            continue;
+        for (int i = word * 8; i < word * 8 + 8; i++)
+        {
+            uint8_t bucket = countBucket(trace[i]);
+            if (bucket & ~seen[i])
+            {
+                edges += seen[i] == 0;
+                seen[i] |= bucket;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+// Function to hash the edges and count buckets of the last case
+ull Fuzzer::pathHash() const
+{
+    ull hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < coverageSize; i++)
+    {
+        if (trace[i])
+            hash = (hash ^ ((ull)i << 8 | countBucket(trace[i]))) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Function to write an input that crashed or hung the routine, once per path, when
+// there is a directory to write it to
+void Fuzzer::saveFinding(const string &kind, const string &input)
+{
+    if (directory.empty() || !findingPaths.insert(pathHash() ^ hash<string>()(kind)).second)
+        return;
+    string file = directory + "/" + kind + "-" + to_string(saved) + ".bin";
+    FILE *output = fopen(file.c_str(), "wb");
+    if (!output)
+    {
+        cerr << "Error: Cannot create " << file << endl;
+        return;
+    }
+    fwrite(input.data(), 1, input.size(), output);
+    fclose(output);
+    saved++;
+}
+
+// Function to run one input from the snapshot and keep it when it found new coverage
+void Fuzzer::runCase(const string &input)
+{
+    unique_ptr<Simulator> machine = snapshot->fork();
+    memset(trace.data(), 0, coverageSize);
+    machine->coverage = trace.data();
+    machine->writeMemory(inputAddress, input.data(), input.size());
+    machine->writeRegister(10, inputAddress);
+    machine->writeRegister(11, input.size());
+    StopReason reason = machine->run(caseBudget);
+    cases++;
+
+    // Inputs that crash or hang are reported rather than mutated further
+    bool found = newCoverage();
+    if (reason == STOP_EXITED && machine->exitCode == 0 && found)
+        corpus.push_back(input);
+    if (reason == STOP_FAULT)
+    {
+        faults++;
+        saveFinding("fault", input);
+    }
+    else if (reason != STOP_EXITED)
+    {
+        hangs++;
+        saveFinding("hang", input);
+    }
+    else if (machine->exitCode != 0)
+    {
+        exits++;
+        saveFinding("exit", input);
+    }
+}
+
+// Function to derive a new input from the corpus with a few stacked random changes
+string Fuzzer::mutate()
+{
+    string input = corpus[random() % corpus.size()];
+    int changes = 1 << (random() % 4);
+    for (int change = 0; change < changes; change++)
+    {
+        size_t size = input.size();
+        size_t position = size ? random() % size : 0;
+        switch (random() % 7)
+        {
+        case 0: // Flip one bit
+            if (size)
+                input[position] ^= 1 << (random() % 8);
+            break;
+        case 1: // Boundary value
+            if (size)
+                input[position] = interestingBytes[random() % sizeof(interestingBytes)];
+            break;
+        case 2: // Small arithmetic
+            if (size)
+                input[position] += (char)(random() % 35) - 17;
+            break;
+        case 3: // Random byte
+            if (size)
+                input[position] = random();
+            break;
+        case 4: // Delete a block
+            if (size)
+                input.erase(position, 1 + random() % min<size_t>(size - position, 16));
+            break;
+        case 5: // Insert random bytes or a copy of a block
+            if (size < maxLength)
+            {
+                size_t length = 1 + random() % min<size_t>(maxLength - size, 16);
+                string block(length, (char)random());
+                if (size && random() % 2)
+                    block = input.substr(random() % size, length);
+                input.insert(position, block);
+            }
+            break;
+        default: // Splice in a block of another input
+        {
+            const string &other = corpus[random() % corpus.size()];
+            if (!other.empty() && size)
+            {
+                size_t start = random() % other.size();
+                size_t length = 1 + random() % min<size_t>(other.size() - start, size - position);
+                input.replace(position, length, other, start, length);
+            }
+            break;
+        }
+        }
+    }
+    if (input.size() > maxLength)
+        input.resize(maxLength);
+    return input;
+}
+
+// Function to run count cases, starting from an empty input and one of zeros
+void Fuzzer::run(ll count)
+{
+    auto start = chrono::steady_clock::now();
+    if (corpus.empty())
+    {
+        runCase("");
+        runCase(string(min<size_t>(maxLength, 16), '\0'));
+        // The corpus must never be empty, even when neither seed found an edge
+        if (corpus.empty())
+            corpus.push_back("");
+    }
+    while (cases < count)
+        runCase(mutate());
+    seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void Fuzzer::printReport() const
+{
+    cout << "Ran " << cases << " cases in " << seconds << " s (" << (ll)(seconds > 0 ? cases / seconds : 0) << " cases/s)" << endl;
+    cout << "Edges: " << edges << ", corpus: " << corpus.size() << " inputs" << endl;
+    cout << "Faults: " << faults << ", hangs: " << hangs << ", non-zero exits: " << exits << endl;
+    if (saved > 0)
+        cout << "Saved " << saved << " findings to " << directory << endl;
+}
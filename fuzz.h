@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "simulator.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Coverage guided fuzzer for one guest routine. Every case runs in a copy-on-write fork
+// of a snapshot taken at the entry label, with the input stored at a fixed guest address
+// and its address and length in a0 and a1. Returning from the routine ends the case.
+// Inputs that reach new control flow edges, or hit known ones a new number of times,
+// are kept and mutated further
+class Fuzzer
+{
+public:
+    Fuzzer(Simulator &machine, const string &entry, int entryLine, ull inputAddress, size_t maxLength, const string &directory);
+    void run(ll count);
+    void printReport() const;
+
+private:
+    void runCase(const string &input);
+    bool newCoverage();
+    ull pathHash() const;
+    string mutate();
+    void saveFinding(const string &kind, const string &input);
+
+    unique_ptr<Simulator> snapshot;
+    ull inputAddress;
+    size_t maxLength;
+    string directory;
+    vector<uint8_t> trace; // Edge hit counts of the case being run
+    vector<uint8_t> seen;  // Hit count buckets reached so far, one bit per bucket
+    vector<string> corpus;
+    unordered_set<ull> findingPaths; // Coverage of the saved findings, one file per path
+    mt19937_64 random;
+
+    ll cases = 0;
+    ll edges = 0;
+    ll faults = 0;
+    ll hangs = 0;
+    ll exits = 0; // Cases that called exit with a non-zero code
+    ll saved = 0;
+    double seconds = 0;
+};
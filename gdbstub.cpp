@@ -0,0 +1,481 @@
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "gdbstub.h"
+#include "simulator.h"
+
+using namespace std;
+typedef long long ll;
+
+// Register layout reported to GDB: x0 to x31 followed by pc
+const char targetXml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<architecture>riscv:rv64</architecture>"
+    "<feature name=\"org.gnu.gdb.riscv.cpu\">"
+    "<reg name=\"zero\" bitsize=\"64\" type=\"int\" regnum=\"0\"/>"
+    "<reg name=\"ra\" bitsize=\"64\" type=\"code_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"64\" type=\"data_ptr\"/>"
+    "<reg name=\"gp\" bitsize=\"64\" type=\"data_ptr\"/>"
+    "<reg name=\"tp\" bitsize=\"64\" type=\"data_ptr\"/>"
+    "<reg name=\"t0\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t1\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t2\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"fp\" bitsize=\"64\" type=\"data_ptr\"/>"
+    "<reg name=\"s1\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a0\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a1\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a2\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a3\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a4\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a5\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a6\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"a7\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s2\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s3\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s4\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s5\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s6\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s7\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s8\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s9\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s10\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"s11\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t3\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t4\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t5\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"t6\" bitsize=\"64\" type=\"int\"/>"
+    "<reg name=\"pc\" bitsize=\"64\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+const char hexDigits[] = "0123456789abcdef";
+
+// Function to append bytes as hex, in memory order
+void appendHex(string &out, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        out += hexDigits[bytes[i] >> 4];
+        out += hexDigits[bytes[i] & 15];
+    }
+}
+
+int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Function to decode hex into bytes, returns false on malformed input
+bool decodeHex(const string &text, size_t start, void *data, size_t size)
+{
+    unsigned char *bytes = (unsigned char *)data;
+    if (start + 2 * size > text.size())
+        return false;
+    for (size_t i = 0; i < size; i++)
+    {
+        int high = hexValue(text[start + 2 * i]);
+        int low = hexValue(text[start + 2 * i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        bytes[i] = high * 16 + low;
+    }
+    return true;
+}
+
+// Function to parse a hex number and move past it
+ull parseHex(const string &text, size_t &position)
+{
+    ull value = 0;
+    while (position < text.size() && hexValue(text[position]) >= 0)
+        value = value * 16 + hexValue(text[position++]);
+    return value;
+}
+
+class GdbConnection
+{
+public:
+    GdbConnection(int fd, Simulator &simulator) : fd(fd), simulator(simulator) {}
+    void serve();
+
+private:
+    bool readPacket(string &packet);
+    void sendPacket(const string &data);
+    string handlePacket(const string &packet, bool &done);
+    string resume(bool singleStep);
+    bool interruptRequested();
+    string readRegister(int index);
+
+    int fd;
+    Simulator &simulator;
+    bool noAck = false;
+    unordered_set<ull> breakpoints;
+    string buffer;
+};
+
+// Function to wait for the next complete packet, answering acks as needed
+bool GdbConnection::readPacket(string &packet)
+{
+    while (true)
+    {
+        size_t start = buffer.find('$');
+        if (start != string::npos)
+        {
+            size_t end = buffer.find('#', start);
+            if (end != string::npos && end + 2 < buffer.size())
+            {
+                // The checksum is the sum of the bytes between '$' and '#' as they were sent
+                unsigned char checksum = 0;
+                for (size_t i = start + 1; i < end; i++)
+                    checksum += buffer[i];
+                string expected = buffer.substr(end + 1, 2);
+                bool intact = isxdigit((unsigned char)expected[0]) && isxdigit((unsigned char)expected[1]) &&
+                              stoul(expected, nullptr, 16) == checksum;
+
+                packet.clear();
+                // Undo the escaping of '}' '#' '$' and '*'
+                for (size_t i = start + 1; i < end; i++)
+                {
+                    if (buffer[i] == '}' && i + 1 < end)
+                        packet += buffer[++i] ^ 0x20;
+                    else
+                        packet += buffer[i];
+                }
+                buffer.erase(0, end + 3);
+                // A damaged packet is dropped, with acks on GDB sends it again after the '-'
+                if (!noAck && send(fd, intact ? "+" : "-", 1, MSG_NOSIGNAL) != 1)
+                    return false;
+                if (intact)
+                    return true;
+                continue;
+            }
+        }
+        else
+        {
+            buffer.clear();
+        }
+
+        char chunk[4096];
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received <= 0)
+            return false;
+        buffer.append(chunk, received);
+    }
+}
+
+void GdbConnection::sendPacket(const string &data)
+{
+    string packet = "$";
+    unsigned char checksum = 0;
+    for (char c : data)
+    {
+        if (c == '$' || c == '#' || c == '}' || c == '*')
+        {
+            packet += '}';
+            checksum += '}';
+            c ^= 0x20;
+        }
+        packet += c;
+        checksum += c;
+    }
+    packet += '#';
+    packet += hexDigits[checksum >> 4];
+    packet += hexDigits[checksum & 15];
+    send(fd, packet.data(), packet.size(), MSG_NOSIGNAL);
+}
+
+// Function to check, without blocking, whether GDB sent a Ctrl-C
+bool GdbConnection::interruptRequested()
+{
+    char chunk[256];
+    ssize_t received = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+    if (received <= 0)
+        return false;
+    buffer.append(chunk, received);
+    size_t interrupt = buffer.find('\x03');
+    if (interrupt == string::npos)
+        return false;
+    buffer.erase(interrupt, 1);
+    return true;
+}
+
+string GdbConnection::readRegister(int index)
+{
+    string out;
+    ull value = index < 32 ? (ull)simulator.readRegister(index) : simulator.readPc();
+    appendHex(out, &value, 8);
+    return out;
+}
+
+// Function to run until a breakpoint, the end of the program, a fault or an interrupt
+string GdbConnection::resume(bool singleStep)
+{
+    for (ull executed = 1;; executed++)
+    {
+        StepResult result = simulator.step();
+        if (result == STEP_EXITED)
+            return "W00";
+        if (result == STEP_FAULT)
+            return "S0b";
+        if (singleStep || breakpoints.count(simulator.readPc()))
+            return "S05";
+        // Polling the socket is a system call, so only do it now and then
+        if ((executed & 0xFFFF) == 0 && interruptRequested())
+            return "S02";
+    }
+}
+
+string GdbConnection::handlePacket(const string &packet, bool &done)
+{
+    char command = packet.empty() ? 0 : packet[0];
+    size_t position = 1;
+
+    switch (command)
+    {
+    case '?':
+        return "S05";
+    case 'g':
+    {
+        string out;
+        for (int i = 0; i <= 32; i++)
+            out += readRegister(i);
+        return out;
+    }
+    case 'G':
+    {
+        for (int i = 0; i < 32; i++)
+        {
+            ull value;
+            if (!decodeHex(packet, 1 + 16 * i, &value, 8))
+                return "E01";
+            simulator.writeRegister(i, value);
+        }
+        ull pc;
+        if (decodeHex(packet, 1 + 16 * 32, &pc, 8))
+            simulator.writePc(pc);
+        return "OK";
+    }
+    case 'p':
+    {
+        ull index = parseHex(packet, position);
+        return index <= 32 ? readRegister(index) : "E01";
+    }
+    case 'P':
+    {
+        ull index = parseHex(packet, position);
+        ull value;
+        if (position >= packet.size() || packet[position] != '=' || !decodeHex(packet, position + 1, &value, 8))
+            return "E01";
+        if (index < 32)
+            simulator.writeRegister(index, value);
+        else if (index == 32)
+            simulator.writePc(value);
+        else
+            return "E01";
+        return "OK";
+    }
+    case 'm':
+    {
+        ull address = parseHex(packet, position);
+        position++;
+        ull length = parseHex(packet, position);
+        if (length > 0x100000)
+            return "E14";
+        vector<unsigned char> data(length);
+        if (!simulator.readMemory(address, data.data(), length))
+            return "E14";
+        string out;
+        appendHex(out, data.data(), length);
+        return out;
+    }
+    case 'M':
+    case 'X':
+    {
+        ull address = parseHex(packet, position);
+        position++;
+        ull length = parseHex(packet, position);
+        if (position >= packet.size() || packet[position] != ':')
+            return "E01";
+        position++;
+        // The packet has to hold the data, two hex digits a byte for M
+        if ((packet.size() - position) / (command == 'M' ? 2 : 1) < length)
+            return "E01";
+        vector<unsigned char> data(length);
+        if (command == 'M' && !decodeHex(packet, position, data.data(), length))
+            return "E01";
+        if (command == 'X')
+            memcpy(data.data(), packet.data() + position, length);
+        return simulator.writeMemory(address, data.data(), length) ? "OK" : "E14";
+    }
+    case 'c':
+    case 's':
+        if (position < packet.size())
+            simulator.writePc(parseHex(packet, position));
+        return resume(command == 's');
+    case 'Z':
+    case 'z':
+    {
+        // Software and hardware breakpoints are handled the same way
+        if (packet.size() < 2 || (packet[1] != '0' && packet[1] != '1'))
+            return "";
+        position = 3;
+        ull address = parseHex(packet, position);
+        if (command == 'Z')
+            breakpoints.insert(address);
+        else
+            breakpoints.erase(address);
+        return "OK";
+    }
+    case 'k':
+        done = true;
+        return "";
+    case 'D':
+        done = true;
+        return "OK";
+    case 'H':
+    case 'T':
+        return "OK";
+    case 'q':
+        if (packet.compare(0, 10, "qSupported") == 0)
+            return "PacketSize=100000;qXfer:features:read+;swbreak+;QStartNoAckMode+";
+        if (packet == "qAttached")
+            return "1";
+        if (packet == "qC")
+            return "QC1";
+        if (packet == "qfThreadInfo")
+            return "m1";
+        if (packet == "qsThreadInfo")
+            return "l";
+        if (packet.compare(0, 31, "qXfer:features:read:target.xml:") == 0)
+        {
+            position = 31;
+            ull offset = parseHex(packet, position);
+            position++;
+            ull length = parseHex(packet, position);
+            ull total = sizeof(targetXml) - 1;
+            if (offset >= total)
+                return "l";
+            string chunk(targetXml + offset, min(length, total - offset));
+            return (offset + chunk.size() < total ? "m" : "l") + chunk;
+        }
+        return "";
+    case 'Q':
+        if (packet == "QStartNoAckMode")
+        {
+            sendPacket("OK");
+            noAck = true;
+            return "";
+        }
+        return "";
+    default:
+        return "";
+    }
+}
+
+void GdbConnection::serve()
+{
+    string packet;
+    bool done = false;
+    while (!done && readPacket(packet))
+    {
+        bool startsNoAck = packet == "QStartNoAckMode";
+        string reply = handlePacket(packet, done);
+        if (!startsNoAck && !(packet == "k"))
+            sendPacket(reply);
+    }
+}
+
+// Function to open the listening socket, a plain number is a TCP port on localhost
+// and anything else is the path of a Unix domain socket
+int listenOn(const string &endpoint, int backlog)
+{
+    bool isPort = !endpoint.empty() && endpoint.find_first_not_of("0123456789") == string::npos;
+    ull port = 0;
+    for (size_t i = 0; isPort && i < endpoint.size() && port <= 65535; i++)
+        port = port * 10 + (endpoint[i] - '0');
+    if (isPort && (port == 0 || port > 65535))
+    {
+        cerr << "Error: Port " << endpoint << " is not between 1 and 65535" << endl;
+        return -1;
+    }
+    int fd = socket(isPort ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int result;
+    if (isPort)
+    {
+        int enable = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        result = bind(fd, (sockaddr *)&address, sizeof(address));
+    }
+    else
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (endpoint.size() >= sizeof(address.sun_path))
+        {
+            close(fd);
+            return -1;
+        }
+        strcpy(address.sun_path, endpoint.c_str());
+        unlink(endpoint.c_str());
+        result = bind(fd, (sockaddr *)&address, sizeof(address));
+    }
+    if (result < 0 || listen(fd, backlog) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to serve one GDB session on the given endpoint until GDB detaches or kills
+bool runGdbServer(const string &endpoint, Simulator &simulator)
+{
+    int listenFd = listenOn(endpoint);
+    if (listenFd < 0)
+    {
+        cerr << "Error: Cannot listen on " << endpoint << endl;
+        return false;
+    }
+    cout << "Waiting for GDB on " << endpoint << endl;
+    int fd = accept(listenFd, nullptr, nullptr);
+    close(listenFd);
+    if (fd < 0)
+    {
+        cerr << "Error: Failed to accept GDB connection" << endl;
+        return false;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    GdbConnection connection(fd, simulator);
+    connection.serve();
+    close(fd);
+    if (endpoint.find_first_not_of("0123456789") != string::npos)
+        unlink(endpoint.c_str());
+    cout << "GDB session ended" << endl;
+    return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+class Simulator;
+
+bool runGdbServer(const string &endpoint, Simulator &simulator);
+int listenOn(const string &endpoint, int backlog = 1);
@@ -0,0 +1,338 @@
+#include <iostream>
+#include <cstring>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "simulator.h"
+#include "cache.h"
+#include "parallel.h"
+#include "selfprofile.h"
+
+using namespace std;
+
+// Function to trim leading and trailing spaces without copying the line
+string_view trimLine(string_view line)
+{
+    size_t first = 0;
+    while (first < line.size() && isspace((unsigned char)line[first]))
+        first++;
+    size_t last = line.size();
+    while (last > first && isspace((unsigned char)line[last - 1]))
+        last--;
+    return line.substr(first, last - first);
+}
+
+// Sources below this size are parsed by the calling thread alone
+const size_t parallelLoadSize = 1 << 20;
+
+// Label or data line of a chunk, handled one after another once all chunks are placed
+struct SourceEvent
+{
+    string_view text;
+    int line; // Instruction a label points at, -1 for a line of the data section
+};
+
+// Piece of the source ending at a line break. Scanning does not know which section the
+// chunk starts in, so lines before its first .data or .text are counted separately
+struct SourceChunk
+{
+    const char *begin;
+    const char *end;
+    int leadingLines = 0;        // Lines before the first section change
+    int leadingInstructions = 0; // Of those, lines holding an instruction
+    int trailingInstructions = 0;
+    int trailingExtraLines = 0; // Section changes and data lines from the first section change on
+    bool switchesSection = false;
+    bool endsInText = true;
+
+    bool startsInText = true;
+    int firstInstruction = 0;
+    vector<SourceEvent> events;
+};
+
+// Function to split a source into chunks of whole lines, one or a few per host thread
+vector<SourceChunk> splitSource(const char *source, size_t size)
+{
+    size_t parts = size < parallelLoadSize ? 1 : hostThreads() * 4;
+    vector<SourceChunk> chunks;
+    const char *begin = source;
+    for (size_t part = 1; part <= parts; part++)
+    {
+        const char *end = source + size * part / parts;
+        if (part < parts && end > begin)
+        {
+            const char *newline = (const char *)memchr(end, '\n', source + size - end);
+            end = newline ? newline + 1 : source + size;
+        }
+        if (end > begin)
+            chunks.push_back({begin, end});
+        begin = max(begin, end);
+    }
+    return chunks;
+}
+
+// Function to read the next line of a chunk that is not empty or a comment, trimmed
+bool nextSourceLine(const char *&cursor, const char *end, string_view &line)
+{
+    while (cursor < end)
+    {
+        const char *newline = (const char *)memchr(cursor, '\n', end - cursor);
+        const char *lineEnd = newline ? newline : end;
+        line = trimLine(string_view(cursor, lineEnd - cursor));
+        cursor = lineEnd + 1;
+        // If the line is empty or a comment, skip it
+        if (!line.empty() && line[0] != ';')
+            return true;
+    }
+    return false;
+}
+
+// Function to split a text line into its label, if any, and its instruction
+string_view splitLabel(string_view line, string_view &label)
+{
+    // Look for labels in the line (format: label:)
+    size_t colon = line.find(':', 1);
+    if (colon == string_view::npos)
+    {
+        label = string_view();
+        return line;
+    }
+    label = line.substr(0, colon);
+    return trimLine(line.substr(colon + 1)); // Remove label from the line
+}
+
+// Function to count the lines, instructions and section changes of a chunk
+void scanChunk(SourceChunk &chunk)
+{
+    const char *cursor = chunk.begin;
+    string_view line, label;
+    bool inTextSection = true;
+    while (nextSourceLine(cursor, chunk.end, line))
+    {
+        // Check for .data or .text sections
+        if (line == ".data" || line == ".text")
+        {
+            chunk.switchesSection = true;
+            inTextSection = line == ".text";
+            chunk.trailingExtraLines++;
+            continue;
+        }
+        bool hasInstruction = !splitLabel(line, label).empty();
+        if (!chunk.switchesSection)
+        {
+            chunk.leadingLines++;
+            chunk.leadingInstructions += hasInstruction;
+        }
+        else if (inTextSection)
+        {
+            chunk.trailingInstructions += hasInstruction;
+        }
+        else
+        {
+            chunk.trailingExtraLines++;
+        }
+    }
+    chunk.endsInText = inTextSection;
+}
+
+// Function to store the instructions of a chunk at their final place and collect its
+// labels and data lines
+void placeChunk(SourceChunk &chunk, vector<string_view> &instructionList)
+{
+    const char *cursor = chunk.begin;
+    string_view line, label;
+    bool inTextSection = chunk.startsInText;
+    int lineNumber = chunk.firstInstruction;
+    while (nextSourceLine(cursor, chunk.end, line))
+    {
+        if (line == ".data" || line == ".text")
+        {
+            inTextSection = line == ".text";
+            continue;
+        }
+        if (!inTextSection)
+        {
+            chunk.events.push_back({line, -1});
+            continue;
+        }
+        string_view instruction = splitLabel(line, label);
+        if (!label.empty())
+            chunk.events.push_back({label, lineNumber});
+        // If the line still has content after removing the label, treats it as an instruction
+        if (!instruction.empty())
+            instructionList[lineNumber++] = instruction;
+    }
+}
+
+void Simulator::handleDataSection(string_view line)
+{
+    // Case where values are on the next line
+    if (!currentDataType.empty())
+    {
+        loadFailed |= !setData(currentDataType, line);
+        currentDataType.clear(); // Reset after processing
+        return;
+    }
+
+    size_t nameEnd = line.find_first_of(" \t");
+    string_view directive = line.substr(0, nameEnd);
+    string_view values = nameEnd == string_view::npos ? string_view() : trimLine(line.substr(nameEnd));
+
+    // Case where data type is encountered alone and its values follow on the next line
+    if (values.empty() && (directive == ".dword" || directive == ".word" || directive == ".half" || directive == ".byte"))
+    {
+        currentDataType = string(directive);
+        return;
+    }
+    loadFailed |= !setData(directive, values);
+}
+
+// Function to release the mapping of the file once no machine runs the program
+Program::~Program()
+{
+    if (mappedFile != nullptr)
+        munmap((void *)mappedFile, mappedSize);
+}
+
+// Function to decode the parsed program and find the pairs that can be fused
+void Simulator::decodeLoadedProgram()
+{
+    PhaseScope scope(PHASE_DECODE);
+    decodeProgram(program->instructionList, program->labelAddresses, program->decodedProgram, program->labelNames);
+    fuseProgram(program->decodedProgram, program->labelAddresses, program->fusion);
+}
+
+// Function to start the heap after the data section and point sp at the top of the stack
+void Simulator::setupLayout()
+{
+    heapStart = (dataAddress + pageSize - 1) & ~(pageSize - 1);
+    programBreak = heapStart;
+    registers[2] = stackTop;
+}
+
+// Function to load file into a simulator that has not loaded one yet, returns false
+// when the file cannot be read. Errors in its contents are reported but still load
+bool Simulator::load(const string &filename)
+{
+    PhaseScope scope(PHASE_PARSE);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "Error opening input file." << endl;
+        return false;
+    }
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) < 0)
+    {
+        cerr << "Error opening input file." << endl;
+        close(fd);
+        return false;
+    }
+
+    // Map the whole file, every line is tokenized in place
+    if (fileInfo.st_size > 0)
+    {
+        void *data = mmap(nullptr, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            cerr << "Error mapping input file." << endl;
+            close(fd);
+            return false;
+        }
+        madvise(data, fileInfo.st_size, MADV_SEQUENTIAL);
+        program->mappedFile = (const char *)data;
+        program->mappedSize = fileInfo.st_size;
+    }
+    close(fd);
+    sourceDirectory = filename.substr(0, filename.rfind('/') + 1);
+    includesFiles = false;
+
+    // Reuse the decoded image of an unchanged file when one was cached before
+    dataAddress = dataStart;
+    bool cached;
+    {
+        PhaseScope cacheScope(PHASE_CACHE);
+        program->programHash = hashContents(program->mappedFile, program->mappedSize);
+        cached = loadProgramCache(program->programHash, program->mappedFile, program->mappedSize, program->decodedProgram,
+                                  program->instructionList, program->labelAddresses, program->labelNames, program->extraLines, memory, dataStart, dataAddress);
+    }
+    if (cached)
+    {
+        PhaseScope decodeScope(PHASE_DECODE);
+        fuseProgram(program->decodedProgram, program->labelAddresses, program->fusion);
+        createStack();
+        setupLayout();
+        return true;
+    }
+    loadFailed = false;
+
+    // First pass, every chunk is scanned on its own thread and counts what it holds
+    vector<SourceChunk> chunks = splitSource(program->mappedFile, program->mappedSize);
+    parallelFor(chunks.size(), 1, [&](size_t first, size_t last)
+                {
+                    for (size_t i = first; i < last; i++)
+                        scanChunk(chunks[i]);
+                });
+
+    // The section and first instruction of a chunk follow from the chunks before it
+    bool inTextSection = true; // Assume starting with text section
+    int lineNumber = 0;
+    for (SourceChunk &chunk : chunks)
+    {
+        chunk.startsInText = inTextSection;
+        chunk.firstInstruction = lineNumber;
+        lineNumber += (inTextSection ? chunk.leadingInstructions : 0) + chunk.trailingInstructions;
+        program->extraLines += (inTextSection ? 0 : chunk.leadingLines) + chunk.trailingExtraLines;
+        if (chunk.switchesSection)
+            inTextSection = chunk.endsInText;
+    }
+
+    // Second pass, chunks store their instructions straight into the final list and
+    // collect their labels and data lines
+    program->instructionList.resize(lineNumber);
+    parallelFor(chunks.size(), 1, [&](size_t first, size_t last)
+                {
+                    for (size_t i = first; i < last; i++)
+                        placeChunk(chunks[i], program->instructionList);
+                });
+
+    // Labels and data in source order, so errors come out in the order of the file
+    bool duplicateLabel = false;
+    for (size_t i = 0; i < chunks.size() && !duplicateLabel; i++)
+    {
+        for (const SourceEvent &event : chunks[i].events)
+        {
+            // Handle data section
+            if (event.line < 0)
+            {
+                handleDataSection(event.text);
+                continue;
+            }
+            string_view label = event.text;
+            if (program->labelAddresses.find(label) != program->labelAddresses.end())
+            {
+                cerr << "Error at line " << event.line + 1 << ". Label " << label
+                     << " already exists at line " << program->labelAddresses[label] + 1 << endl;
+                // The program ends before the line of the duplicate, and is not cached
+                program->instructionList.resize(event.line);
+                loadFailed = true;
+                duplicateLabel = true;
+                break;
+            }
+            // Add the label to the map with the line number
+            program->labelAddresses[label] = event.line;
+        }
+    }
+    decodeLoadedProgram();
+    if (!loadFailed && !includesFiles)
+    {
+        PhaseScope cacheScope(PHASE_CACHE);
+        saveProgramCache(program->programHash, program->mappedFile, program->mappedSize, program->decodedProgram,
+                         program->instructionList, program->labelAddresses, program->labelNames, program->extraLines, memory, dataStart, dataAddress);
+    }
+    createStack();
+    setupLayout();
+    return true;
+}
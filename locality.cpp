@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include "locality.h"
+
+using namespace std;
+
+// Fenwick tree positions to start with, it grows to twice the lines in use when full
+const ull initialTimes = 1 << 20;
+
+LocalityProfiler::LocalityProfiler(ll window, int lineSize) : window(window), lineShift(__builtin_ctz(lineSize)), tree(initialTimes + 1, 0)
+{
+}
+
+void LocalityProfiler::mark(ull time, ll delta)
+{
+    for (ull i = time + 1; i < tree.size(); i += i & -i)
+        tree[i] += delta;
+}
+
+// Function to count the lines whose latest access came before time
+ull LocalityProfiler::marksBefore(ull time) const
+{
+    ll sum = 0;
+    for (ull i = time; i > 0; i -= i & -i)
+        sum += tree[i];
+    return sum;
+}
+
+// Function to renumber the latest accesses 0, 1, 2... in order once every time is used,
+// so the tree only ever needs room for the lines in use and not for every access
+void LocalityProfiler::compact()
+{
+    vector<pair<ull, LineState *>> latest;
+    latest.reserve(lineStates.size());
+    for (auto &[line, state] : lineStates)
+        latest.push_back({state.time, &state});
+    sort(latest.begin(), latest.end(), [](const pair<ull, LineState *> &a, const pair<ull, LineState *> &b)
+         { return a.first < b.first; });
+    for (size_t i = 0; i < latest.size(); i++)
+        latest[i].second->time = i;
+
+    // Position i of a tree over n ones counts those in (i - (i & -i), i]
+    ull n = latest.size();
+    tree.assign(max(initialTimes, 2 * n) + 1, 0);
+    for (ull i = 1; i < tree.size(); i++)
+        tree[i] = i - (i & -i) < n ? min(i, n) - (i - (i & -i)) : 0;
+    now = latest.size();
+}
+
+FunctionLocality &LocalityProfiler::functionLocality(const string *function)
+{
+    static const string noFunction;
+    const string &name = function ? *function : noFunction;
+    if (!lastFunction || *lastFunction != name)
+    {
+        lastLocality = &functions[name];
+        lastFunction = &functions.find(name)->first;
+    }
+    return *lastLocality;
+}
+
+// Function to count one load or store
+void LocalityProfiler::access(ull address, const string *function)
+{
+    if (now + 1 >= tree.size())
+        compact();
+    ull line = address >> lineShift;
+    FunctionLocality &locality = functionLocality(function);
+    locality.accesses++;
+    locality.lines.insert(line);
+    accesses++;
+
+    auto [entry, inserted] = lineStates.try_emplace(line, LineState{now, currentWindow});
+    if (inserted)
+    {
+        coldAccesses++;
+        locality.coldAccesses++;
+        windowLines++;
+    }
+    else
+    {
+        LineState &state = entry->second;
+        // Lines touched after the previous access to this one, each is marked once
+        ull distance = lineStates.size() - marksBefore(state.time + 1);
+        int bucket = distance == 0 ? 0 : 64 - __builtin_clzll(distance);
+        histogram[bucket]++;
+        locality.histogram[bucket]++;
+        mark(state.time, -1);
+        state.time = now;
+        if (state.window != currentWindow)
+        {
+            state.window = currentWindow;
+            windowLines++;
+        }
+    }
+    mark(now++, 1);
+}
+
+// Function to count an access of size bytes once for every line it touches
+void LocalityProfiler::accessRange(ull address, int size, const string *function)
+{
+    ull lines = (((address & ((1ULL << lineShift) - 1)) + size - 1) >> lineShift) + 1;
+    for (ull i = 0; i < lines; i++)
+        access(address + (i << lineShift), function);
+}
+
+// Function to count one retired instruction, ending the window when it is full
+void LocalityProfiler::retire()
+{
+    if (++executed == window)
+    {
+        workingSets.push_back(windowLines);
+        windowLines = 0;
+        executed = 0;
+        currentWindow++;
+    }
+}
+
+// Function to close the last, shorter window
+void LocalityProfiler::finish()
+{
+    if (executed > 0)
+        workingSets.push_back(windowLines);
+    executed = 0;
+}
+
+// Function to format a size in bytes with a binary unit
+string formatSize(ull bytes)
+{
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (unit < 4 && bytes >= 1024 && bytes % 1024 == 0)
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    return to_string(bytes) + " " + units[unit];
+}
+
+// Function to count the accesses that miss a fully associative LRU cache of 2^k lines,
+// those with a distance of at least 2^k, in buckets above k, and cold ones
+ull missesAtSize(const ull *histogram, ull coldAccesses, int k)
+{
+    ull misses = coldAccesses;
+    for (int bucket = k + 1; bucket < reuseBuckets; bucket++)
+        misses += histogram[bucket];
+    return misses;
+}
+
+void LocalityProfiler::printReport() const
+{
+    int lineSize = 1 << lineShift;
+    cout << "Accesses: " << accesses << ", lines touched: " << lineStates.size() << " ("
+         << formatSize(lineStates.size() * lineSize) << "), line size " << lineSize << " B" << endl;
+    if (accesses == 0)
+        return;
+
+    int lastBucket = 0;
+    for (int bucket = 0; bucket < reuseBuckets; bucket++)
+        if (histogram[bucket])
+            lastBucket = bucket;
+
+    cout << fixed << setprecision(3);
+    cout << "Reuse distance (lines):" << endl;
+    cout << setw(24) << "cold" << setw(14) << coldAccesses << setw(9) << 100.0 * coldAccesses / accesses << "%" << endl;
+    for (int bucket = 0; bucket <= lastBucket; bucket++)
+    {
+        ull low = bucket == 0 ? 0 : 1ULL << (bucket - 1), high = bucket == 0 ? 0 : (1ULL << (bucket - 1)) * 2 - 1;
+        string range = low == high ? to_string(low) : to_string(low) + "-" + to_string(high);
+        cout << setw(24) << range << setw(14) << histogram[bucket] << setw(9) << 100.0 * histogram[bucket] / accesses
+             << "%" << endl;
+    }
+
+    // Beyond the largest distance only cold misses are left
+    cout << "Miss rate of a fully associative LRU cache:" << endl;
+    for (int k = 0; k <= lastBucket; k++)
+    {
+        ull misses = missesAtSize(histogram, coldAccesses, k);
+        cout << setw(24) << formatSize((ull)lineSize << k) << setw(14) << misses << setw(9) << 100.0 * misses / accesses
+             << "%" << endl;
+    }
+
+    if (!workingSets.empty())
+    {
+        ull smallest = *min_element(workingSets.begin(), workingSets.end());
+        ull largest = *max_element(workingSets.begin(), workingSets.end());
+        double mean = 0;
+        for (ull lines : workingSets)
+            mean += lines;
+        mean /= workingSets.size();
+        cout << "Working set over " << workingSets.size() << " windows of " << window << " instructions: min "
+             << smallest << ", mean " << mean << ", max " << largest << " lines" << endl;
+    }
+
+    // Functions that made the most accesses first, with miss rates at the modelled L1 and L2 sizes
+    const int firstLevel = __builtin_ctz((32 << 10) / lineSize), secondLevel = __builtin_ctz((256 << 10) / lineSize);
+    vector<pair<string, const FunctionLocality *>> sorted;
+    for (const auto &[name, locality] : functions)
+        sorted.push_back({name, &locality});
+    sort(sorted.begin(), sorted.end(), [](const pair<string, const FunctionLocality *> &a, const pair<string, const FunctionLocality *> &b)
+         { return a.second->accesses != b.second->accesses ? a.second->accesses > b.second->accesses : a.first < b.first; });
+    cout << left << setw(24) << "Function" << right << setw(14) << "Accesses" << setw(14) << "Footprint" << setw(10)
+         << "Cold" << setw(12) << "32 KiB" << setw(12) << "256 KiB" << endl;
+    for (const auto &[name, locality] : sorted)
+    {
+        cout << left << setw(24) << (name.empty() ? "(no function)" : name) << right << setw(14) << locality->accesses
+             << setw(14) << formatSize(locality->lines.size() * lineSize) << setw(10) << locality->coldAccesses
+             << setw(11) << 100.0 * missesAtSize(locality->histogram, locality->coldAccesses, firstLevel) / locality->accesses
+             << "%" << setw(11) << 100.0 * missesAtSize(locality->histogram, locality->coldAccesses, secondLevel) / locality->accesses
+             << "%" << endl;
+    }
+    cout << defaultfloat << setprecision(6);
+}
+
+// Function to write the working set of every window as CSV
+void LocalityProfiler::writeWorkingSets(FILE *output) const
+{
+    fprintf(output, "window,first instruction,lines,bytes\n");
+    for (size_t i = 0; i < workingSets.size(); i++)
+        fprintf(output, "%zu,%llu,%llu,%llu\n", i, (ull)i * window, workingSets[i], workingSets[i] << lineShift);
+}
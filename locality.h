@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Reuse distances are counted in power of two buckets: bucket 0 holds distance 0 and
+// bucket b distances from 2^(b-1) to 2^b - 1
+const int reuseBuckets = 65;
+
+// Locality of the accesses made while one guest function was on top of the call stack
+struct FunctionLocality
+{
+    ull accesses = 0;
+    ull coldAccesses = 0; // First touches of a line in the whole run
+    ull histogram[reuseBuckets] = {};
+    unordered_set<ull> lines; // Lines it touched
+};
+
+// Measures the LRU stack distance of every load and store at cache line granularity:
+// the number of distinct lines touched since the last access to the same line. An
+// access hits in a fully associative LRU cache of C lines exactly when its distance is
+// below C, so one histogram gives the miss rate of every cache size. Distances come from
+// a Fenwick tree over access times that marks the latest access to each line
+class LocalityProfiler
+{
+public:
+    LocalityProfiler(ll window, int lineSize = 64);
+    void access(ull address, const string *function);
+    void accessRange(ull address, int size, const string *function);
+    void retire();
+    void finish();
+    void printReport() const;
+    void writeWorkingSets(FILE *output) const;
+    ull coldCount() const { return coldAccesses; }
+    ull reuseCount(int bucket) const { return histogram[bucket]; }
+
+private:
+    struct LineState
+    {
+        ull time;   // Latest access, a position in the Fenwick tree
+        ull window; // Latest window it was touched in
+    };
+
+    void mark(ull time, ll delta);
+    ull marksBefore(ull time) const;
+    void compact();
+    FunctionLocality &functionLocality(const string *function);
+
+    ll window;
+    int lineShift;
+    vector<ll> tree; // Fenwick tree over access times, 1 where a line was last accessed
+    ull now = 0;     // Time of the next access
+    unordered_map<ull, LineState> lineStates;
+
+    ull accesses = 0;
+    ull coldAccesses = 0;
+    ull histogram[reuseBuckets] = {};
+
+    // Working set, the distinct lines touched in each window of instructions
+    ll executed = 0;
+    ull currentWindow = 0;
+    ull windowLines = 0;
+    vector<ull> workingSets;
+
+    unordered_map<string, FunctionLocality> functions;
+    const string *lastFunction = nullptr;
+    FunctionLocality *lastLocality = nullptr;
+};
@@ -1,423 +1,885 @@
 #include <iostream>
-#include <fstream>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include <algorithm>
-#include <bitset>
+#include <cstdio>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <csignal>
+#include <climits>
+#include <sstream>
 #include "simulator.h" // Header file for simulator functions
+#include "gdbstub.h"
+#include "dump.h"
+#include "fuzz.h"
+#include "ooo.h"
+#include "parallel.h"
+#include "server.h"
+#include "selfprofile.h"
 
 using namespace std;
 typedef long long ll;
 
-unordered_map<string, int> labelAddresses; // Store labels and their line numbers
-vector<string> instructionList; // Store instructions
-int currentLine = 0; // Global variable to track the current instruction line
-vector<int> breakpoints;
-bool atBreak = false; // To check if to stop at breakpoint or start executing from it
-vector<string> dataValues; // Values in .data section
-int extraLines = 0;
+vector<unique_ptr<Simulator>> machines; // The loaded machine followed by its forks
+Simulator *simulator = nullptr;         // Machine the commands act on
+bool loaded = false;
 
-// Function to split data values
-vector<string> splitValues(const string &values)
+// Standard input is read on its own thread, so that pause can stop a running program.
+// Every other line waits in inputLines for the command loop or for the program to read it
+mutex inputMutex;
+condition_variable inputReady;
+deque<string> inputLines;
+bool inputClosed = false;
+atomic<Simulator *> runningMachine{nullptr}; // Machine pause and Ctrl-C stop, while it runs
+
+// Function to read standard input until it ends, pausing the running program on pause
+void readInput()
 {
-    vector<string> result;
-    string currentValue;
-    // Loop through the characters in the string
-    for (char c : values)
+    string line;
+    while (getline(cin, line))
     {
-        // If we encounter a comma or space, add the current value to the result
-        if (c == ',' || c == ' ')
+        lock_guard<mutex> lock(inputMutex);
+        Simulator *machine = runningMachine;
+        if (machine != nullptr && line == "pause")
         {
-            if (!currentValue.empty())
-            {
-                result.push_back(currentValue);
-                currentValue = ""; // Reset currentValue for the next entry
-            }
-        }
-        else
-        {
-            // Add the character to the current value
-            currentValue += c;
+            machine->pauseRequested = true;
+            continue;
         }
+        inputLines.push_back(line);
+        inputReady.notify_one();
     }
+    lock_guard<mutex> lock(inputMutex);
+    inputClosed = true;
+    inputReady.notify_one();
+}
 
-    // Add the last value if there's any
-    if (currentValue.length() > 0)
+// Function to take the next line of standard input, returns false once it ended
+bool nextLine(string &line)
+{
+    unique_lock<mutex> lock(inputMutex);
+    inputReady.wait(lock, []
+                    { return !inputLines.empty() || inputClosed; });
+    if (inputLines.empty())
+        return false;
+    line = move(inputLines.front());
+    inputLines.pop_front();
+    return true;
+}
+
+// Function to pause the running program on Ctrl-C, which quits as usual otherwise
+void interruptHandler(int signal)
+{
+    Simulator *machine = runningMachine;
+    if (machine == nullptr)
     {
-        result.push_back(currentValue);
+        std::signal(signal, SIG_DFL);
+        raise(signal);
+        return;
     }
+    machine->pauseRequested = true;
+}
 
-    return result;
+// Function to run an execution command that pause and Ctrl-C can stop
+void runControlled(const function<void()> &execute)
+{
+    {
+        lock_guard<mutex> lock(inputMutex);
+        simulator->pauseRequested = false;
+        runningMachine = simulator;
+    }
+    execute();
+    lock_guard<mutex> lock(inputMutex);
+    runningMachine = nullptr;
 }
 
-// Function to run instructions continuosly
-void executeInstruction(string filename)
+// Function to parse a whole decimal or 0x prefixed hex argument, false when it is not one
+bool parseNumber(const string &text, ull &value)
 {
-    for (int i = currentLine; i < instructionList.size(); i++)
+    try
     {
-        int j = i;
+        size_t used = 0;
+        value = stoull(text, &used, 0);
+        return used == text.size();
+    }
+    catch (const exception &)
+    {
+        return false;
+    }
+}
 
-        if (find(breakpoints.begin(), breakpoints.end(), j) != breakpoints.end())
+// Function to handle the vm command, which controls address translation
+void vmCommand(const string &arguments)
+{
+    Mmu &mmu = simulator->mmu;
+    if (arguments.empty())
+    {
+        const char *modes[] = {"u", "s", "", "m"};
+        cout << "satp = 0x" << decimalToHex(mmu.satp, 16) << " (" << ((mmu.satp >> 60) == satpModeSv39 ? "Sv39" : "bare") << ")" << endl;
+        cout << "priv = " << modes[mmu.privilegeMode] << ", sum = " << mmu.statusSum << ", mxr = " << mmu.statusMxr << endl;
+    }
+    else if (arguments.substr(0, 5) == "satp ")
+    {
+        ull satp = 0;
+        if (!parseNumber(arguments.substr(5), satp))
         {
-            cout << "Execution stopped at breakpoint" << endl;
-            currentLine = i;
-            atBreak = true;
+            cerr << "Error: Invalid satp value " << arguments.substr(5) << endl;
             return;
         }
-        handleStack(labelAddresses, i + 1);
-        // Function present in simulator.cpp to run the instruction
-        runInstruction(instructionList[j], j, labelAddresses);
-
-        // Convert PC to hexadecimal
-        string PCHex = decimalToHex((ll)4 * i, 8);
-        for (int i = 0; i < 8; i++)
+        mmu.satp = satp;
+        mmu.flushTlb();
+    }
+    else if (arguments == "priv u" || arguments == "priv s" || arguments == "priv m")
+    {
+        mmu.privilegeMode = arguments[5] == 'u' ? PRIV_U : arguments[5] == 's' ? PRIV_S : PRIV_M;
+        mmu.flushTlb();
+    }
+    else if (arguments == "sum on" || arguments == "sum off")
+    {
+        mmu.statusSum = arguments == "sum on";
+        mmu.flushTlb();
+    }
+    else if (arguments == "mxr on" || arguments == "mxr off")
+    {
+        mmu.statusMxr = arguments == "mxr on";
+        mmu.flushTlb();
+    }
+    else if (arguments.substr(0, 10) == "translate ")
+    {
+        ull address = 0;
+        if (!parseNumber(arguments.substr(10), address))
         {
-            if (isalpha(PCHex[i]))
-                PCHex[i] = tolower(PCHex[i]);
+            cerr << "Error: Invalid address " << arguments.substr(10) << endl;
+            return;
         }
-        cout << "Executed " << instructionList[i] << "; PC=0x" << PCHex << endl;
+        cout << mmu.describeTranslation(address) << endl;
+    }
+    else
+    {
+        cerr << "Usage: vm [satp <value> | priv u|s|m | sum on|off | mxr on|off | translate <address>]" << endl;
+    }
+    cout << endl;
+}
 
-        // Update the currentLine if it was changed by a branch/jump instruction
-        i = j;
+// Function to handle watch, rwatch and awatch, which stop execution after an
+// instruction writes, reads or accesses any byte of a range
+void watchCommand(int kind, const string &arguments)
+{
+    char start[32], length[32] = "8";
+    ull address = 0, size = 0;
+    if (sscanf(arguments.c_str(), "%31s %31s", start, length) < 1 || !parseNumber(start, address) ||
+        !parseNumber(length, size) || size == 0)
+    {
+        cerr << "Usage: watch|rwatch|awatch <address> [<length>]" << endl;
+        return;
+    }
+    if (address + (size - 1) < address)
+    {
+        cerr << "Error: The range runs past the end of the address space" << endl;
+        return;
     }
-    currentLine = instructionList.size();
-    deleteStack();
+    vector<Watchpoint> &watchpoints = simulator->mmu.watchpoints;
+    int id = watchpoints.empty() ? 1 : watchpoints.back().id + 1;
+    watchpoints.push_back({id, address, size, kind});
+    simulator->mmu.updateWatchedPages();
+    cout << "Watchpoint " << id << " set on " << watchpoints.back().length << " bytes at 0x"
+         << decimalToHex(watchpoints.back().start, 16) << endl;
+    cout << endl;
 }
 
-// Function to run single instruction at a time
-void stepInstruction()
+// Function to move the data section or the stack, which takes effect on the next load
+void layoutCommand(const string &arguments)
 {
-    if (currentLine < instructionList.size())
+    char region[16], start[32], size[32] = "";
+    int fields = sscanf(arguments.c_str(), "%15s %31s %31s", region, start, size);
+    ull address = 0, stackSize = simulator->stackSize;
+    bool valid = fields >= 2 && parseNumber(start, address) && (fields < 3 || parseNumber(size, stackSize));
+    if (valid && string(region) == "data")
     {
-        // Execute only one instruction
-        int j = currentLine;
-        if (find(breakpoints.begin(), breakpoints.end(), j) != breakpoints.end())
-        {
-            // Case 1 when execution resumes from breakpoint
-            if (atBreak)
-            {
-                atBreak = false;
-            }
-            // Case 2 when execution stops at breakpoint
-            else
-            {
-                cout << "Execution stopped at breakpoint" << endl;
-                atBreak = true;
-                return;
-            }
-        }
-        handleStack(labelAddresses, currentLine + 1);
-        // Function present in simulator.cpp to run the instruction
-        runInstruction(instructionList[j], j, labelAddresses);
+        simulator->dataStart = address;
+    }
+    else if (valid && string(region) == "stack")
+    {
+        simulator->stackTop = address;
+        simulator->stackSize = stackSize;
+    }
+    else
+    {
+        cerr << "Usage: layout data <address> | layout stack <top> [<size>]" << endl;
+        return;
+    }
+    cout << "Layout changed, load the program again to use it" << endl;
+    cout << endl;
+}
 
-        // Convert PC to hexadecimal
-        string PCHex = decimalToHex((ll)4 * currentLine, 8);
-        for (int i = 0; i < 8; i++)
-        {
-            if (isalpha(PCHex[i]))
-                PCHex[i] = tolower(PCHex[i]);
-        }
+// Function to choose what the time CSR counts, host time or cycles
+void timerCommand(const string &arguments)
+{
+    char source[16] = "";
+    ll cyclesPerTick = simulator->cyclesPerTick;
+    int fields = sscanf(arguments.c_str(), "%15s %lld", source, &cyclesPerTick);
+    if (fields == 1 && string(source) == "host")
+    {
+        simulator->hostTimer = true;
+        cout << "time counts host time in 100 ns ticks" << endl;
+    }
+    else if (fields >= 1 && string(source) == "cycles" && cyclesPerTick > 0)
+    {
+        simulator->hostTimer = false;
+        simulator->cyclesPerTick = cyclesPerTick;
+        cout << "time counts one tick every " << cyclesPerTick << " cycles" << endl;
+    }
+    else
+    {
+        cerr << "Usage: timer host | timer cycles [<cycles-per-tick>]" << endl;
+        return;
+    }
+    cout << endl;
+}
+
+// Function to hand the loaded program over to GDB, the PC is the line number times 4
+void gdbServerCommand(const string &endpoint)
+{
+    PhaseScope scope(PHASE_EXECUTE);
+    runGdbServer(endpoint, *simulator);
+    cout << endl;
+}
 
-        cout << "Executed " << instructionList[currentLine] << "; PC=0x" << PCHex << endl;
+// Function to parse the sample command and run the rest of the program sampled
+void sampleCommand(const string &arguments)
+{
+    ll skip = 0, warm = 0, measure = 0;
+    if (sscanf(arguments.c_str(), "%lld %lld %lld", &skip, &warm, &measure) != 3 || skip < 0 || warm < 0 || measure <= 0)
+    {
+        cerr << "Usage: sample <fast-forward> <warm-up> <measure>" << endl;
+        return;
+    }
+    simulator->sample(skip, warm, measure);
+    cout << endl;
+}
 
-        // Increment the current line
-        currentLine = j + 1;
-        if(currentLine==instructionList.size()) deleteStack();
+// Function to parse the intervals command and simulate the rest of the program in
+// parallel intervals
+void intervalsCommand(const string &arguments)
+{
+    ll length = 0, warm = 0;
+    if (sscanf(arguments.c_str(), "%lld %lld", &length, &warm) != 2 || length <= 0 || warm < 0)
+    {
+        cerr << "Usage: intervals <length> <warm-up>" << endl;
+        return;
     }
+    simulator->simulateIntervals(length, warm);
+    cout << endl;
+}
+
+// Function to parse the locality command and analyze the rest of the program
+void localityCommand(const string &arguments)
+{
+    ll window = 0;
+    char file[4096] = "";
+    if (sscanf(arguments.c_str(), "%lld %4095s", &window, file) < 1 || window <= 0)
+    {
+        cerr << "Usage: locality <window> [<file>]" << endl;
+        return;
+    }
+    if (simulator->analyzeLocality(window, file))
+        cout << endl;
+}
+
+// Function to parse the ooo and timing commands and run the rest of the program through
+// the out-of-order core model, each argument overrides one setting as key=value. The
+// timing command also runs the in-order model, both decoupled from the functional engine
+void oooCommand(const string &arguments, bool decoupled)
+{
+    OutOfOrderConfig config;
+    int ringSize = 4096;
+    vector<pair<const char *, int *>> settings = {
+        {"fetch", &config.fetchWidth}, {"issue", &config.issueWidth}, {"retire", &config.retireWidth},
+        {"frontend", &config.frontendDepth}, {"rob", &config.robSize}, {"iq", &config.issueQueueSize},
+        {"regs", &config.physicalRegisters}, {"lq", &config.loadQueueSize}, {"sq", &config.storeQueueSize},
+        {"alu", &config.aluLatency}, {"branch", &config.branchLatency}, {"load", &config.loadLatency},
+        {"store", &config.storeLatency}, {"forward", &config.forwardLatency}, {"l2", &config.secondLevelLatency},
+        {"memory", &config.memoryLatency}};
+    if (decoupled)
+        settings.push_back({"ring", &ringSize});
+    istringstream stream(arguments);
+    string argument;
+    while (stream >> argument)
+    {
+        size_t equals = argument.find('=');
+        auto setting = find_if(begin(settings), end(settings), [&](const pair<const char *, int *> &entry)
+                               { return argument.substr(0, equals) == entry.first; });
+        int value = 0;
+        if (equals == string::npos || setting == end(settings) || sscanf(argument.c_str() + equals + 1, "%d", &value) != 1 || value < 0)
+        {
+            cerr << "Usage: " << (decoupled ? "timing" : "ooo") << " [<setting>=<value> ...], settings are fetch "
+                 << "issue retire frontend rob iq regs lq sq alu branch load store forward l2 memory"
+                 << (decoupled ? " ring" : "") << endl;
+            return;
+        }
+        *setting->second = value;
+    }
+    if (config.fetchWidth <= 0 || config.issueWidth <= 0 || config.retireWidth <= 0 || config.robSize <= 0 ||
+        config.issueQueueSize <= 0 || config.loadQueueSize <= 0 || config.storeQueueSize <= 0 || ringSize <= 0)
+    {
+        cerr << "Error: Widths and queue sizes must be positive" << endl;
+        return;
+    }
+    if (config.physicalRegisters <= 32)
+    {
+        cerr << "Error: The core needs more than 32 physical registers" << endl;
+        return;
+    }
+    if (decoupled)
+        simulator->simulateDecoupled(config, ringSize);
     else
+        simulator->simulateOutOfOrder(config);
+    cout << endl;
+}
+
+// Function to parse the bbv command and profile the rest of the program
+void bbvCommand(const string &arguments)
+{
+    ll interval = 0;
+    char file[4096] = "";
+    int clusters = 10;
+    if (sscanf(arguments.c_str(), "%lld %4095s %d", &interval, file, &clusters) < 2 || interval <= 0 || clusters <= 0)
     {
-        cout << "Nothing to step" << endl;
+        cerr << "Usage: bbv <interval> <file> [<clusters>]" << endl;
+        return;
     }
+    if (simulator->profileBlocks(interval, file, clusters))
+        cout << endl;
 }
 
-string currentDataType;
+// Function to parse the fuzz command and fuzz the routine at a label of the current machine
+void fuzzCommand(const string &arguments)
+{
+    char label[4096] = "", address[64] = "", directory[4096] = "";
+    ll maxLength = 0, cases = 0;
+    ull buffer = 0;
+    if (sscanf(arguments.c_str(), "%4095s %63s %lld %lld %4095s", label, address, &maxLength, &cases, directory) < 4 ||
+        !parseNumber(address, buffer) || maxLength <= 0 || cases <= 0)
+    {
+        cerr << "Usage: fuzz <label> <address> <max-length> <cases> [<directory>]" << endl;
+        return;
+    }
+    auto entry = simulator->program->labelAddresses.find(label);
+    if (entry == simulator->program->labelAddresses.end())
+    {
+        cerr << "Error: Label " << label << " not found" << endl;
+        return;
+    }
+    Fuzzer fuzzer(*simulator, label, entry->second, buffer, maxLength, directory);
+    fuzzer.run(cases);
+    fuzzer.printReport();
+    cout << endl;
+}
 
-void handleDataSection(string line)
+// Function to run one command, returns false once the simulator should exit
+bool runCommand(const string &currentCommand)
 {
-    // Check if we're currently handling a type
-    if (currentDataType.empty())
+    if (currentCommand.substr(0, 5) == "load ")
     {
-        // Case where data type and values are on the same line or type is encountered alone
-        if (line.substr(0, 6) == ".dword")
+        // Handle load command
+        // Starts over with a new machine if there was a file loaded previously, only the
+        // settings are kept
+        if (loaded)
         {
-            currentDataType = ".dword";
-            if (line.size() > 6)
-            {
-                string values = line.substr(7);
-                if (!values.empty())
-                {
-                    dataValues = splitValues(values);
-                    setDoubleword(dataValues);
-                    dataValues.clear();
-                    currentDataType.clear(); // Reset after processing
-                }
-            }
+            unique_ptr<Simulator> next = make_unique<Simulator>();
+            next->fusionEnabled = simulator->fusionEnabled;
+            next->checkEnabled = simulator->checkEnabled;
+            next->checkInterval = simulator->checkInterval;
+            next->readLine = simulator->readLine;
+            next->dataStart = simulator->dataStart;
+            next->stackTop = simulator->stackTop;
+            next->stackSize = simulator->stackSize;
+            next->hostTimer = simulator->hostTimer;
+            next->cyclesPerTick = simulator->cyclesPerTick;
+            machines.clear();
+            machines.push_back(move(next));
+            simulator = machines[0].get();
         }
-        else if (line.substr(0, 5) == ".half")
+
+        simulator->load(currentCommand.substr(5));
+        loaded = true;
+    }
+    else if (currentCommand == "run")
+    {
+        if (!loaded)
         {
-            currentDataType = ".half";
-            if (line.size() > 5)
-            {
-                string values = line.substr(6);
-                if (!values.empty())
-                {
-                    dataValues = splitValues(values);
-                    setHalfword(dataValues);
-                    dataValues.clear();
-                    currentDataType.clear(); // Reset after processing
-                }
-            }
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
         }
-        else if (line.substr(0, 5) == ".word")
+
+        runControlled([]
+                      {
+                          if (simulator->checkEnabled)
+                              simulator->runChecked(); // Executes instructions with both engines
+                          else
+                              simulator->run(); // Executes instructions
+                      });
+        cout << endl;
+    }
+    else if (currentCommand == "step" || currentCommand.substr(0, 5) == "step ")
+    {
+        if (!loaded)
         {
-            currentDataType = ".word";
-            if (line.size() > 5)
-            {
-                string values = line.substr(6);
-                if (!values.empty())
-                {
-                    dataValues = splitValues(values);
-                    setWord(dataValues);
-                    dataValues.clear();
-                    currentDataType.clear(); // Reset after processing
-                }
-            }
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
         }
-        else if (line.substr(0, 5) == ".byte")
+
+        ll count = currentCommand.size() > 5 ? atoll(currentCommand.c_str() + 5) : 1;
+        if (count <= 0)
         {
-            currentDataType = ".byte";
-            if (line.size() > 5)
-            {
-                string values = line.substr(6);
-                if (!values.empty())
-                {
-                    dataValues = splitValues(values);
-                    setByte(dataValues);
-                    dataValues.clear();
-                    currentDataType.clear(); // Reset after processing
-                }
-            }
+            cerr << "Usage: step [<count>]" << endl;
+            return true;
         }
+        runControlled([count]
+                      { simulator->stepInstructions(count); }); // Execute count instructions, one by default
+        cout << endl;
     }
-    else
+    else if (currentCommand.substr(0, 6) == "until " || currentCommand == "finish")
     {
-        // Case where values are on the next line
-        dataValues = splitValues(line);
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
 
-        if (currentDataType == ".dword")
+        if (currentCommand == "finish")
         {
-            setDoubleword(dataValues);
+            runControlled([]
+                          { simulator->finish(); });
+            cout << endl;
+            return true;
         }
-        else if (currentDataType == ".half")
+        // The target is a label or a line of the file, as with break
+        string target = currentCommand.substr(6);
+        const Program &program = *simulator->program;
+        auto label = program.labelAddresses.find(target);
+        ll line = -1;
+        ull fileLine = 0;
+        if (label != program.labelAddresses.end())
+            line = label->second;
+        else if (all_of(target.begin(), target.end(), ::isdigit) && parseNumber(target, fileLine) && fileLine <= INT_MAX)
+            line = (ll)fileLine - program.extraLines - 1;
+        if (line < 0 || line >= (ll)program.instructionList.size())
         {
-            setHalfword(dataValues);
+            cerr << "Error: No instruction at " << target << endl;
+            return true;
+        }
+        runControlled([line]
+                      { simulator->runUntil(line); });
+        cout << endl;
+    }
+    else if (currentCommand == "pause")
+    {
+        cerr << "Error: Program is not running" << endl;
+    }
+    else if (currentCommand.substr(0, 6) == "break ")
+    {
+        // Maximum 5 breakpoints allowed
+        vector<int> &breakpoints = simulator->breakpoints;
+        if (breakpoints.size() == 5)
+            cerr << "Breakpoints limit exceeded.";
+        int breakpoint = stoi(currentCommand.substr(6));
+        int newBreakpoint = breakpoint - simulator->program->extraLines -1;
+        if(newBreakpoint<0){
+            cerr << "Please give valid breakpoint." << endl;
+            exit(1);
         }
-        else if (currentDataType == ".word")
+        breakpoints.push_back(newBreakpoint);
+        cout << "Breakpoint set at line " << breakpoint << endl;
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 10) == "del break ")
+    {
+        int breakpoint = stoi(currentCommand.substr(10));
+        vector<int> &breakpoints = simulator->breakpoints;
+        auto it = find(breakpoints.begin(), breakpoints.end(), breakpoint - 1);
+        if (it != breakpoints.end())
         {
-            setWord(dataValues);
+            breakpoints.erase(it); // If present deletes the breakpoint
         }
-        else if (currentDataType == ".byte")
+        else
         {
-            setByte(dataValues);
+            cerr << "No breakpoint present at line " << breakpoint << endl;
         }
-
-        dataValues.clear();
-        currentDataType.clear(); // Reset after processing
+        cout << endl;
     }
-}
-
-// Function to load file
-void loadFile(string filename)
-{
-    ifstream inputFile(filename);
-    if (!inputFile.is_open())
+    else if (currentCommand.substr(0, 6) == "watch " || currentCommand.substr(0, 7) == "rwatch " ||
+             currentCommand.substr(0, 7) == "awatch ")
     {
-        cerr << "Error opening input file." << endl;
-        return;
+        int kind = currentCommand[0] == 'w' ? WATCH_WRITE : currentCommand[0] == 'r' ? WATCH_READ : WATCH_ACCESS;
+        watchCommand(kind, currentCommand.substr(currentCommand.find(' ') + 1));
     }
-
-    string line;
-    bool inTextSection = true; // Assume starting with text section
-    int lineNumber = 0;
-
-    while (getline(inputFile, line))
+    else if (currentCommand.substr(0, 10) == "del watch ")
     {
-        // Trim leading and trailing spaces
-        while (!line.empty() && isspace(line[0]))
-            line = line.substr(1); // Remove leading spaces
-        while (!line.empty() && isspace(line.back()))
-            line.pop_back(); // Remove trailing spaces
-
-        // If the line is empty or a comment, skip it
-        if (line.empty() || line[0] == ';')
+        ull id = 0;
+        if (!parseNumber(currentCommand.substr(10), id))
         {
-            continue;
+            cerr << "Usage: del watch <id>" << endl;
+            return true;
         }
-
-        // Check for .data or .text sections
-        if (line == ".data")
+        vector<Watchpoint> &watchpoints = simulator->mmu.watchpoints;
+        auto it = find_if(watchpoints.begin(), watchpoints.end(), [id](const Watchpoint &watch)
+                          { return (ull)watch.id == id; });
+        if (it != watchpoints.end())
         {
-            extraLines++;
-            inTextSection = false;
-            continue;
+            watchpoints.erase(it);
+            simulator->mmu.updateWatchedPages();
         }
-        if (line == ".text")
+        else
         {
-            extraLines++;
-            inTextSection = true;
-            continue;
+            cerr << "No watchpoint " << id << endl;
         }
-
-        // Handle data section
-        if (!inTextSection)
+        cout << endl;
+    }
+    else if (currentCommand == "watches")
+    {
+        const char *kinds[] = {"", "read", "write", "access"};
+        for (const Watchpoint &watch : simulator->mmu.watchpoints)
+            cout << "Watchpoint " << watch.id << ": " << kinds[watch.kind] << " of " << watch.length << " bytes at 0x"
+                 << decimalToHex(watch.start, 16) << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "regs")
+    {
+        simulator->printRegisters(); // Function in simulator.cpp
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 4) == "mem ")
+    {
+        // Extracting address and count from the line
+        char start[32], length[32];
+        ull address = 0, count = 0;
+        if (sscanf(currentCommand.c_str() + 4, "%31s %31s", start, length) != 2 || !parseNumber(start, address) ||
+            !parseNumber(length, count) || count == 0 || count > LLONG_MAX)
+        {
+            cerr << "Usage: mem <address> <count>" << endl;
+            return true;
+        }
+        if (address + count < address)
+        {
+            cerr << "Error: The range runs past the end of the address space" << endl;
+            return true;
+        }
+        simulator->printMemory(address, count); // Function in simulator.cpp
+    }
+    else if (currentCommand.substr(0, 4) == "map ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        char file[4096], address[32], mode[8] = "ro";
+        ull start = 0;
+        if (sscanf(currentCommand.c_str() + 4, "%4095s %31s %7s", file, address, mode) < 2 ||
+            !parseNumber(address, start) || (string(mode) != "ro" && string(mode) != "rw"))
+        {
+            cerr << "Usage: map <file> <address> [ro|rw]" << endl;
+            return true;
+        }
+        if (simulator->mapFile(file, start, string(mode) == "rw"))
+            cout << "Mapped " << file << " at " << address << " " << mode << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "regions")
+    {
+        simulator->printRegions();
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 7) == "layout ")
+    {
+        layoutCommand(currentCommand.substr(7));
+    }
+    else if (currentCommand.substr(0, 6) == "timer ")
+    {
+        timerCommand(currentCommand.substr(6));
+    }
+    else if (currentCommand == "dump regs" || currentCommand.substr(0, 10) == "dump regs ")
+    {
+        dumpRegisters(currentCommand.size() > 10 ? currentCommand.substr(10) : "", simulator->registers, simulator->readPc());
+    }
+    else if (currentCommand.substr(0, 9) == "dump mem ")
+    {
+        // Extracting start, length and the optional file from the line
+        char start[32], length[32], file[4096] = "";
+        ull address = 0, size = 0;
+        if (sscanf(currentCommand.c_str() + 9, "%31s %31s %4095s", start, length, file) < 2 ||
+            !parseNumber(start, address) || !parseNumber(length, size))
+        {
+            cerr << "Usage: dump mem <start> <len> [<file>]" << endl;
+            return true;
+        }
+        dumpMemory(simulator->mmu, simulator->memory, address, size, file);
+    }
+    else if (currentCommand == "show-stack")
+    {
+        simulator->showStack(); // Function in simulator.cpp
+    }
+    else if (currentCommand == "fusion on" || currentCommand == "fusion off")
+    {
+        simulator->fusionEnabled = currentCommand == "fusion on";
+        cout << "Instruction fusion " << (simulator->fusionEnabled ? "enabled" : "disabled") << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "vm" || currentCommand.substr(0, 3) == "vm ")
+    {
+        vmCommand(currentCommand.size() > 3 ? currentCommand.substr(3) : "");
+    }
+    else if (currentCommand.substr(0, 10) == "gdbserver ")
+    {
+        if (!loaded)
         {
-            extraLines++;
-            handleDataSection(line);
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
         }
-        // Handle text section
+        gdbServerCommand(currentCommand.substr(10));
+    }
+    else if (currentCommand == "check off" || currentCommand == "check on" || currentCommand.substr(0, 9) == "check on ")
+    {
+        ull interval = 1;
+        if (currentCommand.size() > 9 && (!parseNumber(currentCommand.substr(9), interval) || interval > INT_MAX))
+        {
+            cerr << "Usage: check on [<interval>] | check off, the interval is at most " << INT_MAX << endl;
+            return true;
+        }
+        simulator->checkEnabled = currentCommand != "check off";
+        if (currentCommand.size() > 9)
+            simulator->checkInterval = max((int)interval, 1);
+        if (simulator->checkEnabled)
+            cout << "Differential checking enabled every " << simulator->checkInterval << " instructions" << endl;
         else
+            cout << "Differential checking disabled" << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "record off" || currentCommand == "replay off")
+    {
+        simulator->stopInputLog();
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 7) == "record " || currentCommand.substr(0, 7) == "replay ")
+    {
+        if (!loaded)
         {
-            // Look for labels in the line (format: label:)
-            for (size_t i = 1; i < line.length(); i++)
-            {
-                if (line[i] == ':')
-                {
-                    string label = line.substr(0, i); // Get the label name
-                    if (labelAddresses.find(label) != labelAddresses.end())
-                    {
-                        cerr << "Error at line " << lineNumber + 1 << ". Label " << label
-                             << " already exists at line " << labelAddresses[label] + 1 << endl;
-                        return;
-                    }
-                    // Add the label to the map with the line number
-                    labelAddresses[label] = lineNumber;
-                    line = line.substr(i + 2); // Remove label from the line
-                    break;
-                }
-            }
-            // Trim leading and trailing spaces
-            while (!line.empty() && isspace(line[0]))
-                line = line.substr(1); // Remove leading spaces
-            // If the line still has content after removing the label, treats it as an instruction
-            if (!line.empty())
-            {
-                instructionList.push_back(line);
-                lineNumber++;
-            }
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        string logFile = currentCommand.substr(7);
+        if (currentCommand[2] == 'c' ? simulator->startRecording(logFile) : simulator->startReplay(logFile))
+            cout << (currentCommand[2] == 'c' ? "Recording inputs to " : "Replaying inputs from ") << logFile << endl;
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 7) == "sample " || currentCommand.substr(0, 4) == "bbv ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        if (currentCommand[0] == 's')
+            sampleCommand(currentCommand.substr(7));
+        else
+            bbvCommand(currentCommand.substr(4));
+    }
+    else if (currentCommand == "ooo" || currentCommand.substr(0, 4) == "ooo ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        oooCommand(currentCommand.substr(3), false);
+    }
+    else if (currentCommand.substr(0, 9) == "locality ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        localityCommand(currentCommand.substr(9));
+    }
+    else if (currentCommand.substr(0, 10) == "intervals ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
         }
+        intervalsCommand(currentCommand.substr(10));
+    }
+    else if (currentCommand == "timing" || currentCommand.substr(0, 7) == "timing ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        oooCommand(currentCommand.substr(6), true);
+    }
+    else if (currentCommand.substr(0, 5) == "fuzz ")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        fuzzCommand(currentCommand.substr(5));
+    }
+    else if (currentCommand == "fork")
+    {
+        if (!loaded)
+        {
+            cerr << "Error: No file loaded. Please use the load command first." << endl;
+            return true;
+        }
+        machines.push_back(simulator->fork());
+        cout << "Forked machine " << machines.size() - 1 << " from machine "
+             << find_if(machines.begin(), machines.end(), [](const unique_ptr<Simulator> &machine)
+                        { return machine.get() == simulator; }) - machines.begin() << endl;
+        cout << endl;
+    }
+    else if (currentCommand.substr(0, 8) == "machine ")
+    {
+        ull index = 0;
+        if (!parseNumber(currentCommand.substr(8), index) || index >= machines.size())
+        {
+            cerr << "Error: No machine " << currentCommand.substr(8) << endl;
+            return true;
+        }
+        simulator = machines[index].get();
+        cout << "Switched to machine " << index << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "machines")
+    {
+        for (size_t i = 0; i < machines.size(); i++)
+        {
+            Simulator &machine = *machines[i];
+            cout << (&machine == simulator ? "* " : "  ") << i << ": PC=0x" << decimalToHex(machine.readPc(), 8)
+                 << ", " << machine.retiredCount << " instructions retired, " << machine.memory.allPages().size()
+                 << " pages (" << machine.memory.sharedPageCount() << " shared)" << endl;
+        }
+        cout << endl;
+    }
+    else if (currentCommand == "stats")
+    {
+        cout << "Retired instructions: " << simulator->retiredCount << endl;
+        cout << "Dispatches: " << simulator->dispatchCount << endl;
+        if (simulator->retiredCount > 0)
+            cout << "Dispatches per instruction: " << (double)simulator->dispatchCount / simulator->retiredCount << endl;
+        cout << "TLB misses: " << simulator->mmu.tlbMisses << endl;
+        cout << endl;
+    }
+    else if (currentCommand == "exit")
+    {
+        cout << "Exited the simulator" << endl;
+        return false;
     }
-    createStack(labelAddresses);
-    inputFile.close();
+    else
+    {
+        cerr << "Unknown command." << endl;
+    }
+    return true;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    string currentCommand;
-    string filename;
-    bool loaded = false;
+    machines.push_back(make_unique<Simulator>());
+    simulator = machines[0].get();
 
-    while (true)
+    // Batch flags run the matching commands in order and exit without reading input
+    vector<string> commands;
+    string servePath;
+    size_t serveThreads = hostThreads();
+    for (int i = 1; i < argc; i++)
     {
-        getline(cin, currentCommand);
-
-        if (currentCommand.substr(0, 5) == "load ")
+        string flag = argv[i];
+        if (flag == "--self-profile")
         {
-            // Handle load command
-            // Resets all the memory and variable values if there was a file loaded previously
-            if (loaded)
-            {
-                instructionList.clear();
-                labelAddresses.clear();
-                currentLine = 0;
-                breakpoints.clear();
-                atBreak = false;
-                resetRegisters();
-                resetMemory();
-                deleteStack();
-            }
-            string filename = currentCommand.substr(5);
-            
-            loadFile(filename);
-            loaded = true;
+            startSelfProfile();
         }
-        else if (currentCommand == "run")
+        else if (flag == "--load" && i + 1 < argc)
         {
-            if (!loaded)
-            {
-                cerr << "Error: No file loaded. Please use the load command first." << endl;
-                continue;
-            }
-
-            executeInstruction(filename); // Executes instructions
-            cout << endl;
+            commands.push_back("load " + string(argv[++i]));
         }
-        else if (currentCommand == "step")
+        else if ((flag == "--record" || flag == "--replay") && i + 1 < argc)
         {
-            if (!loaded)
-            {
-                cerr << "Error: No file loaded. Please use the load command first." << endl;
-                continue;
-            }
-
-            stepInstruction(); // Execute one instruction at a time
-            cout << endl;
+            commands.push_back(flag.substr(2) + " " + argv[++i]);
         }
-        else if (currentCommand.substr(0, 6) == "break ")
+        else if (flag == "--serve" && i + 1 < argc)
         {
-            // Maximum 5 breakpoints allowed
-            if (breakpoints.size() == 5)
-                cerr << "Breakpoints limit exceeded.";
-            int breakpoint = stoi(currentCommand.substr(6));
-            int newBreakpoint = breakpoint - extraLines -1;
-            if(newBreakpoint<0){
-                cerr << "Please give valid breakpoint." << endl;
-                return 1;
-            }
-            breakpoints.push_back(newBreakpoint);
-            cout << "Breakpoint set at line " << breakpoint << endl;
-            cout << endl;
+            servePath = argv[++i];
         }
-        else if (currentCommand.substr(0, 10) == "del break ")
+        else if (flag == "--threads" && i + 1 < argc)
         {
-            int breakpoint = stoi(currentCommand.substr(10));
-            auto it = find(breakpoints.begin(), breakpoints.end(), breakpoint - 1);
-            if (it != breakpoints.end())
+            ull threads = 0;
+            if (!parseNumber(argv[++i], threads) || threads == 0)
             {
-                breakpoints.erase(it); // If present deletes the breakpoint
-            }
-            else
-            {
-                cerr << "No breakpoint present at line " << breakpoint << endl;
+                cerr << "Error: --threads takes a positive number" << endl;
+                return 1;
             }
-            cout << endl;
+            serveThreads = threads;
         }
-        else if (currentCommand == "regs")
+        else if (flag == "--run")
         {
-            printRegisters(); // Function in simulator.cpp
-            cout << endl;
+            commands.push_back("run");
         }
-        else if (currentCommand.substr(0, 4) == "mem ")
+        else if (flag == "--dump-regs" && i + 1 < argc)
         {
-            // Extracting address and count from the line
-            string address = currentCommand.substr(4, 7);
-            int count = stoi(currentCommand.substr(11));
-            printMemory(address, count); // Function in simulator.cpp
+            commands.push_back("dump regs " + string(argv[++i]));
         }
-        else if (currentCommand == "show-stack")
+        else if (flag == "--dump-mem" && i + 3 < argc)
         {
-            showStack(extraLines); // Function in simulator.cpp
+            commands.push_back("dump mem " + string(argv[i + 1]) + " " + argv[i + 2] + " " + argv[i + 3]);
+            i += 3;
         }
-        else if (currentCommand == "exit")
+        else
         {
-            cout << "Exited the simulator" << endl;
-            break;
+            cerr << "Usage: riscv_sim [--self-profile] [--load <file>] [--record|--replay <log>] [--run] [--dump-regs <file>] [--dump-mem <start> <len> <file>]..." << endl;
+            cerr << "       riscv_sim --serve <socket> [--threads <n>]" << endl;
+            return 1;
         }
-        else
+    }
+
+    if (!servePath.empty())
+        return runServer(servePath, max<size_t>(serveThreads, 1)) ? 0 : 1;
+
+    if (!commands.empty())
+    {
+        for (const string &command : commands)
+        {
+            if (!runCommand(command))
+                break;
+        }
+    }
+    else
+    {
+        // Ctrl-C is handled on this thread, which runs the program
+        sigset_t interrupt;
+        sigemptyset(&interrupt);
+        sigaddset(&interrupt, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &interrupt, nullptr);
+        thread(readInput).detach();
+        pthread_sigmask(SIG_UNBLOCK, &interrupt, nullptr);
+        signal(SIGINT, interruptHandler);
+        simulator->readLine = nextLine;
+
+        string currentCommand;
+        while (nextLine(currentCommand))
         {
-            cerr << "Unknown command." << endl;
+            if (!runCommand(currentCommand))
+                break;
         }
     }
 
+    cout << flush;
+    printSelfProfile(simulator->retiredCount);
     return 0;
 }
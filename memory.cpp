@@ -0,0 +1,273 @@
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "memory.h"
+
+using namespace std;
+
+// Function to find an allocated or file backed page, returns nullptr for untouched pages
+Page *Memory::findPage(ull pageNumber) const
+{
+    auto it = pages.find(pageNumber);
+    if (it != pages.end())
+        return it->second.get();
+    return mappings.empty() ? nullptr : mappedPage(pageNumber);
+}
+
+// Function to find the host memory of a page inside a mapped file
+Page *Memory::mappedPage(ull pageNumber) const
+{
+    for (const FileMapping &mapping : mappings)
+    {
+        ull offset = (pageNumber << pageBits) - mapping.start;
+        if ((pageNumber << pageBits) >= mapping.start && offset < mapping.length)
+            return (Page *)(mapping.file->data + offset);
+    }
+    return nullptr;
+}
+
+// Function to check whether another memory still holds a page. use_count is a relaxed
+// load, so seeing one owner says nothing about the writes of the owner that let go of
+// the page last. Its release decrement of the count is paired with the acquire fence
+// here, which makes its accesses to the page happen before we write it in place
+bool sharedPage(const shared_ptr<Page> &page)
+{
+    if (page.use_count() > 1)
+        return true;
+    atomic_thread_fence(memory_order_acquire);
+    return false;
+}
+
+// Function to find a page for writing, allocating a zeroed page if needed and
+// copying a page that is still shared with another memory or comes from a file
+Page *Memory::touchPage(ull pageNumber)
+{
+    shared_ptr<Page> &page = pages[pageNumber];
+    Page *mapped = page || mappings.empty() ? nullptr : mappedPage(pageNumber);
+    if (journaling && journal.find(pageNumber) == journal.end())
+        journal[pageNumber] = page ? make_unique<Page>(*page) : mapped ? make_unique<Page>(*mapped) : nullptr;
+    if (mapped)
+    {
+        // Cached pointers may still point into the mapping
+        page = make_shared<Page>(*mapped);
+        copiedPages++;
+    }
+    else if (!page)
+    {
+        page = make_shared<Page>();
+    }
+    else if (sharedPage(page))
+    {
+        page = make_shared<Page>(*page);
+        copiedPages++;
+    }
+    return page.get();
+}
+
+// Function to read a little endian value of up to 8 bytes
+ull Memory::read(ull address, int bytes) const
+{
+    ull value = 0;
+    copyOut(address, &value, bytes);
+    return value;
+}
+
+// Function to write the low bytes of a value in little endian format
+void Memory::write(ull address, ull value, int bytes)
+{
+    copyIn(address, &value, bytes);
+}
+
+unsigned char Memory::readByte(ull address) const
+{
+    const Page *page = findPage(address >> pageBits);
+    return page ? page->bytes[address & (pageSize - 1)] : 0;
+}
+
+// Function to copy a block of host data into guest memory one page at a time
+void Memory::copyIn(ull address, const void *data, size_t size)
+{
+    const unsigned char *source = (const unsigned char *)data;
+    while (size > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        size_t chunk = pageSize - offset < size ? pageSize - offset : size;
+        memcpy(touchPage(address >> pageBits)->bytes + offset, source, chunk);
+        address += chunk;
+        source += chunk;
+        size -= chunk;
+    }
+}
+
+// Function to copy a block of guest memory out to the host
+void Memory::copyOut(ull address, void *data, size_t size) const
+{
+    unsigned char *destination = (unsigned char *)data;
+    while (size > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        size_t chunk = pageSize - offset < size ? pageSize - offset : size;
+        const Page *page = findPage(address >> pageBits);
+        if (page)
+            memcpy(destination, page->bytes + offset, chunk);
+        else
+            memset(destination, 0, chunk);
+        address += chunk;
+        destination += chunk;
+        size -= chunk;
+    }
+}
+
+// Function to set a block of guest memory to one value, zero fills of untouched pages are free
+void Memory::fill(ull address, unsigned char value, size_t size)
+{
+    while (size > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        size_t chunk = pageSize - offset < size ? pageSize - offset : size;
+        Page *page = value == 0 && !findPage(address >> pageBits) ? nullptr : touchPage(address >> pageBits);
+        if (page)
+            memset(page->bytes + offset, value, chunk);
+        address += chunk;
+        size -= chunk;
+    }
+}
+
+// Function to get the host memory of a page, untouched pages are only allocated on request
+unsigned char *Memory::pageData(ull pageNumber, bool allocate)
+{
+    Page *page = allocate ? touchPage(pageNumber) : findPage(pageNumber);
+    return page ? page->bytes : nullptr;
+}
+
+// Function to replace the contents of this memory with those of other without copying
+// any page, both see the same pages until one of them writes to a page
+void Memory::shareFrom(const Memory &other)
+{
+    pages = other.pages;
+    mappings = other.mappings;
+    journal.clear();
+    journaling = false;
+    copiedPages++;
+}
+
+size_t Memory::sharedPageCount() const
+{
+    size_t count = 0;
+    for (auto &[pageNumber, page] : pages)
+        count += sharedPage(page);
+    return count;
+}
+
+// Function to map a host file into guest memory at a page aligned address without
+// copying it. Pages already written in the range are dropped so the file shows through
+bool Memory::mapFile(const string &path, ull address, bool writable)
+{
+    if (address & (pageSize - 1))
+    {
+        cerr << "Error: Mapping address must be a multiple of " << pageSize << endl;
+        return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat fileInfo;
+    if (fd < 0 || fstat(fd, &fileInfo) < 0 || fileInfo.st_size == 0)
+    {
+        cerr << "Error: Cannot map " << path << endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    ull length = ((ull)fileInfo.st_size + pageSize - 1) & ~(pageSize - 1);
+    for (const FileMapping &mapping : mappings)
+    {
+        if (address < mapping.start + mapping.length && mapping.start < address + length)
+        {
+            cerr << "Error: " << path << " overlaps the mapping of " << mapping.path << endl;
+            close(fd);
+            return false;
+        }
+    }
+    // Guest writes never reach the file, a private read only mapping is enough
+    void *data = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        cerr << "Error: Cannot map " << path << endl;
+        return false;
+    }
+    shared_ptr<MappedFile> file = make_shared<MappedFile>();
+    file->data = (unsigned char *)data;
+    file->size = length;
+    mappings.push_back({address, length, writable, path, file});
+
+    for (auto it = pages.begin(); it != pages.end();)
+    {
+        if ((it->first << pageBits) - address < length && (it->first << pageBits) >= address)
+            it = pages.erase(it);
+        else
+            ++it;
+    }
+    copiedPages++;
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (data != nullptr)
+        munmap(data, size);
+}
+
+// Function to check if a page belongs to a read only mapping, stores to it fault
+bool Memory::readOnly(ull pageNumber) const
+{
+    for (const FileMapping &mapping : mappings)
+    {
+        if (!mapping.writable && (pageNumber << pageBits) >= mapping.start && (pageNumber << pageBits) - mapping.start < mapping.length)
+            return true;
+    }
+    return false;
+}
+
+void Memory::clear()
+{
+    pages.clear();
+    mappings.clear();
+    journal.clear();
+}
+
+void Memory::startJournal()
+{
+    journal.clear();
+    journaling = true;
+}
+
+// Function to keep the writes made so far and start a new journal
+void Memory::commitJournal()
+{
+    journal.clear();
+}
+
+// Function to undo every write made since the journal was started or committed,
+// pages stay allocated so pointers to them remain valid
+void Memory::rollbackJournal()
+{
+    for (auto &[pageNumber, saved] : journal)
+    {
+        Page *page = findPage(pageNumber);
+        if (saved)
+            memcpy(page->bytes, saved->bytes, pageSize);
+        else
+            memset(page->bytes, 0, pageSize);
+    }
+    journal.clear();
+}
+
+void Memory::stopJournal()
+{
+    journal.clear();
+    journaling = false;
+}
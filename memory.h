@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+typedef unsigned long long ull;
+
+const ull pageBits = 12;
+const ull pageSize = 1ULL << pageBits;
+
+// One page of guest memory
+struct Page
+{
+    unsigned char bytes[pageSize];
+};
+
+// Host file mapped read only into this process, unmapped once no guest memory uses it
+struct MappedFile
+{
+    ~MappedFile();
+    unsigned char *data = nullptr;
+    size_t size = 0; // File size rounded up to a whole page
+};
+
+// Guest range backed by a host file. Its pages are read straight from the mapping,
+// the first guest write to a page of a writable mapping copies it like a shared page
+struct FileMapping
+{
+    ull start;
+    ull length;
+    bool writable;
+    string path;
+    shared_ptr<MappedFile> file;
+};
+
+// Sparse guest memory made of pages that are allocated on first write,
+// bytes that were never written read as zero. Pages can be shared with forks of
+// the memory and are copied by the first write of whoever does not own them alone
+class Memory
+{
+public:
+    ull read(ull address, int bytes) const;
+    void write(ull address, ull value, int bytes);
+    unsigned char readByte(ull address) const;
+    void copyIn(ull address, const void *data, size_t size);
+    void copyOut(ull address, void *data, size_t size) const;
+    void fill(ull address, unsigned char value, size_t size);
+    void clear();
+    unsigned char *pageData(ull pageNumber, bool allocate);
+    const unordered_map<ull, shared_ptr<Page>> &allPages() const { return pages; }
+    void shareFrom(const Memory &other);
+    size_t sharedPageCount() const;
+    bool mapFile(const string &path, ull address, bool writable);
+    const vector<FileMapping> &allMappings() const { return mappings; }
+    bool readOnly(ull pageNumber) const;
+
+    // Shared pages copied on write so far. Page pointers handed out before a copy
+    // may point at the shared page, so cached pointers have to be dropped when it changes
+    ull copiedPages = 0;
+
+    // While journaling, the contents of every page are saved before its first write so
+    // the writes can be undone. Writes through cached page pointers are only seen when
+    // the pointer was handed out after the journal started or was last committed
+    void startJournal();
+    void commitJournal();
+    void rollbackJournal();
+    void stopJournal();
+    const unordered_map<ull, unique_ptr<Page>> &journaledPages() const { return journal; }
+
+private:
+    Page *findPage(ull pageNumber) const;
+    Page *mappedPage(ull pageNumber) const;
+    Page *touchPage(ull pageNumber);
+
+    unordered_map<ull, shared_ptr<Page>> pages;
+    vector<FileMapping> mappings; // Pages of the mappings not written yet are not in pages
+    bool journaling = false;
+    unordered_map<ull, unique_ptr<Page>> journal; // Saved pages, nullptr for pages that did not exist
+};
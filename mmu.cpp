@@ -0,0 +1,304 @@
+#include "mmu.h"
+#include "simulator.h"
+
+using namespace std;
+typedef long long ll;
+
+// Page table entry bits
+const ull PTE_V = 1 << 0;
+const ull PTE_R = 1 << 1;
+const ull PTE_W = 1 << 2;
+const ull PTE_X = 1 << 3;
+const ull PTE_U = 1 << 4;
+const ull PTE_A = 1 << 6;
+const ull PTE_D = 1 << 7;
+const ull ppnMask = (1ULL << 44) - 1;
+
+Mmu::Mmu(Memory &memory) : memory(memory)
+{
+    // Empty TLB entries must not match virtual page 0
+    flushTlb();
+}
+
+// Function to translate a virtual address with an Sv39 page table walk. When updateBits
+// is set the accessed and dirty bits of the leaf entry are updated like hardware would
+bool Mmu::translateAddress(ull virtualAddress, AccessType access, ull &physicalAddress, bool updateBits)
+{
+    // Machine mode and bare mode use physical addresses directly
+    if (privilegeMode == PRIV_M || (satp >> 60) != satpModeSv39)
+    {
+        physicalAddress = virtualAddress;
+        return true;
+    }
+
+    // Bits 63 to 39 must all be copies of bit 38
+    if (((ll)(virtualAddress << 25) >> 25) != (ll)virtualAddress)
+        return false;
+
+    ull table = (satp & ppnMask) << pageBits;
+    for (int level = 2; level >= 0; level--)
+    {
+        ull vpn = (virtualAddress >> (pageBits + 9 * level)) & 0x1FF;
+        ull pteAddress = table + vpn * 8;
+        ull pte = memory.read(pteAddress, 8);
+
+        if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W)) || (pte >> 54) != 0)
+            return false;
+
+        ull ppn = (pte >> 10) & ppnMask;
+        if (!(pte & (PTE_R | PTE_X)))
+        {
+            // Pointer to the next level of the table
+            table = ppn << pageBits;
+            continue;
+        }
+
+        // Leaf entry, check permissions for the current privilege mode
+        if (privilegeMode == PRIV_U && !(pte & PTE_U))
+            return false;
+        if (privilegeMode == PRIV_S && (pte & PTE_U) && !statusSum)
+            return false;
+        if (access == ACCESS_LOAD && !(pte & PTE_R) && !(statusMxr && (pte & PTE_X)))
+            return false;
+        if (access == ACCESS_STORE && !(pte & PTE_W))
+            return false;
+
+        // Superpages must be aligned to their size
+        ull levelMask = (1ULL << (9 * level)) - 1;
+        if (ppn & levelMask)
+            return false;
+
+        if (updateBits)
+        {
+            ull newPte = pte | PTE_A | (access == ACCESS_STORE ? PTE_D : 0);
+            if (newPte != pte)
+            {
+                memory.write(pteAddress, newPte, 8);
+                dropStaleEntries();
+            }
+        }
+
+        physicalAddress = ((ppn | ((virtualAddress >> pageBits) & levelMask)) << pageBits) | (virtualAddress & (pageSize - 1));
+        return true;
+    }
+    return false;
+}
+
+// Function to record a faulting access, whoever stops execution reports it
+void Mmu::raiseFault(ull address, AccessType access)
+{
+    memoryFault = true;
+    faultAddress = address;
+    faultAccess = access;
+}
+
+string Mmu::describeFault()
+{
+    return string(faultAccess == ACCESS_LOAD ? "Load" : "Store") + " page fault at 0x" + decimalToHex(faultAddress, 16);
+}
+
+// Function to refresh the watched kinds after the watchpoints changed. Ranges stay
+// intervals, a watchpoint over a huge range costs no more than one over a byte
+void Mmu::updateWatchedPages()
+{
+    watchedKinds = 0;
+    for (const Watchpoint &watch : watchpoints)
+        watchedKinds |= watch.kind;
+    // Cached translations may cover pages that are watched now
+    flushTlb();
+}
+
+// Function to start or, with an empty observer, stop reporting every guest access
+void Mmu::observeAccesses(function<void(ull address, int size)> observer)
+{
+    accessObserver = move(observer);
+    // Accesses that hit the TLB would never reach the observer
+    flushTlb();
+}
+
+// Function to find the watchpoint an access hits, returns 0 when there is none. Ranges
+// are compared by their last byte, so one that ends at the top of memory does not wrap
+int Mmu::findWatchpoint(ull address, int size, AccessType access)
+{
+    int kind = access == ACCESS_LOAD ? WATCH_READ : WATCH_WRITE;
+    for (const Watchpoint &watch : watchpoints)
+    {
+        if ((watch.kind & kind) && address <= watch.start + (watch.length - 1) && watch.start <= address + (size - 1))
+            return watch.id;
+    }
+    return 0;
+}
+
+// Function to check whether a watchpoint of the given kind overlaps a virtual page
+bool Mmu::pageWatched(ull page, int kind)
+{
+    if (!(watchedKinds & kind))
+        return false;
+    for (const Watchpoint &watch : watchpoints)
+    {
+        if ((watch.kind & kind) && page <= (watch.start + (watch.length - 1)) >> pageBits && watch.start >> pageBits <= page)
+            return true;
+    }
+    return false;
+}
+
+// Function to read guest memory on a TLB miss, refilling the load TLB
+bool Mmu::readVirtual(ull address, void *data, int size)
+{
+    int watch = !(watchedKinds & WATCH_READ) || watchHit ? 0 : findWatchpoint(address, size, ACCESS_LOAD);
+    ull start = address;
+    int total = size;
+    unsigned char *destination = (unsigned char *)data;
+    while (size > 0)
+    {
+        ull offset = address & (pageSize - 1);
+        int chunk = pageSize - offset < (ull)size ? pageSize - offset : size;
+        ull physicalAddress;
+        tlbMisses++;
+        if (!translateAddress(address, ACCESS_LOAD, physicalAddress, true))
+        {
+            raiseFault(address, ACCESS_LOAD);
+            return false;
+        }
+
+        // Untouched pages read as zero and are not cached, a later write allocates them
+        unsigned char *page = memory.pageData(physicalAddress >> pageBits, false);
+        if (page)
+        {
+            if (!accessObserver && !pageWatched(address >> pageBits, WATCH_READ))
+                loadTlb[(address >> pageBits) & (tlbSize - 1)] = {address >> pageBits, page};
+            memcpy(destination, page + offset, chunk);
+        }
+        else
+        {
+            memset(destination, 0, chunk);
+        }
+        address += chunk;
+        destination += chunk;
+        size -= chunk;
+    }
+    if (watch)
+    {
+        ull value = 0;
+        memcpy(&value, data, total < 8 ? total : 8);
+        watchHit = true;
+        lastWatch = {watch, start, total, ACCESS_LOAD, 0, value};
+    }
+    if (accessObserver)
+        accessObserver(start, total);
+    return true;
+}
+
+// Function to write guest memory on a TLB miss, refilling the store TLB. Both pages of
+// an access that crosses a page boundary are translated and checked before the A and D
+// bits of either are set or anything is written, so a faulting store leaves no trace
+bool Mmu::writeVirtual(ull address, const void *data, int size)
+{
+    ull chunkAddress = address;
+    int remaining = size;
+    while (remaining > 0)
+    {
+        ull offset = chunkAddress & (pageSize - 1);
+        int chunk = pageSize - offset < (ull)remaining ? pageSize - offset : remaining;
+        ull physicalAddress;
+        tlbMisses++;
+        if (!translateAddress(chunkAddress, ACCESS_STORE, physicalAddress, false) ||
+            memory.readOnly(physicalAddress >> pageBits))
+        {
+            raiseFault(chunkAddress, ACCESS_STORE);
+            return false;
+        }
+        chunkAddress += chunk;
+        remaining -= chunk;
+    }
+
+    unsigned char *pages[2];
+    chunkAddress = address;
+    remaining = size;
+    for (int i = 0; remaining > 0; i++)
+    {
+        ull offset = chunkAddress & (pageSize - 1);
+        int chunk = pageSize - offset < (ull)remaining ? pageSize - offset : remaining;
+        ull physicalAddress;
+        translateAddress(chunkAddress, ACCESS_STORE, physicalAddress, true);
+        pages[i] = memory.pageData(physicalAddress >> pageBits, true);
+        dropStaleEntries();
+        if (!accessObserver && !pageWatched(chunkAddress >> pageBits, WATCH_WRITE))
+            storeTlb[(chunkAddress >> pageBits) & (tlbSize - 1)] = {chunkAddress >> pageBits, pages[i]};
+        chunkAddress += chunk;
+        remaining -= chunk;
+    }
+
+    // A watched store keeps the bytes it is about to overwrite for the report
+    int watch = !(watchedKinds & WATCH_WRITE) || watchHit ? 0 : findWatchpoint(address, size, ACCESS_STORE);
+    if (watch)
+    {
+        ull oldValue = 0, newValue = 0;
+        ull first = address & (pageSize - 1);
+        for (int i = 0; i < size && i < 8; i++)
+            ((unsigned char *)&oldValue)[i] = first + i < pageSize ? pages[0][first + i] : pages[1][first + i - pageSize];
+        memcpy(&newValue, data, size < 8 ? size : 8);
+        watchHit = true;
+        lastWatch = {watch, address, size, ACCESS_STORE, oldValue, newValue};
+    }
+    if (accessObserver)
+        accessObserver(address, size);
+
+    const unsigned char *source = (const unsigned char *)data;
+    for (int i = 0; size > 0; i++)
+    {
+        ull offset = address & (pageSize - 1);
+        int chunk = pageSize - offset < (ull)size ? pageSize - offset : size;
+        memcpy(pages[i] + offset, source, chunk);
+        address += chunk;
+        source += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Function to drop every cached translation, needed after satp, privilege or sfence.vma
+void Mmu::flushTlb()
+{
+    for (int i = 0; i < tlbSize; i++)
+    {
+        loadTlb[i] = {~0ULL, nullptr};
+        storeTlb[i] = {~0ULL, nullptr};
+    }
+}
+
+// Function to drop every cached translation once a write copied a page shared with
+// a fork, entries may still point at the shared copy
+void Mmu::dropStaleEntries()
+{
+    if (memory.copiedPages != knownCopies)
+    {
+        knownCopies = memory.copiedPages;
+        flushTlb();
+    }
+}
+
+// Function to drop the cached translations of one virtual page
+void Mmu::flushTlbPage(ull virtualAddress)
+{
+    ull vpn = virtualAddress >> pageBits;
+    int index = vpn & (tlbSize - 1);
+    if (loadTlb[index].tag == vpn)
+        loadTlb[index] = {~0ULL, nullptr};
+    if (storeTlb[index].tag == vpn)
+        storeTlb[index] = {~0ULL, nullptr};
+}
+
+// Function to describe how an address translates, without touching accessed/dirty bits
+string Mmu::describeTranslation(ull virtualAddress)
+{
+    ull physicalAddress;
+    string result = "0x" + decimalToHex(virtualAddress, 16) + " -> ";
+    if (!translateAddress(virtualAddress, ACCESS_LOAD, physicalAddress, false))
+        return result + "page fault";
+    result += "0x" + decimalToHex(physicalAddress, 16);
+    ull storeAddress;
+    if (!translateAddress(virtualAddress, ACCESS_STORE, storeAddress, false))
+        result += " (read only)";
+    return result;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "memory.h"
+
+using namespace std;
+typedef unsigned long long ull;
+
+enum AccessType
+{
+    ACCESS_LOAD,
+    ACCESS_STORE
+};
+
+enum PrivilegeMode
+{
+    PRIV_U = 0,
+    PRIV_S = 1,
+    PRIV_M = 3
+};
+
+const ull satpModeSv39 = 8;
+
+enum WatchKind
+{
+    WATCH_READ = 1,
+    WATCH_WRITE = 2,
+    WATCH_ACCESS = 3
+};
+
+// Range of guest virtual addresses whose accesses stop execution
+struct Watchpoint
+{
+    int id;
+    ull start;
+    ull length;
+    int kind; // WatchKind
+};
+
+// First watched access of an instruction, values hold up to the first 8 bytes
+struct WatchHit
+{
+    int id;
+    ull address;
+    int size;
+    AccessType access;
+    ull oldValue; // Stores only
+    ull newValue; // Value loaded or stored
+};
+
+// One entry of the software TLB, mapping a guest virtual page straight to the
+// host memory that backs it
+struct TlbEntry
+{
+    ull tag; // Virtual page number, ~0 when empty
+    unsigned char *page;
+};
+
+const int tlbSize = 256;
+
+// Sv39 address translation in front of one guest memory, with software TLBs
+class Mmu
+{
+public:
+    explicit Mmu(Memory &memory);
+    bool translateAddress(ull virtualAddress, AccessType access, ull &physicalAddress, bool updateBits);
+    bool readVirtual(ull address, void *data, int size);
+    bool writeVirtual(ull address, const void *data, int size);
+    void flushTlb();
+    void flushTlbPage(ull virtualAddress);
+    string describeTranslation(ull virtualAddress);
+    string describeFault();
+    void raiseFault(ull address, AccessType access);
+    void dropStaleEntries();
+    void updateWatchedPages();
+    void observeAccesses(function<void(ull address, int size)> observer);
+
+    // Function to read guest memory, a TLB hit is a tag compare and an add
+    bool readGuest(ull address, void *data, int size)
+    {
+        TlbEntry &entry = loadTlb[(address >> pageBits) & (tlbSize - 1)];
+        ull offset = address & (pageSize - 1);
+        if (entry.tag == (address >> pageBits) && offset + size <= pageSize)
+        {
+            memcpy(data, entry.page + offset, size);
+            return true;
+        }
+        return readVirtual(address, data, size);
+    }
+
+    // Function to write guest memory through the store TLB
+    bool writeGuest(ull address, const void *data, int size)
+    {
+        TlbEntry &entry = storeTlb[(address >> pageBits) & (tlbSize - 1)];
+        ull offset = address & (pageSize - 1);
+        if (entry.tag == (address >> pageBits) && offset + size <= pageSize)
+        {
+            memcpy(entry.page + offset, data, size);
+            return true;
+        }
+        return writeVirtual(address, data, size);
+    }
+
+    ull satp = 0;
+    int privilegeMode = PRIV_U;
+    bool statusSum = false;    // S mode may access U pages
+    bool statusMxr = false;    // Loads from executable pages are allowed
+    bool memoryFault = false;  // Set by a faulting access, cleared by whoever stops execution
+    ull faultAddress = 0;
+    AccessType faultAccess = ACCESS_LOAD;
+    ull tlbMisses = 0;
+
+    // Pages a watchpoint overlaps are kept out of the TLB of the watched access type, so
+    // only their accesses take the slow path where the exact range is checked
+    vector<Watchpoint> watchpoints; // Call updateWatchedPages after changing them
+    bool watchHit = false;          // Set by a watched access, cleared by whoever stops execution
+    WatchHit lastWatch = {};
+
+private:
+    // Sees every guest load and store that reached memory while set. The TLBs are not
+    // filled meanwhile, so each access takes the slow path where it is reported
+    function<void(ull address, int size)> accessObserver;
+
+    int findWatchpoint(ull address, int size, AccessType access);
+    bool pageWatched(ull page, int kind);
+
+    Memory &memory;
+    int watchedKinds = 0; // Watch kinds of all watchpoints together
+    ull knownCopies = 0; // Value of memory.copiedPages when the TLBs were last known valid
+    TlbEntry loadTlb[tlbSize];
+    TlbEntry storeTlb[tlbSize];
+};
@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include "ooo.h"
+#include "simulator.h"
+
+using namespace std;
+
+// Cycles of issue history kept, instructions never issue further apart within the ROB
+const int issueWindow = 4096;
+// Recent stores remembered for forwarding, by address
+const int storeTableSize = 4096;
+
+// 32 KiB 8 way first level caches in front of a 256 KiB 8 way second level, 64 byte lines
+OutOfOrderModel::OutOfOrderModel(const OutOfOrderConfig &config)
+    : config(config), instructionCache(32 << 10, 8, 64), dataCache(32 << 10, 8, 64), secondLevel(256 << 10, 8, 64),
+      predictor(12), robFree(config.robSize), issueQueueFree(config.issueQueueSize),
+      registerFree(config.physicalRegisters - 32), loadQueueFree(config.loadQueueSize),
+      storeQueueFree(config.storeQueueSize), issueSlots(issueWindow, {~0ULL, 0}),
+      storeTable(storeTableSize, {~0ULL, 0, 0, 0})
+{
+}
+
+// Function to place an instruction in the first cycle at or after earliest that an in
+// order stage still has room in, cycle and used describe the last cycle it filled
+ull OutOfOrderModel::inOrderSlot(ull earliest, ull &cycle, int &used, int width)
+{
+    if (earliest > cycle)
+    {
+        cycle = earliest;
+        used = 0;
+    }
+    if (used == width)
+    {
+        cycle++;
+        used = 0;
+    }
+    used++;
+    return cycle;
+}
+
+// Function to find the first cycle at or after earliest with a free issue port
+ull OutOfOrderModel::issueSlot(ull earliest)
+{
+    for (ull cycle = earliest;; cycle++)
+    {
+        IssueSlot &slot = issueSlots[cycle % issueWindow];
+        if (slot.cycle != cycle)
+            slot = {cycle, 0};
+        if (slot.used < config.issueWidth)
+        {
+            slot.used++;
+            return cycle;
+        }
+    }
+}
+
+int OutOfOrderModel::dataLatency(ull address)
+{
+    if (dataCache.access(address))
+        return config.loadLatency;
+    dataMisses++;
+    return secondLevel.access(address) ? config.secondLevelLatency : config.memoryLatency;
+}
+
+// Function to find the statistics of a function, remembering the last one since
+// consecutive instructions nearly always share it
+FunctionTiming &OutOfOrderModel::functionTiming(const string &function)
+{
+    if (!lastFunction || *lastFunction != function)
+    {
+        lastTiming = &functions[function];
+        lastFunction = &functions.find(function)->first;
+    }
+    return *lastTiming;
+}
+
+// Function to account for one instruction
+void OutOfOrderModel::execute(const RetiredInstruction &instruction)
+{
+    static const string noFunction;
+    ull pc = (ull)instruction.line * 4;
+    uint8_t op = instruction.op;
+    bool isLoad = op >= OP_LB && op <= OP_LWU;
+    bool isStore = op >= OP_SB && op <= OP_SD;
+    bool isBranch = op >= OP_BEQ && op <= OP_BGEU;
+    bool readsFirst = op != OP_JAL && op != OP_LUI && op != OP_ECALL && (op < OP_CSRRWI || op > OP_CSRRCI);
+    bool readsSecond = (op >= OP_ADD && op <= OP_SRA) || (op >= OP_ADD_UW && op <= OP_RORW) || isStore || isBranch;
+    int rd = (isStore || isBranch || op == OP_ECALL || op == OP_SFENCE_VMA) ? 0 : instruction.rd;
+
+    // Fetch, a new cache line may miss and stall the front end
+    if (pc >> 6 != lastFetchLine)
+    {
+        lastFetchLine = pc >> 6;
+        if (!instructionCache.access(pc))
+        {
+            instructionMisses++;
+            fetchCycle += secondLevel.access(pc) ? config.secondLevelLatency : config.memoryLatency;
+            fetchedInCycle = 0;
+        }
+    }
+    ull fetched = inOrderSlot(fetchCycle, fetchCycle, fetchedInCycle, config.fetchWidth);
+
+    // Dispatch waits for a free entry in every structure the instruction needs
+    ull ready = max(fetched + config.frontendDepth, dispatchCycle);
+    ull limits[STALL_COUNT] = {};
+    if (robAllocated >= robFree.size())
+        limits[STALL_ROB] = robFree[robAllocated % robFree.size()];
+    if (issueQueueAllocated >= issueQueueFree.size())
+        limits[STALL_ISSUE_QUEUE] = issueQueueFree[issueQueueAllocated % issueQueueFree.size()];
+    if (rd && registersAllocated >= registerFree.size())
+        limits[STALL_REGISTERS] = registerFree[registersAllocated % registerFree.size()];
+    if (isLoad && loadsAllocated >= loadQueueFree.size())
+        limits[STALL_LOAD_QUEUE] = loadQueueFree[loadsAllocated % loadQueueFree.size()];
+    if (isStore && storesAllocated >= storeQueueFree.size())
+        limits[STALL_STORE_QUEUE] = storeQueueFree[storesAllocated % storeQueueFree.size()];
+    if (op == OP_ECALL)
+        limits[STALL_SERIALIZE] = retireCycle + 1;
+    int reason = max_element(limits, limits + STALL_COUNT) - limits;
+    if (limits[reason] > ready)
+    {
+        stallCycles[reason] += limits[reason] - ready;
+        ready = limits[reason];
+    }
+    ull dispatched = inOrderSlot(ready, dispatchCycle, dispatchedInCycle, config.fetchWidth);
+
+    // Issue once the sources are ready and a port is free
+    ull operands = max(readsFirst ? registerReady[instruction.rs1] : 0, readsSecond ? registerReady[instruction.rs2] : 0);
+    ull depth = max(readsFirst ? registerDepth[instruction.rs1] : 0, readsSecond ? registerDepth[instruction.rs2] : 0);
+    ull issued = issueSlot(max(dispatched + 1, operands));
+
+    int latency = config.aluLatency;
+    ull address = instruction.address;
+    if (isLoad)
+    {
+        loads++;
+        // An older store to the same word still in the store queue hands its data over
+        StoreEntry &store = storeTable[(address >> 3) % storeTableSize];
+        if (store.word == address >> 3 && store.retire > issued)
+        {
+            forwardedLoads++;
+            issued = max(issued, store.dataReady);
+            depth = max(depth, store.depth);
+            latency = config.forwardLatency;
+        }
+        else
+        {
+            latency = dataLatency(address);
+        }
+    }
+    else if (isStore)
+    {
+        latency = config.storeLatency;
+        dataLatency(address);
+    }
+    else if (isBranch || op == OP_JAL || op == OP_JALR)
+    {
+        latency = config.branchLatency;
+    }
+    ull complete = issued + latency;
+    depth += latency;
+
+    // A wrong prediction refetches after the branch resolves, a taken one ends the fetch group
+    bool redirect = false, taken = false;
+    if (isBranch)
+    {
+        branches++;
+        taken = instruction.taken;
+        redirect = !predictor.predictBranch(pc, taken);
+    }
+    else if (op == OP_JAL)
+    {
+        taken = true;
+        if (instruction.rd != 0)
+            predictor.call(pc + 4);
+    }
+    else if (op == OP_JALR)
+    {
+        branches++;
+        taken = true;
+        redirect = !predictor.predictReturn(instruction.address);
+    }
+    if (redirect)
+    {
+        mispredictions++;
+        fetchCycle = max(fetchCycle + 1, complete + 1);
+        fetchedInCycle = 0;
+    }
+    else if (taken)
+    {
+        fetchedInCycle = config.fetchWidth;
+    }
+    // Nothing younger runs before a system call is done
+    if (op == OP_ECALL && complete + 1 > fetchCycle)
+    {
+        fetchCycle = complete + 1;
+        fetchedInCycle = 0;
+    }
+
+    ull previousRetire = retireCycle;
+    ull retired = inOrderSlot(complete + 1, retireCycle, retiredInCycle, config.retireWidth);
+
+    // Free the entries, the ROB, the load and store queues and registers at retirement
+    robFree[robAllocated++ % robFree.size()] = retired;
+    issueQueueFree[issueQueueAllocated++ % issueQueueFree.size()] = issued;
+    if (rd)
+    {
+        registerFree[registersAllocated++ % registerFree.size()] = retired;
+        registerReady[rd] = complete;
+        registerDepth[rd] = depth;
+    }
+    if (isLoad)
+        loadQueueFree[loadsAllocated++ % loadQueueFree.size()] = retired;
+    if (isStore)
+    {
+        storeQueueFree[storesAllocated++ % storeQueueFree.size()] = retired;
+        ull dataReady = max(issued, registerReady[instruction.rs2]);
+        storeTable[(address >> 3) % storeTableSize] = {address >> 3, dataReady, retired, max(depth, registerDepth[instruction.rs2])};
+    }
+
+    FunctionTiming &timing = functionTiming(instruction.function ? *instruction.function : noFunction);
+    timing.instructions++;
+    timing.cycles += retired - previousRetire;
+    timing.operandWait += operands > dispatched + 1 ? operands - dispatched - 1 : 0;
+    if (depth > criticalPath)
+    {
+        timing.criticalPath += depth - criticalPath;
+        criticalPath = depth;
+    }
+    instructions++;
+}
+
+void OutOfOrderModel::printReport() const
+{
+    static const char *stallNames[STALL_COUNT] = {"ROB full", "issue queue full", "no free physical register",
+                                                  "load queue full", "store queue full", "serialized by ecall"};
+    ull cycles = retireCycle;
+    cout << "Core: fetch " << config.fetchWidth << ", issue " << config.issueWidth << ", retire " << config.retireWidth
+         << " wide, ROB " << config.robSize << ", issue queue " << config.issueQueueSize << ", "
+         << config.physicalRegisters << " physical registers, load/store queue " << config.loadQueueSize << "/"
+         << config.storeQueueSize << endl;
+    cout << "Instructions: " << instructions << ", cycles: " << cycles << ", IPC: " << fixed << setprecision(3)
+         << (cycles ? (double)instructions / cycles : 0) << endl;
+    cout << "Dataflow critical path: " << criticalPath << " cycles, IPC limit "
+         << (criticalPath ? (double)instructions / criticalPath : 0) << endl;
+    cout << "Dispatch stalls:" << endl;
+    for (int reason = 0; reason < STALL_COUNT; reason++)
+        cout << "  " << stallNames[reason] << ": " << stallCycles[reason] << " cycles" << endl;
+    cout << "Loads: " << loads << ", forwarded from stores: " << forwardedLoads << endl;
+    cout << "Branches: " << branches << ", mispredicted: " << mispredictions << endl;
+    cout << "L1 misses: " << instructionMisses << " instruction, " << dataMisses << " data" << endl;
+
+    // Functions that took the most cycles first
+    vector<pair<string, FunctionTiming>> sorted(functions.begin(), functions.end());
+    sort(sorted.begin(), sorted.end(), [](const pair<string, FunctionTiming> &a, const pair<string, FunctionTiming> &b)
+         { return a.second.cycles != b.second.cycles ? a.second.cycles > b.second.cycles : a.first < b.first; });
+    cout << left << setw(24) << "Function" << right << setw(14) << "Instructions" << setw(12) << "Cycles" << setw(8)
+         << "IPC" << setw(14) << "Operand wait" << setw(15) << "Critical path" << endl;
+    for (const auto &[name, timing] : sorted)
+    {
+        cout << left << setw(24) << (name.empty() ? "(no function)" : name) << right << setw(14) << timing.instructions
+             << setw(12) << timing.cycles << setw(8) << (timing.cycles ? (double)timing.instructions / timing.cycles : 0)
+             << setw(14) << timing.operandWait << setw(14)
+             << (criticalPath ? 100.0 * timing.criticalPath / criticalPath : 0) << "%" << endl;
+    }
+    cout << defaultfloat << setprecision(6);
+}
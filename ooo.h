@@ -0,0 +1,120 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "decoder.h"
+#include "timing.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Sizes and latencies of the modelled core, latencies are in cycles
+struct OutOfOrderConfig
+{
+    int fetchWidth = 4;
+    int issueWidth = 4;
+    int retireWidth = 4;
+    int frontendDepth = 3; // Cycles from fetch to dispatch
+    int robSize = 128;
+    int issueQueueSize = 64;
+    int physicalRegisters = 160; // Includes the 32 holding architectural state
+    int loadQueueSize = 32;
+    int storeQueueSize = 32;
+    int aluLatency = 1;
+    int branchLatency = 1;
+    int loadLatency = 4; // First level hit
+    int storeLatency = 1;
+    int forwardLatency = 1; // Load served by an older store in the store queue
+    int secondLevelLatency = 12;
+    int memoryLatency = 100;
+};
+
+// Reasons dispatch had to wait, in the order they are checked
+enum DispatchStall
+{
+    STALL_ROB,
+    STALL_ISSUE_QUEUE,
+    STALL_REGISTERS,
+    STALL_LOAD_QUEUE,
+    STALL_STORE_QUEUE,
+    STALL_SERIALIZE, // ecall waits for every older instruction to retire
+    STALL_COUNT
+};
+
+// Time spent in one guest function, by the function on top of the call stack
+struct FunctionTiming
+{
+    ull instructions = 0;
+    ull cycles = 0;       // Advance of the retire cycle while its instructions retired
+    ull operandWait = 0;  // Cycles its instructions waited for their sources after dispatch
+    ull criticalPath = 0; // Cycles it added to the dataflow critical path of the program
+};
+
+// Trace driven model of an out-of-order core. Each retired instruction is given fetch,
+// dispatch, issue, complete and retire cycles in program order, limited by the widths,
+// the sizes of the ROB, issue queue, register file and load/store queues, by its
+// sources and by the latency of its functional unit
+class OutOfOrderModel
+{
+public:
+    explicit OutOfOrderModel(const OutOfOrderConfig &config);
+    void execute(const RetiredInstruction &instruction);
+    void printReport() const;
+    ull cycles() const { return retireCycle; }
+
+private:
+    struct IssueSlot
+    {
+        ull cycle;
+        int used;
+    };
+    struct StoreEntry
+    {
+        ull word; // Address divided by 8, ~0 when empty
+        ull dataReady;
+        ull retire;
+        ull depth;
+    };
+
+    ull inOrderSlot(ull earliest, ull &cycle, int &used, int width);
+    ull issueSlot(ull earliest);
+    int dataLatency(ull address);
+    FunctionTiming &functionTiming(const string &function);
+
+    OutOfOrderConfig config;
+    CacheModel instructionCache;
+    CacheModel dataCache;
+    CacheModel secondLevel;
+    BranchPredictor predictor;
+
+    // In order stages
+    ull fetchCycle = 0;
+    int fetchedInCycle = 0;
+    ull lastFetchLine = ~0ULL;
+    ull dispatchCycle = 0;
+    int dispatchedInCycle = 0;
+    ull retireCycle = 0;
+    int retiredInCycle = 0;
+
+    // Cycle each entry of a structure is freed, indexed by allocation count modulo its size
+    vector<ull> robFree, issueQueueFree, registerFree, loadQueueFree, storeQueueFree;
+    ull robAllocated = 0, issueQueueAllocated = 0, registersAllocated = 0, loadsAllocated = 0, storesAllocated = 0;
+
+    vector<IssueSlot> issueSlots; // Issues per cycle, for a window of cycles
+    vector<StoreEntry> storeTable; // Recent stores by address, for forwarding
+    ull registerReady[32] = {};
+    ull registerDepth[32] = {}; // Dataflow depth of the value in each register
+
+    ull instructions = 0;
+    ull stallCycles[STALL_COUNT] = {};
+    ull loads = 0, forwardedLoads = 0;
+    ull branches = 0, mispredictions = 0;
+    ull instructionMisses = 0, dataMisses = 0;
+    ull criticalPath = 0;
+
+    unordered_map<string, FunctionTiming> functions;
+    const string *lastFunction = nullptr;
+    FunctionTiming *lastTiming = nullptr;
+};
@@ -0,0 +1,31 @@
+#include <thread>
+#include <vector>
+#include "parallel.h"
+
+using namespace std;
+
+// Function to find how many threads the host can run at once
+size_t hostThreads()
+{
+    unsigned threads = thread::hardware_concurrency();
+    return threads == 0 ? 1 : threads;
+}
+
+// Function to run body over [0, count) split into one contiguous range per host thread.
+// Ranges get at least minimumRange items, so small jobs run on the calling thread alone
+void parallelFor(size_t count, size_t minimumRange, const function<void(size_t begin, size_t end)> &body)
+{
+    size_t threads = min(hostThreads(), count / (minimumRange ? minimumRange : 1));
+    if (threads <= 1)
+    {
+        if (count > 0)
+            body(0, count);
+        return;
+    }
+    vector<thread> workers;
+    for (size_t t = 1; t < threads; t++)
+        workers.emplace_back(body, count * t / threads, count * (t + 1) / threads);
+    body(0, count / threads);
+    for (thread &worker : workers)
+        worker.join();
+}
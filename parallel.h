@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+using namespace std;
+
+size_t hostThreads();
+void parallelFor(size_t count, size_t minimumRange, const function<void(size_t begin, size_t end)> &body);
@@ -0,0 +1,174 @@
+#include <algorithm>
+#include <array>
+#include <random>
+#include "profile.h"
+
+using namespace std;
+
+// Basic block vectors are projected down to this many dimensions before clustering
+const int projectedDimensions = 15;
+const int maxIterations = 100;
+
+typedef array<double, projectedDimensions> Point;
+
+double distanceSquared(const Point &a, const Point &b)
+{
+    double sum = 0;
+    for (int i = 0; i < projectedDimensions; i++)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    return sum;
+}
+
+BlockProfiler::BlockProfiler(ll intervalLength, FILE *output) : intervalLength(intervalLength), output(output)
+{
+}
+
+// Function to count one executed instruction, a block ends wherever control does not
+// simply fall through to the next line
+void BlockProfiler::retire(int line, int nextLine)
+{
+    if (newBlock)
+    {
+        blockStart = blockIds.emplace(line, blockIds.size() + 1).first->second;
+        newBlock = false;
+    }
+    counts[blockStart]++;
+    newBlock = nextLine != line + 1;
+    if (++executed == intervalLength)
+        endInterval();
+}
+
+void BlockProfiler::endInterval()
+{
+    vector<pair<int, ll>> blocks(counts.begin(), counts.end());
+    sort(blocks.begin(), blocks.end());
+    if (output)
+    {
+        fputc('T', output);
+        for (auto &[id, count] : blocks)
+            fprintf(output, ":%d:%lld ", id, count);
+        fputc('\n', output);
+    }
+    intervals.push_back(move(blocks));
+    counts.clear();
+    executed = 0;
+}
+
+// Function to close the last, shorter interval
+void BlockProfiler::finish()
+{
+    if (executed > 0)
+        endInterval();
+}
+
+// Function to pick representative intervals like SimPoint: vectors are normalized,
+// randomly projected and grouped with k-means, and the interval closest to the centre
+// of each group stands for all of its members
+vector<SimPoint> BlockProfiler::chooseSimPoints(int clusters) const
+{
+    int count = intervals.size();
+    clusters = min(clusters, count);
+    if (clusters <= 0)
+        return {};
+
+    // Fixed seed so that the same profile always gives the same simulation points
+    mt19937 generator(42);
+    uniform_real_distribution<double> uniform(-1, 1);
+    vector<Point> projection(blockIds.size() + 1);
+    for (Point &row : projection)
+    {
+        for (double &value : row)
+            value = uniform(generator);
+    }
+
+    vector<Point> points(count);
+    for (int i = 0; i < count; i++)
+    {
+        ll total = 0;
+        for (auto &[id, blockCount] : intervals[i])
+            total += blockCount;
+        points[i].fill(0);
+        for (auto &[id, blockCount] : intervals[i])
+        {
+            for (int d = 0; d < projectedDimensions; d++)
+                points[i][d] += projection[id][d] * blockCount / total;
+        }
+    }
+
+    // k-means++ seeding, each new centre is picked with probability proportional to
+    // its squared distance from the closest centre so far
+    vector<Point> centres = {points[generator() % count]};
+    vector<double> closest(count);
+    while ((int)centres.size() < clusters)
+    {
+        double sum = 0;
+        for (int i = 0; i < count; i++)
+        {
+            closest[i] = distanceSquared(points[i], centres[0]);
+            for (const Point &centre : centres)
+                closest[i] = min(closest[i], distanceSquared(points[i], centre));
+            sum += closest[i];
+        }
+        if (sum == 0)
+            break;
+        double target = uniform_real_distribution<double>(0, sum)(generator);
+        int chosen = 0;
+        while (chosen < count - 1 && (target -= closest[chosen]) > 0)
+            chosen++;
+        centres.push_back(points[chosen]);
+    }
+
+    vector<int> assignment(count, -1);
+    for (int iteration = 0; iteration < maxIterations; iteration++)
+    {
+        bool changed = false;
+        for (int i = 0; i < count; i++)
+        {
+            int best = 0;
+            for (int c = 1; c < (int)centres.size(); c++)
+            {
+                if (distanceSquared(points[i], centres[c]) < distanceSquared(points[i], centres[best]))
+                    best = c;
+            }
+            changed |= assignment[i] != best;
+            assignment[i] = best;
+        }
+        if (!changed)
+            break;
+
+        vector<int> members(centres.size(), 0);
+        for (Point &centre : centres)
+            centre.fill(0);
+        for (int i = 0; i < count; i++)
+        {
+            members[assignment[i]]++;
+            for (int d = 0; d < projectedDimensions; d++)
+                centres[assignment[i]][d] += points[i][d];
+        }
+        for (int c = 0; c < (int)centres.size(); c++)
+        {
+            for (int d = 0; d < projectedDimensions && members[c] > 0; d++)
+                centres[c][d] /= members[c];
+        }
+    }
+
+    vector<SimPoint> simPoints;
+    for (int c = 0; c < (int)centres.size(); c++)
+    {
+        int representative = -1;
+        int members = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (assignment[i] != c)
+                continue;
+            members++;
+            if (representative < 0 || distanceSquared(points[i], centres[c]) < distanceSquared(points[representative], centres[c]))
+                representative = i;
+        }
+        if (members > 0)
+            simPoints.push_back({representative, (double)members / count});
+    }
+    sort(simPoints.begin(), simPoints.end(), [](const SimPoint &a, const SimPoint &b)
+         { return a.interval < b.interval; });
+    return simPoints;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+typedef long long ll;
+
+// Representative interval chosen by clustering and the share of the run it stands for
+struct SimPoint
+{
+    int interval;
+    double weight;
+};
+
+// Collects a basic block vector for every interval of a fixed number of instructions,
+// written in the SimPoint .bb format
+class BlockProfiler
+{
+public:
+    BlockProfiler(ll intervalLength, FILE *output);
+    void retire(int line, int nextLine);
+    void finish();
+    int intervalCount() const { return intervals.size(); }
+    vector<SimPoint> chooseSimPoints(int clusters) const;
+
+private:
+    void endInterval();
+
+    ll intervalLength;
+    FILE *output;
+    ll executed = 0;
+    int blockStart = 0;
+    bool newBlock = true;
+    unordered_map<int, int> blockIds; // Line of the first instruction of a block to its id
+    unordered_map<int, ll> counts;     // Instructions of each block in the current interval
+    vector<vector<pair<int, ll>>> intervals;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+// The producer waits while it is full and the consumer while it is empty, so the faster
+// side is held back to the pace of the slower one
+template <typename T>
+class SpscRing
+{
+public:
+    // Capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Function to add an item, waiting while the ring is full
+    void push(const T &item)
+    {
+        size_t position = head.load(memory_order_relaxed);
+        // The consumer's position is re-read only when the cached one says the ring is full
+        if (position - cachedTail > mask)
+        {
+            cachedTail = tail.load(memory_order_acquire);
+            while (position - cachedTail > mask)
+            {
+                fullWaits++;
+                this_thread::yield();
+                cachedTail = tail.load(memory_order_acquire);
+            }
+        }
+        slots[position & mask] = item;
+        head.store(position + 1, memory_order_release);
+    }
+
+    // Function to take the oldest item, waiting while the ring is empty. Returns false
+    // once the ring is empty and closed
+    bool pop(T &item)
+    {
+        size_t position = tail.load(memory_order_relaxed);
+        if (position == cachedHead)
+        {
+            cachedHead = head.load(memory_order_acquire);
+            while (position == cachedHead)
+            {
+                // Closing happens after the last push, so an empty ring seen after it stays empty
+                if (closed.load(memory_order_acquire))
+                {
+                    cachedHead = head.load(memory_order_acquire);
+                    if (position == cachedHead)
+                        return false;
+                    break;
+                }
+                emptyWaits++;
+                this_thread::yield();
+                cachedHead = head.load(memory_order_acquire);
+            }
+        }
+        item = slots[position & mask];
+        tail.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    // Function for the producer to say no more items will come
+    void close() { closed.store(true, memory_order_release); }
+
+    size_t capacity() const { return mask + 1; }
+    // Times the producer found the ring full and the consumer found it empty, read them
+    // once both threads are done
+    size_t producerWaits() const { return fullWaits; }
+    size_t consumerWaits() const { return emptyWaits; }
+
+private:
+    vector<T> slots;
+    size_t mask;
+    // Each side's position on its own cache line, next to its cached copy of the other's
+    alignas(64) atomic<size_t> head{0};
+    size_t cachedTail = 0;
+    size_t fullWaits = 0;
+    alignas(64) atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+    size_t emptyWaits = 0;
+    alignas(64) atomic<bool> closed{false};
+};
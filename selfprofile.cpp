@@ -0,0 +1,170 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <string>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "selfprofile.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Hardware events counted for every phase, read together as one perf event group
+const int counterCount = 4;
+const uint64_t counterEvents[counterCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                              PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+const char *const counterNames[counterCount] = {"cycles", "instructions", "branch-miss", "cache-miss"};
+const char *const phaseNames[PHASE_COUNT] = {"other", "parse", "data", "decode", "cache", "execute", "stack", "output"};
+
+// Profiles are per thread, each simulator instance charges the thread it runs on
+thread_local bool selfProfiling = false;
+
+thread_local ProfilePhase currentPhase = PHASE_OTHER;
+thread_local int counterFds[counterCount] = {-1, -1, -1, -1};
+thread_local int openCounters = 0;         // Counters in the group, in counterEvents order
+thread_local int counterSlot[counterCount]; // Position of each event in a group read, -1 when unavailable
+thread_local string counterError;
+
+thread_local ull lastTime = 0;
+thread_local ull lastCounters[counterCount] = {};
+thread_local ull phaseTime[PHASE_COUNT] = {};
+thread_local ull phaseCounters[PHASE_COUNT][counterCount] = {};
+
+ull nowNanoseconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ull)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Function to read every counter of the group with a single system call
+void readCounters(ull *values)
+{
+    ull buffer[1 + counterCount] = {};
+    if (openCounters > 0 && read(counterFds[0], buffer, sizeof(buffer)) < 0)
+        return;
+    for (int i = 0; i < counterCount; i++)
+        values[i] = counterSlot[i] >= 0 ? buffer[1 + counterSlot[i]] : 0;
+}
+
+// Function to open the hardware counters, user space only so that it works without
+// privileges. Counters the host does not have are left out
+void startSelfProfile()
+{
+    for (int i = 0; i < counterCount; i++)
+    {
+        counterSlot[i] = -1;
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = counterEvents[i];
+        attributes.read_format = PERF_FORMAT_GROUP;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.disabled = openCounters == 0;
+        int groupFd = openCounters == 0 ? -1 : counterFds[0];
+        int fd = syscall(SYS_perf_event_open, &attributes, 0, -1, groupFd, 0);
+        if (fd < 0)
+        {
+            if (counterError.empty())
+                counterError = string(counterNames[i]) + ": " + strerror(errno);
+            continue;
+        }
+        counterFds[openCounters] = fd;
+        counterSlot[i] = openCounters++;
+    }
+    if (openCounters > 0)
+    {
+        ioctl(counterFds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counterFds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    selfProfiling = true;
+    currentPhase = PHASE_OTHER;
+    lastTime = nowNanoseconds();
+    readCounters(lastCounters);
+}
+
+// Function to charge everything since the last switch to the current phase and make
+// phase the current one, returns the phase that was current before
+ProfilePhase switchPhase(ProfilePhase phase)
+{
+    ull time = nowNanoseconds();
+    ull counters[counterCount];
+    readCounters(counters);
+    phaseTime[currentPhase] += time - lastTime;
+    for (int i = 0; i < counterCount; i++)
+        phaseCounters[currentPhase][i] += counters[i] - lastCounters[i];
+    lastTime = time;
+    memcpy(lastCounters, counters, sizeof(counters));
+
+    ProfilePhase previous = currentPhase;
+    currentPhase = phase;
+    return previous;
+}
+
+// Function to print where the host spent its time, per phase and in total
+void printSelfProfile(ll guestInstructions)
+{
+    if (!selfProfiling)
+        return;
+    switchPhase(currentPhase);
+
+    ull totalTime = 0;
+    ull total[counterCount] = {};
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        totalTime += phaseTime[phase];
+        for (int i = 0; i < counterCount; i++)
+            total[i] += phaseCounters[phase][i];
+    }
+
+    auto printRow = [&](const char *name, ull time, const ull *counters)
+    {
+        fprintf(stderr, "%-10s %10.3f %6.1f%%", name, time / 1e6, totalTime ? 100.0 * time / totalTime : 0.0);
+        for (int i = 0; i < counterCount; i++)
+        {
+            if (counterSlot[i] >= 0)
+                fprintf(stderr, " %14llu", counters[i]);
+        }
+        if (counterSlot[0] >= 0 && counterSlot[1] >= 0)
+            fprintf(stderr, " %6.2f", counters[0] ? (double)counters[1] / counters[0] : 0.0);
+        fprintf(stderr, "\n");
+    };
+
+    fprintf(stderr, "Self profile:\n%-10s %10s %7s", "phase", "wall ms", "share");
+    for (int i = 0; i < counterCount; i++)
+    {
+        if (counterSlot[i] >= 0)
+            fprintf(stderr, " %14s", counterNames[i]);
+    }
+    if (counterSlot[0] >= 0 && counterSlot[1] >= 0)
+        fprintf(stderr, " %6s", "IPC");
+    fprintf(stderr, "\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        if (phaseTime[phase] > 0)
+            printRow(phaseNames[phase], phaseTime[phase], phaseCounters[phase]);
+    }
+    printRow("total", totalTime, total);
+
+    if (!counterError.empty())
+        fprintf(stderr, "Hardware counters unavailable (%s)\n", counterError.c_str());
+    fprintf(stderr, "Guest instructions: %lld\n", guestInstructions);
+    if (guestInstructions > 0)
+    {
+        ull runTime = phaseTime[PHASE_EXECUTE] + phaseTime[PHASE_STACK] + phaseTime[PHASE_OUTPUT];
+        fprintf(stderr, "Host ns per guest instruction: %.2f\n", (double)runTime / guestInstructions);
+        if (counterSlot[1] >= 0)
+        {
+            ull runInstructions = phaseCounters[PHASE_EXECUTE][1] + phaseCounters[PHASE_STACK][1] + phaseCounters[PHASE_OUTPUT][1];
+            fprintf(stderr, "Host instructions per guest instruction: %.2f (execution phases), %.2f (whole run)\n",
+                    (double)runInstructions / guestInstructions, (double)total[1] / guestInstructions);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// Parts of the simulator that host time is charged to
+enum ProfilePhase
+{
+    PHASE_OTHER, // Anything outside the phases below, such as reading commands
+    PHASE_PARSE,
+    PHASE_DATA,
+    PHASE_DECODE,
+    PHASE_CACHE,
+    PHASE_EXECUTE,
+    PHASE_STACK,
+    PHASE_OUTPUT,
+    PHASE_COUNT
+};
+
+extern thread_local bool selfProfiling;
+
+void startSelfProfile();
+ProfilePhase switchPhase(ProfilePhase phase);
+void printSelfProfile(long long guestInstructions);
+
+// Charges the host time and counters of a scope to a phase, time spent in nested
+// scopes is charged to their own phases only
+class PhaseScope
+{
+public:
+    explicit PhaseScope(ProfilePhase phase) : previous(selfProfiling ? switchPhase(phase) : PHASE_COUNT) {}
+    ~PhaseScope()
+    {
+        if (previous != PHASE_COUNT)
+            switchPhase(previous);
+    }
+
+private:
+    ProfilePhase previous;
+};
@@ -0,0 +1,522 @@
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "gdbstub.h"
+#include "server.h"
+#include "simulator.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Largest request line and memory read a client may ask for
+const size_t maxRequestLine = 1 << 16;
+const ull maxMemoryRead = 1 << 20;
+// Instructions a run executes between checks for the server stopping
+const ll runSlice = 1 << 20;
+
+// Set by SIGINT and SIGTERM, the accept loop checks it between polls. The signal may
+// land on any thread, so the flag is a lock-free atomic rather than a volatile
+atomic<bool> stopServer{false};
+
+void stopServerHandler(int)
+{
+    stopServer = true;
+}
+
+// Function to parse one request, a flat JSON object whose values are strings, numbers,
+// booleans or null. Values are kept as text, strings without their quotes and escapes
+bool parseRequest(const string &line, unordered_map<string, string> &fields)
+{
+    size_t position = 0;
+    auto skipSpaces = [&]()
+    {
+        while (position < line.size() && isspace((unsigned char)line[position]))
+            position++;
+    };
+    auto parseString = [&](string &value)
+    {
+        if (position >= line.size() || line[position] != '"')
+            return false;
+        for (position++; position < line.size() && line[position] != '"'; position++)
+        {
+            if (line[position] != '\\')
+            {
+                value += line[position];
+                continue;
+            }
+            if (++position >= line.size())
+                return false;
+            char escaped = line[position];
+            if (escaped == 'n')
+                value += '\n';
+            else if (escaped == 't')
+                value += '\t';
+            else if (escaped == 'u')
+            {
+                // Only code points below 0x80 are expected in requests
+                if (position + 4 >= line.size())
+                    return false;
+                int code = 0;
+                for (int digit = 1; digit <= 4; digit++)
+                {
+                    char hex = line[position + digit];
+                    if (!isxdigit((unsigned char)hex))
+                        return false;
+                    code = code * 16 + (isdigit((unsigned char)hex) ? hex - '0' : tolower(hex) - 'a' + 10);
+                }
+                value += (char)code;
+                position += 4;
+            }
+            else
+                value += escaped;
+        }
+        return position++ < line.size();
+    };
+
+    skipSpaces();
+    if (position >= line.size() || line[position++] != '{')
+        return false;
+    skipSpaces();
+    if (position < line.size() && line[position] == '}')
+        return true;
+    while (true)
+    {
+        string key, value;
+        skipSpaces();
+        if (!parseString(key))
+            return false;
+        skipSpaces();
+        if (position >= line.size() || line[position++] != ':')
+            return false;
+        skipSpaces();
+        if (position < line.size() && line[position] == '"')
+        {
+            if (!parseString(value))
+                return false;
+        }
+        else
+        {
+            size_t end = line.find_first_of(",} \t", position);
+            if (end == string::npos || end == position)
+                return false;
+            value = line.substr(position, end - position);
+            position = end;
+        }
+        fields[key] = value;
+        skipSpaces();
+        if (position >= line.size())
+            return false;
+        if (line[position] == '}')
+            return true;
+        if (line[position++] != ',')
+            return false;
+    }
+}
+
+// Function to quote a string for a JSON response
+string jsonString(const string &text)
+{
+    string quoted = "\"";
+    for (unsigned char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (c == '\n')
+            quoted += "\\n";
+        else if (c < 0x20 || c >= 0x7F)
+            quoted += "\\u00" + decimalToHex(c, 2);
+        else
+            quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Loaded programs by file, shared by every session that loads the same unchanged file.
+// Each holds a machine that never runs, sessions are forks of it and share its decoded
+// program and unwritten data pages
+class ProgramRegistry
+{
+public:
+    unique_ptr<Simulator> newSession(const string &file, bool &shared);
+
+private:
+    struct Entry
+    {
+        mutex lock; // Held while loading and forking, forks flush the TLB of the template
+        unique_ptr<Simulator> machine;
+        timespec modified = {};
+        off_t size = 0;
+    };
+
+    mutex lock;
+    unordered_map<string, shared_ptr<Entry>> entries; // By device and inode
+};
+
+// Function to fork a session from the loaded program, loading it first when the file is
+// new or changed since it was loaded
+unique_ptr<Simulator> ProgramRegistry::newSession(const string &file, bool &shared)
+{
+    struct stat fileInfo;
+    if (stat(file.c_str(), &fileInfo) < 0)
+        return nullptr;
+    shared_ptr<Entry> entry;
+    {
+        lock_guard<mutex> guard(lock);
+        shared_ptr<Entry> &slot = entries[to_string(fileInfo.st_dev) + ":" + to_string(fileInfo.st_ino)];
+        if (!slot)
+            slot = make_shared<Entry>();
+        entry = slot;
+    }
+
+    lock_guard<mutex> guard(entry->lock);
+    shared = entry->machine && entry->size == fileInfo.st_size &&
+             entry->modified.tv_sec == fileInfo.st_mtim.tv_sec && entry->modified.tv_nsec == fileInfo.st_mtim.tv_nsec;
+    if (!shared)
+    {
+        unique_ptr<Simulator> machine = make_unique<Simulator>();
+        machine->trace = false;
+        if (!machine->load(file))
+            return nullptr;
+        entry->machine = move(machine);
+        entry->modified = fileInfo.st_mtim;
+        entry->size = fileInfo.st_size;
+    }
+    return entry->machine->fork();
+}
+
+// Fixed set of threads that run queued tasks
+class WorkerPool
+{
+public:
+    explicit WorkerPool(size_t threads);
+    ~WorkerPool();
+    void submit(function<void()> task);
+
+private:
+    void work();
+
+    mutex lock;
+    condition_variable ready;
+    deque<function<void()>> tasks;
+    bool stopping = false;
+    vector<thread> workers;
+};
+
+WorkerPool::WorkerPool(size_t threads)
+{
+    for (size_t i = 0; i < threads; i++)
+        workers.emplace_back(&WorkerPool::work, this);
+}
+
+// Function to finish the queued tasks and join the threads
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread &worker : workers)
+        worker.join();
+}
+
+void WorkerPool::submit(function<void()> task)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        tasks.push_back(move(task));
+    }
+    ready.notify_one();
+}
+
+void WorkerPool::work()
+{
+    while (true)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this]
+                       { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+// One client connection and the machine it drives. The accept loop reads requests,
+// a worker answers them in order, at most one worker per session at a time
+struct Session
+{
+    int fd;
+    unique_ptr<Simulator> machine;
+    string received;         // Bytes after the last complete request line
+    mutex lock;              // Guards the fields below
+    deque<string> requests;  // Complete lines waiting for a worker
+    bool busy = false;       // A worker owns the session
+    atomic<bool> closing{false}; // The client hung up or asked to close, runs check it without the lock
+};
+
+const char *stopReasonNames[] = {"budget", "breakpoint", "exited", "fault", "paused", "watchpoint", "target"};
+
+// Function to run the machine of a session and describe where it stopped
+string runSession(Session &session, ll budget)
+{
+    Simulator &machine = *session.machine;
+    string output;
+    machine.outputCapture = &output;
+    ll retired = machine.retiredCount;
+    // Long runs go in slices so that stopping the server or a client hanging up does not
+    // wait for them
+    StopReason reason = STOP_EXITED;
+    if (machine.running())
+    {
+        do
+            reason = machine.run(min(budget - (machine.retiredCount - retired), runSlice));
+        while (reason == STOP_BUDGET && machine.retiredCount - retired < budget && !stopServer && !session.closing);
+    }
+    machine.outputCapture = nullptr;
+
+    string response = "\"reason\":\"" + string(stopReasonNames[reason]) + "\",\"retired\":" +
+                      to_string(machine.retiredCount - retired) + ",\"pc\":" + to_string(machine.readPc());
+    if (reason == STOP_EXITED)
+        response += ",\"exitCode\":" + to_string(machine.exitCode);
+    if (reason == STOP_FAULT)
+    {
+        response += ",\"fault\":" + jsonString(machine.mmu.describeFault());
+        machine.mmu.memoryFault = false;
+    }
+    return response + ",\"output\":" + jsonString(output);
+}
+
+// Function to answer one request line, the response is a JSON object without its braces
+string handleRequest(Session &session, ProgramRegistry &registry, const string &line)
+{
+    unordered_map<string, string> fields;
+    string id, command;
+    auto number = [&](const string &name, ull fallback)
+    {
+        return fields.count(name) ? stoull(fields[name], nullptr, 0) : fallback;
+    };
+    auto fail = [&](const string &error)
+    {
+        return id + "\"ok\":false,\"error\":" + jsonString(error);
+    };
+
+    try
+    {
+        if (!parseRequest(line, fields))
+            return "\"ok\":false,\"error\":\"Malformed request\"";
+        if (fields.count("id"))
+            id = "\"id\":" + (fields["id"].find_first_not_of("-0123456789") == string::npos ? fields["id"] : jsonString(fields["id"])) + ",";
+        command = fields["cmd"];
+        if (command == "load")
+        {
+            bool shared = false;
+            unique_ptr<Simulator> machine = registry.newSession(fields["file"], shared);
+            if (!machine)
+                return fail("Cannot load " + fields["file"]);
+            machine->outputMuted = false;
+            machine->readLine = [](string &)
+            { return false; };
+            session.machine = move(machine);
+            return id + "\"ok\":true,\"instructions\":" + to_string(session.machine->program->instructionList.size()) +
+                   ",\"pc\":" + to_string(session.machine->readPc()) + ",\"shared\":" + (shared ? "true" : "false");
+        }
+        if (command == "close")
+        {
+            lock_guard<mutex> guard(session.lock);
+            session.closing = true;
+            return id + "\"ok\":true";
+        }
+        if (!session.machine)
+            return fail("No program loaded");
+        if (command == "run")
+            return id + "\"ok\":true," + runSession(session, number("budget", LLONG_MAX));
+        if (command == "step")
+            return id + "\"ok\":true," + runSession(session, number("count", 1));
+        if (command == "regs")
+        {
+            string response = id + "\"ok\":true,\"pc\":" + to_string(session.machine->readPc()) + ",\"x\":[";
+            for (int i = 0; i < 32; i++)
+                response += (i ? ",\"0x" : "\"0x") + decimalToHex(session.machine->readRegister(i), 16) + "\"";
+            return response + "]";
+        }
+        if (command == "mem")
+        {
+            ull address = number("address", 0), length = number("length", 0);
+            if (length > maxMemoryRead)
+                return fail("At most " + to_string(maxMemoryRead) + " bytes can be read at once");
+            string bytes(length, '\0');
+            if (!session.machine->readMemory(address, &bytes[0], length))
+                return fail("Cannot read memory at 0x" + decimalToHex(address, 16));
+            string data;
+            for (unsigned char byte : bytes)
+                data += decimalToHex(byte, 2);
+            return id + "\"ok\":true,\"address\":" + to_string(address) + ",\"data\":\"" + data + "\"";
+        }
+    }
+    catch (const exception &)
+    {
+        return fail("Invalid number");
+    }
+    return fail("Unknown command " + command);
+}
+
+// Function to write a whole response, the client may have gone away in the meantime
+void sendResponse(int fd, const string &response)
+{
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t result = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (result <= 0)
+            return;
+        sent += result;
+    }
+}
+
+// Function to answer the queued requests of a session until none are left, on a worker
+void serveSession(shared_ptr<Session> session, ProgramRegistry &registry)
+{
+    while (true)
+    {
+        string line;
+        {
+            lock_guard<mutex> guard(session->lock);
+            if (session->requests.empty() || session->closing)
+            {
+                session->busy = false;
+                return;
+            }
+            line = move(session->requests.front());
+            session->requests.pop_front();
+        }
+        sendResponse(session->fd, "{" + handleRequest(*session, registry, line) + "}\n");
+    }
+}
+
+// Function to serve newline-delimited JSON requests on a Unix domain socket until
+// interrupted. Every connection is a session with its own machine, requests of all
+// sessions are answered by a pool of worker threads
+bool runServer(const string &path, size_t threads)
+{
+    if (path.empty() || path.find_first_not_of("0123456789") == string::npos)
+    {
+        cerr << "Error: The server listens on a Unix domain socket path" << endl;
+        return false;
+    }
+    int listenFd = listenOn(path, SOMAXCONN);
+    if (listenFd < 0)
+    {
+        cerr << "Error: Cannot listen on " << path << endl;
+        return false;
+    }
+    stopServer = false;
+    signal(SIGINT, stopServerHandler);
+    signal(SIGTERM, stopServerHandler);
+    cout << "Serving on " << path << ", worker threads: " << threads << endl;
+
+    ProgramRegistry registry;
+    vector<shared_ptr<Session>> sessions;
+    {
+        WorkerPool pool(threads);
+        while (!stopServer)
+        {
+            // Sessions that hung up are dropped once their worker is done with them
+            for (size_t i = 0; i < sessions.size();)
+            {
+                lock_guard<mutex> guard(sessions[i]->lock);
+                if (sessions[i]->closing && !sessions[i]->busy)
+                {
+                    close(sessions[i]->fd);
+                    sessions[i] = sessions.back();
+                    sessions.pop_back();
+                }
+                else
+                    i++;
+            }
+
+            // A closing session is not read again, its fd would report end of file forever
+            vector<pollfd> watched = {{listenFd, POLLIN, 0}};
+            vector<shared_ptr<Session>> reading;
+            for (auto &session : sessions)
+            {
+                if (!session->closing)
+                {
+                    watched.push_back({session->fd, POLLIN, 0});
+                    reading.push_back(session);
+                }
+            }
+            // The timeout bounds how long stopping and closing sessions take
+            if (poll(watched.data(), watched.size(), 100) <= 0)
+                continue;
+
+            if (watched[0].revents & POLLIN)
+            {
+                int fd = accept(listenFd, nullptr, nullptr);
+                if (fd >= 0)
+                {
+                    sessions.push_back(make_shared<Session>());
+                    sessions.back()->fd = fd;
+                }
+            }
+            for (size_t i = 1; i < watched.size(); i++)
+            {
+                if (!watched[i].revents)
+                    continue;
+                shared_ptr<Session> session = reading[i - 1];
+                char buffer[65536];
+                ssize_t size = read(session->fd, buffer, sizeof(buffer));
+                lock_guard<mutex> guard(session->lock);
+                if (size <= 0 || session->received.size() > maxRequestLine)
+                {
+                    session->closing = true;
+                    continue;
+                }
+                session->received.append(buffer, size);
+                size_t end;
+                while ((end = session->received.find('\n')) != string::npos)
+                {
+                    session->requests.push_back(session->received.substr(0, end));
+                    session->received.erase(0, end + 1);
+                }
+                if (!session->requests.empty() && !session->busy && !session->closing)
+                {
+                    session->busy = true;
+                    pool.submit([session, &registry]
+                                { serveSession(session, registry); });
+                }
+            }
+        }
+    }
+    for (auto &session : sessions)
+        close(session->fd);
+    close(listenFd);
+    unlink(path.c_str());
+    cout << "Server stopped" << endl;
+    return true;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+using namespace std;
+
+bool runServer(const string &path, size_t threads);
@@ -1,21 +1,23 @@
 #include <string>
+#include <string_view>
 #include <cmath>
 #include <iostream>
 #include <bitset>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <stack>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "simulator.h"
+#include "selfprofile.h"
 
 using namespace std;
 typedef unsigned long long ull;
 typedef long long ll;
 
-vector<ll> registers(32, 0);          // Initialize all registers to 0
-unordered_map<string, string> memory; // Unordered map for storing memory
-string initialMemory = "10000";       // Start of data section
-stack<pair<string, int>> funStack;    // Stack for functions
-
 // Store aliases and actual register pairs
 unordered_map<string, string> regMap = {
     // Integer register aliases
@@ -217,8 +219,69 @@ int regToIndex(const string &reg)
     return regNum;
 }
 
+// Function to load a little endian value of the given size into a register,
+// the register is left unchanged when the access faults
+void Simulator::loadRegister(int rd, ull addr, int bytes, bool isUnsigned)
+{
+    ull value = 0;
+    if (!mmu.readGuest(addr, &value, bytes))
+        return;
+    if (!isUnsigned && bytes < 8)
+    {
+        int unusedBits = 64 - 8 * bytes;
+        value = (ll)(value << unusedBits) >> unusedBits; // Sign extend the loaded value
+    }
+    registers[rd] = value;
+}
+
+// Function to write a value of the given size to memory in little endian format
+void Simulator::storeMemory(ull address, ll value, int bytes)
+{
+    mmu.writeGuest(address, &value, bytes);
+}
+
+// Function to convert registers to indices without reporting errors
+int findRegister(string_view reg)
+{
+    string actualReg(reg);
+    auto alias = regMap.find(actualReg);
+    if (alias != regMap.end())
+        actualReg = alias->second;
+    if (actualReg.length() < 2 || actualReg.length() > 3 || (actualReg[0] != 'x' && actualReg[0] != 'f'))
+        return -1;
+    int regNum = 0;
+    for (size_t i = 1; i < actualReg.length(); i++)
+    {
+        if (!isdigit((unsigned char)actualReg[i]))
+            return -1;
+        regNum = regNum * 10 + (actualReg[i] - '0');
+    }
+    return regNum > 31 ? -1 : regNum;
+}
+
+// Function to convert a CSR name or a hexadecimal CSR number to the number, -1 when invalid
+int findCsr(string_view csr)
+{
+    if (csr == "cycle")
+        return CSR_CYCLE;
+    if (csr == "time")
+        return CSR_TIME;
+    if (csr == "instret")
+        return CSR_INSTRET;
+    if (csr.length() < 3 || csr.length() > 5 || csr.substr(0, 2) != "0x")
+        return -1;
+    int number = 0;
+    for (size_t i = 2; i < csr.length(); i++)
+    {
+        if (!isxdigit((unsigned char)csr[i]))
+            return -1;
+        number = number * 16 + (isdigit((unsigned char)csr[i]) ? csr[i] - '0' : tolower(csr[i]) - 'a' + 10);
+    }
+    return number;
+}
+
 // Function to run R format Instructions
-void runRFormat(const string &instruction)
+void Simulator::runRFormat(string_view instruction)
 {
     string operation, rd, rs1, rs2;
     size_t start = 0;
@@ -333,7 +396,7 @@ void runRFormat(const string &instruction)
 }
 
 // Function to run I format Instructions
-void runIFormat(const string &instruction, int &currentLine)
+void Simulator::runIFormat(string_view instruction, int &currentLine)
 {
     string operation;
     size_t start = 0;
@@ -543,75 +606,31 @@ void runIFormat(const string &instruction, int &currentLine)
         ull addr = (ull)registers[rs1Index] + (ull)immediateValue; // Calculate the address
         if (operation == "ld")
         {
-            string hexStr = "";
-            for (int i = 0; i < 8; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            registers[rdIndex] = hexToDecimal(hexStr); // Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 8, false);
         }
         else if (operation == "lw")
         {
-            string hexStr = "";
-            for (int i = 0; i < 4; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            registers[rdIndex] = hexToDecimal(hexStr); // Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 4, false);
         }
         else if (operation == "lh")
         {
-            string hexStr = "";
-            for (int i = 0; i < 2; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            registers[rdIndex] = hexToDecimal(hexStr); // Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 2, false);
         }
         else if (operation == "lb")
         {
-            string hexStr = "";
-            for (int i = 0; i < 1; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            registers[rdIndex] = hexToDecimal(hexStr); // Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 1, false);
         }
         else if (operation == "lwu")
         {
-            string hexStr = "";
-            for (int i = 0; i < 4; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            if (hexToDecimal(hexStr) < 0)
-                registers[rdIndex] = hexToDecimal(hexStr) + pow(2, 32); // Converts to deciaml and then unsigned if negative number
-            else
-                registers[rdIndex] = hexToDecimal(hexStr); //  Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 4, true);
         }
         else if (operation == "lhu")
         {
-            string hexStr = "";
-            for (int i = 0; i < 2; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            if (hexToDecimal(hexStr) < 0)
-                registers[rdIndex] = hexToDecimal(hexStr) + pow(2, 16); // Converts to deciaml and then unsigned if negative number
-            else
-                registers[rdIndex] = hexToDecimal(hexStr); //  Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 2, true);
         }
         else if (operation == "lbu")
         {
-            string hexStr = "";
-            for (int i = 0; i < 1; i++)
-            {
-                hexStr = memory[decimalToHex(addr + i, 5)] + hexStr; // Adds the whole value in little endian format
-            }
-            if (hexToDecimal(hexStr) < 0)
-                registers[rdIndex] = hexToDecimal(hexStr) + pow(2, 8); // Converts to deciaml and then unsigned if negative number
-            else
-                registers[rdIndex] = hexToDecimal(hexStr); //  Stores the value after converting it to decimal
+            loadRegister(rdIndex, addr, 1, true);
         }
         else if (operation == "jalr")
         {
@@ -622,7 +641,7 @@ void runIFormat(const string &instruction, int &currentLine)
 }
 
 // Function to run B format Instructions
-void runBFormat(const string &instruction, const unordered_map<string, int> &labelAddresses, int &currentLine)
+void Simulator::runBFormat(string_view instruction, int &currentLine)
 {
     string operation, rs1, rs2, label;
     size_t start = 0;
@@ -703,13 +722,13 @@ void runBFormat(const string &instruction, const unordered_map<string, int> &lab
     ll reg2Value = registers[reg2Index];
 
     // Check if label exists
-    if (labelAddresses.find(label) == labelAddresses.end())
+    if (program->labelAddresses.find(label) == program->labelAddresses.end())
     {
         cerr << "Error: Label not found." << endl;
         return;
     }
 
-    int targetLine = labelAddresses.at(label);
+    int targetLine = program->labelAddresses.at(label);
     ull reg1Unsigned;
     ull reg2Unsigned;
     if(reg1Value<0) reg1Unsigned = reg1Value + pow(2,64);
@@ -729,7 +748,7 @@ void runBFormat(const string &instruction, const unordered_map<string, int> &lab
 }
 
 // Function to run S format Instructions
-void runSFormat(const string &instruction)
+void Simulator::runSFormat(string_view instruction)
 {
     string operation, rs1, rs2, immediateWithRegister;
     size_t start = 0;
@@ -800,37 +819,24 @@ void runSFormat(const string &instruction)
     ull address = registers[reg1Index] + (ull)immediateValue;// Calculate address
     if (operation == "sd")
     {
-        string numHex = decimalToHex(registers[reg2Index], 16);
-        for (int i = 0; i < 8; i++)
-        {
-            memory[decimalToHex(address + i, 5)] = numHex.substr(16 - (i + 1) * 2, 2);// Store 8 bytes at time
-        }
+        storeMemory(address, registers[reg2Index], 8);
     }
     else if (operation == "sw")
     {
-        string numHex = decimalToHex(registers[reg2Index], 8);
-        for (int i = 0; i < 4; i++)
-        {
-            memory[decimalToHex(address + i, 5)] = numHex.substr(8 - (i + 1) * 2, 2);// Store 8 bytes at time
-        }
+        storeMemory(address, registers[reg2Index], 4);
     }
     else if (operation == "sh")
     {
-        string numHex = decimalToHex(registers[reg2Index], 4);
-        for (int i = 0; i < 2; i++)
-        {
-            memory[decimalToHex(address + i, 5)] = numHex.substr(4 - (i + 1) * 2, 2);// Store 8 bytes at time
-        }
+        storeMemory(address, registers[reg2Index], 2);
     }
     else if (operation == "sb")
     {
-        string numHex = decimalToHex(registers[reg2Index], 2);// Store 8 bytes at time
-        memory[decimalToHex(address, 5)] = numHex;
+        storeMemory(address, registers[reg2Index], 1);
     }
 }
 
 // Function to run J format Instructions
-void runJFormat(const string &instruction, const unordered_map<string, int> &labelAddresses, int &currentLine)
+void Simulator::runJFormat(string_view instruction, int &currentLine)
 {
     string operation, rd, label;
     size_t start = 0;
@@ -888,9 +894,9 @@ void runJFormat(const string &instruction, const unordered_map<string, int> &lab
     }
 
     // Check if the immediate is a label or a number
-    if (labelAddresses.find(label) != labelAddresses.end())
+    if (program->labelAddresses.find(label) != program->labelAddresses.end())
     {
-        int targetLine = labelAddresses.at(label);
+        int targetLine = program->labelAddresses.at(label);
         registers[rdIndex] = (currentLine + 1) * 4;
         funStack.push({label, currentLine + 1});
         currentLine = targetLine - 1; // Calculate the jump
@@ -903,7 +909,7 @@ void runJFormat(const string &instruction, const unordered_map<string, int> &lab
 }
 
 // Function to run U format Instructions
-void runUFormat(const string &instruction)
+void Simulator::runUFormat(string_view instruction)
 {
     string operation, rd, immediate;
     size_t start = 0;
@@ -987,7 +993,289 @@ void runUFormat(const string &instruction)
     registers[rdIndex] = immediateValue * 4096;
 }
 
-void runInstruction(const string &instruction, int &lineNumber, const unordered_map<string, int> &labelAddresses)
+// Zba and Zbb operations with two registers, one register and a shift amount, or one register
+const unordered_set<string> bitManipBinary = {"add.uw", "sh1add", "sh2add", "sh3add", "sh1add.uw", "sh2add.uw", "sh3add.uw",
+                                              "andn", "orn", "xnor", "max", "maxu", "min", "minu", "rol", "rolw", "ror", "rorw"};
+const unordered_set<string> bitManipImmediate = {"slli.uw", "rori", "roriw"};
+const unordered_set<string> bitManipUnary = {"clz", "clzw", "ctz", "ctzw", "cpop", "cpopw", "sext.b", "sext.h", "zext.h",
+                                             "orc.b", "rev8", "zext.w"};
+
+// Function to compute a Zba or Zbb operation one bit or byte at a time, the reference
+// for the pre-decoded engine that uses host builtins
+ull bitManipResult(const string &operation, ull first, ull second)
+{
+    bool word = operation == "rolw" || operation == "rorw" || operation == "roriw" || operation == "clzw" ||
+                operation == "ctzw" || operation == "cpopw";
+    int width = word ? 32 : 64;
+    if (width == 32)
+        first &= 0xFFFFFFFFULL;
+
+    if (operation == "add.uw" || operation == "zext.w")
+        return second + (first & 0xFFFFFFFFULL);
+    if (operation.substr(0, 2) == "sh")
+    {
+        ull base = operation.size() > 6 ? first & 0xFFFFFFFFULL : first;
+        return second + base * (1ULL << (operation[2] - '0'));
+    }
+    if (operation == "slli.uw")
+        return (first & 0xFFFFFFFFULL) << second;
+    if (operation == "andn")
+        return first & ~second;
+    if (operation == "orn")
+        return first | ~second;
+    if (operation == "xnor")
+        return ~(first ^ second);
+    if (operation == "max")
+        return (ll)first > (ll)second ? first : second;
+    if (operation == "maxu")
+        return first > second ? first : second;
+    if (operation == "min")
+        return (ll)first < (ll)second ? first : second;
+    if (operation == "minu")
+        return first < second ? first : second;
+
+    ull result = 0;
+    if (operation.substr(0, 3) == "rol" || operation.substr(0, 3) == "ror")
+    {
+        // Move every bit to its rotated position, sign extending the word forms
+        int shift = second % width;
+        if (operation[2] == 'l')
+            shift = (width - shift) % width;
+        for (int bit = 0; bit < width; bit++)
+        {
+            if (first >> bit & 1)
+                result |= 1ULL << ((bit - shift + width) % width);
+        }
+        return width == 32 ? (ull)(ll)(int32_t)result : result;
+    }
+    if (operation.substr(0, 3) == "clz")
+    {
+        while (result < (ull)width && !(first >> (width - 1 - result) & 1))
+            result++;
+        return result;
+    }
+    if (operation.substr(0, 3) == "ctz")
+    {
+        while (result < (ull)width && !(first >> result & 1))
+            result++;
+        return result;
+    }
+    if (operation.substr(0, 4) == "cpop")
+    {
+        for (int bit = 0; bit < width; bit++)
+            result += first >> bit & 1;
+        return result;
+    }
+    if (operation == "sext.b")
+        return (first & 0x80) ? first | ~0xFFULL : first & 0xFF;
+    if (operation == "sext.h")
+        return (first & 0x8000) ? first | ~0xFFFFULL : first & 0xFFFF;
+    if (operation == "zext.h")
+        return first & 0xFFFF;
+    for (int byte = 0; byte < 8; byte++)
+    {
+        ull value = first >> (8 * byte) & 0xFF;
+        if (operation == "orc.b")
+            result |= (value ? 0xFFULL : 0) << (8 * byte);
+        else // rev8
+            result |= value << (8 * (7 - byte));
+    }
+    return result;
+}
+
+// Function to run a Zba or Zbb instruction from its text
+void Simulator::runBitManipFormat(string_view instruction)
+{
+    size_t start = instruction.find(' ');
+    string operation(instruction.substr(0, start));
+    vector<string> operands;
+    while (start != string::npos)
+    {
+        size_t end = instruction.find(',', start + 1);
+        operands.push_back(string(instruction.substr(start + 1, end == string::npos ? string::npos : end - start - 1)));
+        if (end != string::npos && (end + 1 >= instruction.length() || instruction[end + 1] != ' '))
+        {
+            cerr << "Error: Expected space after comma." << endl;
+            return;
+        }
+        start = end == string::npos ? end : end + 1;
+    }
+
+    size_t expected = bitManipUnary.count(operation) ? 2 : 3;
+    if (operands.size() != expected || operands.back().empty() || operands.back().find(' ') != string::npos)
+    {
+        cerr << "Error: Too few or too many parameters." << endl;
+        return;
+    }
+    int rdIndex = regToIndex(operands[0]);
+    int rs1Index = regToIndex(operands[1]);
+    if (rdIndex == -1 || rs1Index == -1)
+    {
+        cerr << "Error: Invalid register format." << endl;
+        return;
+    }
+
+    // zext.w reads x0 as its second source like add.uw does
+    ull second = registers[0];
+    if (bitManipImmediate.count(operation))
+    {
+        int limit = operation == "roriw" ? 31 : 63;
+        if (!isValidDecimal(operands[2]) || operands[2].length() > 3 || stoi(operands[2]) < 0 || stoi(operands[2]) > limit)
+        {
+            cerr << "Error: Shift amount out of range (0 to " << limit << ")." << endl;
+            return;
+        }
+        second = stoi(operands[2]);
+    }
+    else if (expected == 3)
+    {
+        int rs2Index = regToIndex(operands[2]);
+        if (rs2Index == -1)
+        {
+            cerr << "Error: Invalid register format." << endl;
+            return;
+        }
+        second = registers[rs2Index];
+    }
+    registers[rdIndex] = bitManipResult(operation, registers[rs1Index], second);
+}
+
+// Function to run a Zicsr instruction from its text: csrrw, csrrs and csrrc with a
+// register or an immediate, csrr and the counter reads rdcycle, rdtime and rdinstret
+void Simulator::runCsrFormat(string_view instruction, int &lineNumber)
+{
+    size_t start = instruction.find(' ');
+    if (start == string::npos)
+    {
+        cerr << "Error: Missing space after the operation." << endl;
+        return;
+    }
+    string operation(instruction.substr(0, start));
+    string rd, csr, source;
+    start++;
+
+    if (operation.substr(0, 2) == "rd")
+    {
+        rd = instruction.substr(start);
+        csr = operation.substr(2);
+    }
+    else
+    {
+        // Extract rd until comma
+        size_t end = instruction.find(',', start);
+        if (end == string::npos || end + 1 >= instruction.length() || instruction[end + 1] != ' ')
+        {
+            cerr << "Error: Missing comma after rd." << endl;
+            return;
+        }
+        rd = instruction.substr(start, end - start);
+        start = end + 2;
+
+        // csrr has no source, the others have one after the CSR
+        end = operation == "csrr" ? string::npos : instruction.find(',', start);
+        if (operation != "csrr" && (end == string::npos || end + 1 >= instruction.length() || instruction[end + 1] != ' '))
+        {
+            cerr << "Error: Missing comma after the CSR." << endl;
+            return;
+        }
+        csr = instruction.substr(start, end - start);
+        if (end != string::npos)
+            source = instruction.substr(end + 2);
+    }
+
+    int rdIndex = regToIndex(rd);
+    if (rdIndex == -1)
+    {
+        cerr << "Error: Invalid register format." << endl;
+        return;
+    }
+    int csrNumber = findCsr(csr);
+    if (csrNumber == -1)
+    {
+        cerr << "Error: Invalid CSR " << csr << "." << endl;
+        return;
+    }
+
+    // csrrw always writes, csrrs and csrrc only with a source other than x0 or 0
+    bool writes = false;
+    if (operation == "csrrwi" || operation == "csrrsi" || operation == "csrrci")
+    {
+        if (!isValidDecimal(source) || source.length() > 3 || stoi(source) < 0 || stoi(source) > 31)
+        {
+            cerr << "Error: CSR immediate must be between 0 and 31." << endl;
+            return;
+        }
+        writes = operation == "csrrwi" || stoi(source) != 0;
+    }
+    else if (operation == "csrrw" || operation == "csrrs" || operation == "csrrc")
+    {
+        int sourceIndex = regToIndex(source);
+        if (sourceIndex == -1)
+        {
+            cerr << "Error: Invalid register format." << endl;
+            return;
+        }
+        writes = operation == "csrrw" || sourceIndex != 0;
+    }
+    runCsr(rdIndex, csrNumber, writes, lineNumber);
+}
+
+// Function to read a CSR into rd. Only the Zicntr counters exist and they are read-only,
+// so an instruction that would write one does nothing but report the error
+void Simulator::runCsr(int rd, int csr, bool writes, int &lineNumber)
+{
+    static const char *counterNames[] = {"cycle", "time", "instret"};
+    if (csr < CSR_CYCLE || csr > CSR_INSTRET)
+    {
+        cerr << "Error: CSR 0x" << decimalToHex(csr, 3) << " is not implemented." << endl;
+        return;
+    }
+    if (writes)
+    {
+        cerr << "Error: CSR " << counterNames[csr - CSR_CYCLE] << " is read-only." << endl;
+        return;
+    }
+    ll value = 0;
+    if (csr == CSR_INSTRET)
+        value = retiredCount;
+    else if (csr == CSR_CYCLE)
+        value = retiredCount + modelledCycles;
+    else if (!readTimer(lineNumber, value))
+        return;
+    registers[rd] = value;
+}
+
+// Function to run sfence.vma, which drops cached address translations
+void Simulator::runSfence(string_view instruction)
+{
+    if (instruction.length() == 10)
+    {
+        mmu.flushTlb();
+        return;
+    }
+
+    // Extract rs1 and rs2 after the operation
+    size_t start = 11;
+    size_t end = instruction.find(',', start);
+    if (instruction[10] != ' ' || end == string::npos || end + 1 >= instruction.length() || instruction[end + 1] != ' ')
+    {
+        cerr << "Error: Expected sfence.vma rs1, rs2." << endl;
+        return;
+    }
+    int rs1Index = regToIndex(string(instruction.substr(start, end - start)));
+    int rs2Index = regToIndex(string(instruction.substr(end + 2)));
+    if (rs1Index == -1 || rs2Index == -1)
+    {
+        cerr << "Error: Invalid register format." << endl;
+        return;
+    }
+    if (rs1Index == 0)
+        mmu.flushTlb();
+    else
+        mmu.flushTlbPage(registers[rs1Index]);
+}
+
+void Simulator::runInstruction(string_view instruction, int &lineNumber)
 {
     string operation;
     size_t i = 0;
@@ -1025,13 +1313,13 @@ void runInstruction(const string &instruction, int &lineNumber, const unordered_
     else if (operation == "beq" || operation == "bne" || operation == "blt" || operation == "bge" ||
              operation == "bltu" || operation == "bgeu")
     {
-        runBFormat(instruction, labelAddresses, lineNumber);
+        runBFormat(instruction, lineNumber);
     }
 
     // J-format instructions
     else if (operation == "jal")
     {
-        runJFormat(instruction, labelAddresses, lineNumber);
+        runJFormat(instruction, lineNumber);
     }
 
     // U-format instructions
@@ -1040,6 +1328,30 @@ void runInstruction(const string &instruction, int &lineNumber, const unordered_
         runUFormat(instruction);
     }
 
+    // Address translation fence
+    else if (operation == "sfence.vma")
+    {
+        runSfence(instruction);
+    }
+
+    // Zba and Zbb instructions
+    else if (bitManipBinary.count(operation) || bitManipImmediate.count(operation) || bitManipUnary.count(operation))
+    {
+        runBitManipFormat(instruction);
+    }
+
+    // Zicsr instructions and the counter reads
+    else if (operation.substr(0, 3) == "csr" || operation == "rdcycle" || operation == "rdtime" || operation == "rdinstret")
+    {
+        runCsrFormat(instruction, lineNumber);
+    }
+
+    // Environment call
+    else if (instruction == "ecall")
+    {
+        runEcall(lineNumber);
+    }
+
     // If instruction not found then gives error
     else
     {
@@ -1047,15 +1359,340 @@ void runInstruction(const string &instruction, int &lineNumber, const unordered_
     }
 }
 
+// Function to check the condition of a decoded branch
+bool branchTaken(const DecodedInstruction &decoded, const vector<ll> &registers)
+{
+    ll reg1Value = registers[decoded.rs1];
+    ll reg2Value = registers[decoded.rs2];
+    switch (decoded.op)
+    {
+    case OP_BEQ:
+        return reg1Value == reg2Value;
+    case OP_BNE:
+        return reg1Value != reg2Value;
+    case OP_BLT:
+        return reg1Value < reg2Value;
+    case OP_BGE:
+        return reg1Value >= reg2Value;
+    default:
+    {
+        // Same unsigned conversion as runBFormat so both engines agree
+        ull reg1Unsigned = reg1Value < 0 ? reg1Value + pow(2, 64) : reg1Value;
+        ull reg2Unsigned = reg2Value < 0 ? reg2Value + pow(2, 64) : reg2Value;
+        return decoded.op == OP_BLTU ? reg1Unsigned < reg2Unsigned : reg1Unsigned >= reg2Unsigned;
+    }
+    }
+}
+
+// Function to run an instruction decoded at load time
+// Function to rotate right by the low 6 bits of count, which makes a negative count rotate left
+inline ull rotateRight(ull value, ll count)
+{
+    int shift = count & 63;
+    return (value >> shift) | (value << ((64 - shift) & 63));
+}
+
+// Function to rotate a 32 bit word right by the low 5 bits of count
+inline uint32_t rotateRightWord(uint32_t value, ll count)
+{
+    int shift = count & 31;
+    return (value >> shift) | (value << ((32 - shift) & 31));
+}
+
+void Simulator::runDecoded(const DecodedInstruction &decoded, string_view instruction, int &lineNumber)
+{
+    const int rd = decoded.rd;
+    const int rs1 = decoded.rs1;
+    const int rs2 = decoded.rs2;
+    const ll imm = decoded.imm;
+
+    switch (decoded.op)
+    {
+    case OP_ADD:
+        registers[rd] = registers[rs1] + registers[rs2];
+        break;
+    case OP_SUB:
+        registers[rd] = registers[rs1] - registers[rs2];
+        break;
+    case OP_XOR:
+        registers[rd] = registers[rs1] ^ registers[rs2];
+        break;
+    case OP_OR:
+        registers[rd] = registers[rs1] | registers[rs2];
+        break;
+    case OP_AND:
+        registers[rd] = registers[rs1] & registers[rs2];
+        break;
+    case OP_SLL:
+        registers[rd] = registers[rs1] << registers[rs2];
+        break;
+    case OP_SRL:
+        registers[rd] = (unsigned)((ull)registers[rs1] >> registers[rs2]);
+        break;
+    case OP_SRA:
+        registers[rd] = registers[rs1] >> registers[rs2];
+        break;
+    case OP_ADDI:
+        registers[rd] = registers[rs1] + imm;
+        break;
+    case OP_XORI:
+        registers[rd] = registers[rs1] ^ imm;
+        break;
+    case OP_ORI:
+        registers[rd] = registers[rs1] | imm;
+        break;
+    case OP_ANDI:
+        registers[rd] = registers[rs1] & imm;
+        break;
+    case OP_SLLI:
+        registers[rd] = registers[rs1] << imm;
+        break;
+    case OP_SRLI:
+        registers[rd] = ((ull)registers[rs1] >> imm) & ((1ULL << (64 - imm)) - 1);
+        break;
+    case OP_SRAI:
+        registers[rd] = registers[rs1] >> imm;
+        break;
+    case OP_LB:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 1, false);
+        break;
+    case OP_LH:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 2, false);
+        break;
+    case OP_LW:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 4, false);
+        break;
+    case OP_LD:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 8, false);
+        break;
+    case OP_LBU:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 1, true);
+        break;
+    case OP_LHU:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 2, true);
+        break;
+    case OP_LWU:
+        loadRegister(rd, (ull)registers[rs1] + (ull)imm, 4, true);
+        break;
+    case OP_JALR:
+        if (coverage)
+            recordEdge(lineNumber, registers[rs1] / 4);
+        lineNumber = registers[rs1] / 4 - 1;
+        funStack.pop();
+        break;
+    case OP_SB:
+        storeMemory(registers[rs1] + (ull)imm, registers[rs2], 1);
+        break;
+    case OP_SH:
+        storeMemory(registers[rs1] + (ull)imm, registers[rs2], 2);
+        break;
+    case OP_SW:
+        storeMemory(registers[rs1] + (ull)imm, registers[rs2], 4);
+        break;
+    case OP_SD:
+        storeMemory(registers[rs1] + (ull)imm, registers[rs2], 8);
+        break;
+    case OP_BEQ:
+    case OP_BNE:
+    case OP_BLT:
+    case OP_BGE:
+    case OP_BLTU:
+    case OP_BGEU:
+    {
+        int from = lineNumber;
+        if (branchTaken(decoded, registers))
+            lineNumber = decoded.target - 1;
+        if (coverage)
+            recordEdge(from, lineNumber + 1);
+        break;
+    }
+    case OP_SFENCE_VMA:
+        if (rs1 == 0)
+            mmu.flushTlb();
+        else
+            mmu.flushTlbPage(registers[rs1]);
+        break;
+    case OP_ECALL:
+        runEcall(lineNumber);
+        break;
+    case OP_ADD_UW:
+        registers[rd] = registers[rs2] + (ll)(uint32_t)registers[rs1];
+        break;
+    case OP_SH1ADD:
+        registers[rd] = registers[rs2] + (ll)((ull)registers[rs1] << 1);
+        break;
+    case OP_SH2ADD:
+        registers[rd] = registers[rs2] + (ll)((ull)registers[rs1] << 2);
+        break;
+    case OP_SH3ADD:
+        registers[rd] = registers[rs2] + (ll)((ull)registers[rs1] << 3);
+        break;
+    case OP_SH1ADD_UW:
+        registers[rd] = registers[rs2] + (ll)((ull)(uint32_t)registers[rs1] << 1);
+        break;
+    case OP_SH2ADD_UW:
+        registers[rd] = registers[rs2] + (ll)((ull)(uint32_t)registers[rs1] << 2);
+        break;
+    case OP_SH3ADD_UW:
+        registers[rd] = registers[rs2] + (ll)((ull)(uint32_t)registers[rs1] << 3);
+        break;
+    case OP_ANDN:
+        registers[rd] = registers[rs1] & ~registers[rs2];
+        break;
+    case OP_ORN:
+        registers[rd] = registers[rs1] | ~registers[rs2];
+        break;
+    case OP_XNOR:
+        registers[rd] = ~(registers[rs1] ^ registers[rs2]);
+        break;
+    case OP_MAX:
+        registers[rd] = max(registers[rs1], registers[rs2]);
+        break;
+    case OP_MAXU:
+        registers[rd] = max((ull)registers[rs1], (ull)registers[rs2]);
+        break;
+    case OP_MIN:
+        registers[rd] = min(registers[rs1], registers[rs2]);
+        break;
+    case OP_MINU:
+        registers[rd] = min((ull)registers[rs1], (ull)registers[rs2]);
+        break;
+    case OP_ROL:
+        registers[rd] = rotateRight((ull)registers[rs1], -registers[rs2]);
+        break;
+    case OP_ROLW:
+        registers[rd] = (int32_t)rotateRightWord((uint32_t)registers[rs1], -registers[rs2]);
+        break;
+    case OP_ROR:
+        registers[rd] = rotateRight((ull)registers[rs1], registers[rs2]);
+        break;
+    case OP_RORW:
+        registers[rd] = (int32_t)rotateRightWord((uint32_t)registers[rs1], registers[rs2]);
+        break;
+    case OP_SLLI_UW:
+        registers[rd] = (ll)((ull)(uint32_t)registers[rs1] << imm);
+        break;
+    case OP_RORI:
+        registers[rd] = rotateRight((ull)registers[rs1], imm);
+        break;
+    case OP_RORIW:
+        registers[rd] = (int32_t)rotateRightWord((uint32_t)registers[rs1], imm);
+        break;
+    case OP_CLZ:
+        registers[rd] = registers[rs1] ? __builtin_clzll(registers[rs1]) : 64;
+        break;
+    case OP_CLZW:
+        registers[rd] = (uint32_t)registers[rs1] ? __builtin_clz((uint32_t)registers[rs1]) : 32;
+        break;
+    case OP_CTZ:
+        registers[rd] = registers[rs1] ? __builtin_ctzll(registers[rs1]) : 64;
+        break;
+    case OP_CTZW:
+        registers[rd] = (uint32_t)registers[rs1] ? __builtin_ctz((uint32_t)registers[rs1]) : 32;
+        break;
+    case OP_CPOP:
+        registers[rd] = __builtin_popcountll(registers[rs1]);
+        break;
+    case OP_CPOPW:
+        registers[rd] = __builtin_popcount((uint32_t)registers[rs1]);
+        break;
+    case OP_SEXT_B:
+        registers[rd] = (int8_t)registers[rs1];
+        break;
+    case OP_SEXT_H:
+        registers[rd] = (int16_t)registers[rs1];
+        break;
+    case OP_ZEXT_H:
+        registers[rd] = (uint16_t)registers[rs1];
+        break;
+    case OP_ORC_B:
+    {
+        // The top bit of each byte is set when any bit of the byte is, then spread
+        ull value = registers[rs1];
+        ull nonZero = (((value & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | value) & 0x8080808080808080ULL;
+        registers[rd] = (nonZero >> 7) * 0xFF;
+        break;
+    }
+    case OP_REV8:
+        registers[rd] = __builtin_bswap64(registers[rs1]);
+        break;
+    case OP_CSRRW:
+    case OP_CSRRS:
+    case OP_CSRRC:
+    case OP_CSRRWI:
+    case OP_CSRRSI:
+    case OP_CSRRCI:
+        // csrrw always writes, csrrs and csrrc only with a source other than x0 or 0
+        runCsr(rd, imm, decoded.op == OP_CSRRW || decoded.op == OP_CSRRWI || rs1 != 0, lineNumber);
+        break;
+    case OP_JAL:
+        registers[rd] = (lineNumber + 1) * 4;
+        funStack.push({string(program->labelNames[imm]), lineNumber + 1});
+        if (coverage)
+            recordEdge(lineNumber, decoded.target);
+        lineNumber = decoded.target - 1;
+        break;
+    case OP_LUI:
+        registers[rd] = (ull)imm * 4096;
+        break;
+    default:
+        runInstruction(instruction, lineNumber);
+        break;
+    }
+}
+
+// Size and signedness of the loads from OP_LB to OP_LWU
+const int loadWidth[] = {1, 2, 4, 8, 1, 2, 4};
+const bool loadUnsigned[] = {false, false, false, false, true, true, true};
+
+// Function to run two adjacent instructions fused by fuseProgram in a single dispatch,
+// lineNumber is the line of the first one and ends on the second unless a branch is taken
+void Simulator::runFused(uint8_t fusion, const DecodedInstruction &first, const DecodedInstruction &second, int &lineNumber)
+{
+    switch (fusion)
+    {
+    case FUSE_LUI_ADDI:
+        registers[first.rd] = (ll)((ull)first.imm * 4096) + second.imm;
+        break;
+    case FUSE_SLLI_ADD:
+        registers[first.rd] = registers[first.rs1] << first.imm;
+        registers[second.rd] = registers[second.rs1] + registers[second.rs2];
+        break;
+    case FUSE_ADDI_LOAD:
+        registers[first.rd] = registers[first.rs1] + first.imm;
+        loadRegister(second.rd, (ull)registers[second.rs1] + (ull)second.imm,
+                     loadWidth[second.op - OP_LB], loadUnsigned[second.op - OP_LB]);
+        break;
+    case FUSE_ADD_LOAD:
+        registers[first.rd] = registers[first.rs1] + registers[first.rs2];
+        loadRegister(second.rd, (ull)registers[second.rs1] + (ull)second.imm,
+                     loadWidth[second.op - OP_LB], loadUnsigned[second.op - OP_LB]);
+        break;
+    case FUSE_ADDI_BRANCH:
+        registers[first.rd] = registers[first.rs1] + first.imm;
+        if (branchTaken(second, registers))
+        {
+            if (coverage)
+                recordEdge(lineNumber + 1, second.target);
+            lineNumber = second.target - 1;
+            return;
+        }
+        if (coverage)
+            recordEdge(lineNumber + 1, lineNumber + 2);
+        break;
+    }
+    lineNumber++;
+}
+
 // Function to print register values
-void printRegisters()
+void Simulator::printRegisters()
 {
+    PhaseScope scope(PHASE_OUTPUT);
     cout << "Registers:" << endl;
     for (int i = 0; i < 32; i++)
     {
         string regHex = decimalToHex(registers[i], 16);// Convert deciaml to hex
-        while (regHex[0] == '0' && regHex.length() > 1)
-            regHex = regHex.substr(1);
+        regHex.erase(0, min(regHex.find_first_not_of('0'), regHex.size() - 1));
         if (i > 9)
             cout << "x" << i << " = 0x" << regHex << endl;
         else
@@ -1064,217 +1701,340 @@ void printRegisters()
 }
 
 // Function to print memory
-void printMemory(string address, int count)
+void Simulator::printMemory(ull address, ll count)
 {
-    ll addr = hexToDecimal(address.substr(2));
-    for (int i = addr; i < addr + count; i++)
+    PhaseScope scope(PHASE_OUTPUT);
+    // Addresses take at least 5 hex digits, more when any of them needs it
+    int digits = 5;
+    while (digits < 16 && (address + count - 1) >> (4 * digits))
+        digits++;
+    for (ull i = address; i < address + count; i++)
     {
-        if(i<65336 || i>327680){
-            cerr << "Cannot view memory beyond data section";
-            return;
-        } 
-        string location = decimalToHex(i, 5);
-        cout << "Memory[0x" << location << "] = 0x";
-        if (memory[location] == "")
-            cout << "0" << endl;
-        else
-            cout << memory[location] << endl;
+        string location = decimalToHex(i, digits);
+        cout << "Memory[0x" << location << "] = 0x" << decimalToHex(memory.readByte(i), 2) << endl;
     }
 }
 
-// Function to set register values back to 0
-void resetRegisters()
+// Function to print the regions of the address space and the files mapped into it
+void Simulator::printRegions()
 {
-    for (int i = 0; i < 32; i++)
+    cout << "text  0x" << decimalToHex(0, 16) << "-0x" << decimalToHex(program->instructionList.size() * 4, 16) << endl;
+    cout << "data  0x" << decimalToHex(dataStart, 16) << "-0x" << decimalToHex(dataAddress, 16) << endl;
+    cout << "heap  0x" << decimalToHex(heapStart, 16) << "-0x" << decimalToHex(programBreak, 16) << endl;
+    cout << "stack 0x" << decimalToHex(stackTop - stackSize, 16) << "-0x" << decimalToHex(stackTop, 16) << endl;
+    for (const FileMapping &mapping : memory.allMappings())
+        cout << "file  0x" << decimalToHex(mapping.start, 16) << "-0x" << decimalToHex(mapping.start + mapping.length, 16)
+             << " " << (mapping.writable ? "rw " : "ro ") << mapping.path << endl;
+}
+
+// Function to parse one data value given in decimal or hex
+bool parseDataValue(string_view text, ull &value)
+{
+    bool negative = false;
+    if (!text.empty() && text[0] == '-')
+    {
+        negative = true;
+        text.remove_prefix(1);
+    }
+    int base = 10;
+    if (text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
     {
-        registers[i] = 0;
+        base = 16;
+        text.remove_prefix(2);
+    }
+    if (text.empty())
+        return false;
+    value = 0;
+    for (char c : text)
+    {
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+        value = value * base + digit;
     }
+    if (negative)
+        value = -value;
+    return true;
 }
 
-// Function to set memory values back to 0
-void resetMemory()
+// Function to split directive operands separated by commas or spaces
+vector<string_view> splitOperands(string_view values)
 {
-    memory.clear();
+    vector<string_view> result;
+    size_t start = 0;
+    while (start < values.size())
+    {
+        size_t end = values.find_first_of(", \t", start);
+        if (end == string_view::npos)
+            end = values.size();
+        if (end > start)
+            result.push_back(values.substr(start, end - start));
+        start = end + 1;
+    }
+    return result;
 }
 
-// Function to store .dword values from data section in memory
-void setDoubleword(vector<string> dataValues)
+// Function to store .dword, .word, .half and .byte values from data section in memory
+bool Simulator::setDataValues(string_view values, int size)
 {
-    // Case when data values are decimal
-    if (dataValues[0].substr(0, 2) != "0x")
+    vector<unsigned char> block;
+    block.reserve(values.size() / 2 * size);
+    size_t start = 0;
+    while (start < values.size())
     {
-        for (int i = 0; i < dataValues.size(); i++)
+        size_t end = values.find_first_of(", \t", start);
+        if (end == string_view::npos)
+            end = values.size();
+        if (end > start)
         {
-            string decimal = dataValues[i];
-            if (isValidDecimal(decimal))
-            {
-                ll temp = (ll)stoll(decimal);
-                dataValues[i] = decimalToHex(temp, 16);// Double words are of 64 bytes 
-            }
-            else
+            ull value;
+            if (!parseDataValue(values.substr(start, end - start), value))
             {
                 cerr << "Invalid data input." << endl;
-                return;
+                return false;
             }
+            for (int i = 0; i < size; i++)
+                block.push_back((value >> (8 * i)) & 0xFF); // Little endian
         }
+        start = end + 1;
     }
-    // Case when data values are hex
-    else
-    {
-        for (int i = 0; i < dataValues.size(); i++)
-        {
-            dataValues[i] = dataValues[i].substr(2);
-        }
-    }
-    // Storing values 8 byte at a time
-    for (int i = 0; i < dataValues.size(); i++)
+    // Copy all the values into memory in one go
+    memory.copyIn(dataAddress, block.data(), block.size());
+    dataAddress += block.size();
+    return true;
+}
+
+// Function to reserve bytes for .space/.zero, filled with an optional value
+bool Simulator::setSpace(string_view values)
+{
+    vector<string_view> operands = splitOperands(values);
+    ull size, value = 0;
+    if (operands.empty() || operands.size() > 2 || !parseDataValue(operands[0], size) ||
+        (operands.size() == 2 && !parseDataValue(operands[1], value)))
     {
-        ll addr = hexToDecimal(initialMemory);
-        while (dataValues[i].length() < 16)
-            dataValues[i] = "0" + dataValues[i];
-        for (int j = addr; j < addr + 8; j++)
-        {
-            string location = decimalToHex(j, 5);
-            memory[location] = dataValues[i].substr(16 - (j - addr + 1) * 2, 2);
-        }
-        initialMemory = decimalToHex(addr + 8, 5);
+        cerr << "Invalid data input." << endl;
+        return false;
     }
+    memory.fill(dataAddress, value & 0xFF, size);
+    dataAddress += size;
+    return true;
 }
 
-// Function to store .half values from data section in memory
-void setHalfword(vector<string> dataValues)
+// Function to handle .fill repeat, size, value
+bool Simulator::setFill(string_view values)
 {
-    // Case when data values are decimal
-    if (dataValues[0].substr(0, 2) != "0x")
+    vector<string_view> operands = splitOperands(values);
+    ull repeat, size = 1, value = 0;
+    if (operands.empty() || operands.size() > 3 || !parseDataValue(operands[0], repeat) ||
+        (operands.size() > 1 && !parseDataValue(operands[1], size)) ||
+        (operands.size() > 2 && !parseDataValue(operands[2], value)) || size == 0 || size > 8)
     {
-        for (int i = 0; i < dataValues.size(); i++)
-        {
-            string decimal = dataValues[i];
-            if (isValidDecimal(decimal))
-            {
-                ll temp = (ll)stoi(decimal);
-                dataValues[i] = decimalToHex(temp, 4);// Half words are of 16 bytes
-            }
-            else
-            {
-                cerr << "Invalid data input." << endl;
-                return;
-            }
-        }
+        cerr << "Invalid data input." << endl;
+        return false;
     }
-    // Case when data values are hex
-    else
+
+    // Values made of one repeated byte are plain fills
+    bool sameBytes = true;
+    for (ull i = 1; i < size; i++)
+        sameBytes = sameBytes && ((value >> (8 * i)) & 0xFF) == (value & 0xFF);
+    if (sameBytes)
     {
-        for (int i = 0; i < dataValues.size(); i++)
-        {
-            dataValues[i] = dataValues[i].substr(2);
-        }
+        memory.fill(dataAddress, value & 0xFF, repeat * size);
+        dataAddress += repeat * size;
+        return true;
     }
-    // Storing values 8 byte at a time
-    for (int i = 0; i < dataValues.size(); i++)
+
+    // Otherwise build one page worth of the pattern and copy it repeatedly
+    vector<unsigned char> pattern;
+    ull perBlock = pageSize / size;
+    for (ull i = 0; i < perBlock * size; i++)
+        pattern.push_back((value >> (8 * (i % size))) & 0xFF);
+    while (repeat > 0)
     {
-        ll addr = hexToDecimal(initialMemory);
-        while (dataValues[i].length() < 4)
-            dataValues[i] = "0" + dataValues[i];
-        for (int j = addr; j < addr + 2; j++)
-        {
-            string location = decimalToHex(j, 5);
-            memory[location] = dataValues[i].substr(4 - (j - addr + 1) * 2, 2);
-        }
-        initialMemory = decimalToHex(addr + 2, 5);
+        ull count = repeat < perBlock ? repeat : perBlock;
+        memory.copyIn(dataAddress, pattern.data(), count * size);
+        dataAddress += count * size;
+        repeat -= count;
     }
+    return true;
 }
 
-// Function to store .word values from data section in memory
-void setWord(vector<string> dataValues)
+// Function to read a quoted string with C style escapes, returns the position after it
+bool parseString(string_view values, size_t &position, string &text)
 {
-    // Case when data values are decimal
-    if (dataValues[0].substr(0, 2) != "0x")
+    while (position < values.size() && (values[position] == ' ' || values[position] == ','))
+        position++;
+    if (position >= values.size() || values[position] != '"')
+        return false;
+    position++;
+    while (position < values.size() && values[position] != '"')
     {
-        for (int i = 0; i < dataValues.size(); i++)
+        char c = values[position++];
+        if (c == '\\' && position < values.size())
         {
-            string decimal = dataValues[i];
-            if (isValidDecimal(decimal))
-            {
-                ll temp = (ll)stoi(decimal);
-                dataValues[i] = decimalToHex(temp, 8);// Words are of 64 bytes
-            }
-            else
+            char escaped = values[position++];
+            switch (escaped)
             {
-                cerr << "Invalid data input." << endl;
-                return;
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case '0':
+                c = '\0';
+                break;
+            default:
+                c = escaped;
+                break;
             }
         }
+        text += c;
     }
-    // Case when data values are hex
-    else
+    if (position >= values.size())
+        return false;
+    position++;
+    return true;
+}
+
+// Function to store .ascii strings, .asciz/.string also store a terminating zero
+bool Simulator::setAscii(string_view values, bool terminate)
+{
+    size_t position = 0;
+    string text;
+    do
     {
-        for (int i = 0; i < dataValues.size(); i++)
+        if (!parseString(values, position, text))
         {
-            dataValues[i] = dataValues[i].substr(2);
+            cerr << "Invalid string in data section." << endl;
+            return false;
         }
+        if (terminate)
+            text += '\0';
+        while (position < values.size() && values[position] == ' ')
+            position++;
+    } while (position < values.size());
+    memory.copyIn(dataAddress, text.data(), text.size());
+    dataAddress += text.size();
+    return true;
+}
+
+// Function to align the data section to 2^n bytes, or n bytes for .balign
+bool Simulator::setAlign(string_view values, bool byteAlign)
+{
+    ull alignment;
+    vector<string_view> operands = splitOperands(values);
+    if (operands.empty() || !parseDataValue(operands[0], alignment) || (!byteAlign && alignment > 63))
+    {
+        cerr << "Invalid data input." << endl;
+        return false;
     }
-    // Storing values 8 byte at a time
-    for (int i = 0; i < dataValues.size(); i++)
+    if (!byteAlign)
+        alignment = 1ULL << alignment;
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
     {
-        ll addr = hexToDecimal(initialMemory);
-        while (dataValues[i].length() < 8)
-            dataValues[i] = "0" + dataValues[i];
-        for (int j = addr; j < addr + 4; j++)
-        {
-            string location = decimalToHex(j, 5);
-            memory[location] = dataValues[i].substr(8 - (j - addr + 1) * 2, 2);
-        }
-        initialMemory = decimalToHex(addr + 4, 5);
+        cerr << "Alignment must be a power of two." << endl;
+        return false;
     }
+    dataAddress = (dataAddress + alignment - 1) & ~(alignment - 1);
+    return true;
 }
 
-// Function to store .byte values from data section in memory
-void setByte(vector<string> dataValues)
+// Function to copy a host file into the data section for .incbin "file"[, skip[, count]]
+bool Simulator::setIncbin(string_view values)
 {
-    // Case when data values are decimal
-    if (dataValues[0].substr(0, 2) != "0x")
+    size_t position = 0;
+    string path;
+    if (!parseString(values, position, path))
     {
-        for (int i = 0; i < dataValues.size(); i++)
-        {
-            string decimal = dataValues[i];
-            if (isValidDecimal(decimal))
-            {
-                ll temp = (ll)stoi(decimal);
-                dataValues[i] = decimalToHex(temp, 2);
-            }
-            else
-            {
-                cerr << "Invalid data input." << endl;
-                return;
-            }
-        }
+        cerr << "Invalid file name for .incbin." << endl;
+        return false;
     }
-    // Case when data values are hex
-    else
+    vector<string_view> operands = splitOperands(values.substr(position));
+    ull skip = 0, count = ~0ULL;
+    if (operands.size() > 2 || (operands.size() > 0 && !parseDataValue(operands[0], skip)) ||
+        (operands.size() > 1 && !parseDataValue(operands[1], count)))
     {
-        for (int i = 0; i < dataValues.size(); i++)
-        {
-            dataValues[i] = dataValues[i].substr(2);
-        }
+        cerr << "Invalid data input." << endl;
+        return false;
     }
-    // Storing values 8 byte at a time
-    for (int i = 0; i < dataValues.size(); i++)
+
+    if (!path.empty() && path[0] != '/')
+        path = sourceDirectory + path;
+    includesFiles = true;
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat fileInfo;
+    if (fd < 0 || fstat(fd, &fileInfo) < 0)
     {
-        ll addr = hexToDecimal(initialMemory);
-        while (dataValues[i].length() < 2)
-            dataValues[i] = "0" + dataValues[i];
-        for (int j = addr; j < addr + 1; j++)
+        cerr << "Error opening " << path << " for .incbin." << endl;
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    ull fileSize = fileInfo.st_size;
+    if (skip > fileSize)
+        skip = fileSize;
+    if (count > fileSize - skip)
+        count = fileSize - skip;
+    if (count > 0)
+    {
+        void *data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
         {
-            string location = decimalToHex(j, 5);
-            memory[location] = dataValues[i].substr(2 - (j - addr + 1) * 2, 2);
+            cerr << "Error mapping " << path << " for .incbin." << endl;
+            close(fd);
+            return false;
         }
-        initialMemory = decimalToHex(addr + 1, 5);
+        madvise(data, fileSize, MADV_SEQUENTIAL);
+        memory.copyIn(dataAddress, (const char *)data + skip, count);
+        munmap(data, fileSize);
     }
+    close(fd);
+    dataAddress += count;
+    return true;
+}
+
+// Function to store the values of one data section directive in memory
+bool Simulator::setData(string_view directive, string_view values)
+{
+    PhaseScope scope(PHASE_DATA);
+    if (directive == ".dword")
+        return setDataValues(values, 8);
+    if (directive == ".word")
+        return setDataValues(values, 4);
+    if (directive == ".half")
+        return setDataValues(values, 2);
+    if (directive == ".byte")
+        return setDataValues(values, 1);
+    if (directive == ".space" || directive == ".zero")
+        return setSpace(values);
+    if (directive == ".fill")
+        return setFill(values);
+    if (directive == ".ascii")
+        return setAscii(values, false);
+    if (directive == ".asciz" || directive == ".string")
+        return setAscii(values, true);
+    if (directive == ".align" || directive == ".p2align")
+        return setAlign(values, false);
+    if (directive == ".balign")
+        return setAlign(values, true);
+    if (directive == ".incbin")
+        return setIncbin(values);
+    cerr << "Unsupported data directive: " << directive << endl;
+    return false;
 }
 
 // Function to display the stack
-void showStack(int extraLines)
+void Simulator::showStack()
 {
     if (funStack.empty())
     {
@@ -1294,7 +2054,7 @@ void showStack(int extraLines)
     while (!temp.empty())
     {
         pair function = temp.top();
-        cout << function.first << ":" << function.second+extraLines << endl;
+        cout << function.first << ":" << function.second+program->extraLines << endl;
         funStack.push(function);
         temp.pop();
     }
@@ -1302,17 +2062,18 @@ void showStack(int extraLines)
 }
 
 // Function to create stack
-void createStack(unordered_map<string, int> &labelAddresses)
+void Simulator::createStack()
 {
-    if (labelAddresses.find("main") != labelAddresses.end())
+    if (program->labelAddresses.find("main") != program->labelAddresses.end())
     {
         funStack.push({"main", 0});
     }
 }
 
 // Function to update value of stack after executing every line
-void handleStack(unordered_map<string, int> &labelAddresses, int lineNumber)
+void Simulator::handleStack(int lineNumber)
 {
+    PhaseScope scope(PHASE_STACK);
     if (!funStack.empty())
     {
         pair currentFun = funStack.top();
@@ -1323,7 +2084,7 @@ void handleStack(unordered_map<string, int> &labelAddresses, int lineNumber)
 }
 
 // Function to delete/empty stack after complete execution
-void deleteStack()
+void Simulator::deleteStack()
 {
     while (!funStack.empty())
     {
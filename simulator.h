@@ -1,20 +1,266 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <stack>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "cache.h"
+#include "decoder.h"
+#include "ecall.h"
+#include "memory.h"
+#include "mmu.h"
 
 using namespace std;
 typedef long long ll;
+typedef unsigned long long ull;
+
+class TimingModel;
+class BlockProfiler;
+class OutOfOrderModel;
+struct OutOfOrderConfig;
+
+// A loaded program, shared by every machine forked from the one that loaded it and
+// not changed once loading is done
+struct Program
+{
+    Program() = default;
+    ~Program();
+    Program(const Program &) = delete;
+    Program &operator=(const Program &) = delete;
+
+    vector<string_view> instructionList;            // Store instructions as views into the mapped input file
+    unordered_map<string_view, int> labelAddresses; // Store labels and their line numbers
+    vector<DecodedInstruction> decodedProgram;      // Instructions decoded at load time
+    vector<string_view> labelNames;                 // Labels referenced by decoded jal instructions
+    vector<uint8_t> fusion;                         // Fusion of each instruction with the next one, see fuseProgram
+    int extraLines = 0;
+    SourceHash programHash = {}; // Content hash of the loaded file
+
+    // Input file mapped into memory, labels and instructions point into it
+    const char *mappedFile = nullptr;
+    size_t mappedSize = 0;
+};
+
+// Entries of a coverage map, control flow edges are hashed into it
+const int coverageSize = 1 << 16;
+
+// Outcome of executing one instruction for a debugger or an embedding program
+enum StepResult
+{
+    STEP_OK,
+    STEP_EXITED, // Program ran off its last instruction
+    STEP_FAULT   // Memory access faulted, the instruction did not complete
+};
+
+// Why run returned
+enum StopReason
+{
+    STOP_BUDGET,     // Ran all the instructions it was allowed to
+    STOP_BREAKPOINT,
+    STOP_EXITED,     // Program ran off its last instruction or called exit
+    STOP_FAULT,      // Memory access faulted, execution resumes at that instruction
+    STOP_PAUSED,     // pauseRequested was set
+    STOP_WATCHPOINT, // An instruction accessed a watched range, execution resumes after it
+    STOP_TARGET      // Reached the line of runUntil or the return of finish
+};
+
+// One simulated machine and the program loaded into it. Instances share no mutable
+// state, so several of them can run in one process, each on its own thread. Forks
+// share the program and their unwritten memory pages
+class Simulator
+{
+public:
+    Simulator();
+    ~Simulator();
+    Simulator(const Simulator &) = delete;
+    Simulator &operator=(const Simulator &) = delete;
+
+    // Loading and running, in loader.cpp and execution.cpp
+    bool load(const string &filename);
+    StopReason run(ll budget = LLONG_MAX);
+    StopReason runUntil(int line);
+    StopReason finish();
+    void runChecked();
+    bool stepInstruction();
+    void stepInstructions(ll count);
+    StepResult step();
+    void sample(ll skip, ll warm, ll measure);
+    void simulateOutOfOrder(const OutOfOrderConfig &config);
+    void simulateDecoupled(const OutOfOrderConfig &config, size_t ringSize);
+    void simulateIntervals(ll length, ll warm);
+    bool analyzeLocality(ll window, const string &file);
+    bool profileBlocks(ll interval, const string &file, int clusters);
+    bool running() const;
+    unique_ptr<Simulator> fork();
+    bool mapFile(const string &path, ull address, bool writable);
+
+    // Architectural state as a debugger sees it, x0 ignores writes and the PC is the
+    // instruction index times 4
+    ll readRegister(int index) const;
+    void writeRegister(int index, ll value);
+    ull readPc() const;
+    void writePc(ull pc);
+    bool readMemory(ull address, void *data, size_t size);
+    bool writeMemory(ull address, const void *data, size_t size);
+
+    // Console output, in simulator.cpp
+    void printRegisters();
+    void printMemory(ull address, ll count);
+    void printRegions();
+    void showStack();
+
+    // Record and replay of host inputs, in ecall.cpp
+    bool startRecording(const string &file);
+    bool startReplay(const string &file);
+    void stopInputLog();
+
+    bool fusionEnabled = true;
+    bool trace = true;         // Print every executed instruction and why execution stopped
+    bool outputMuted = false;  // Drop guest output
+    string *outputCapture = nullptr; // Receives guest output instead of the console when set
+    uint8_t *coverage = nullptr; // Hit counts of control flow edges, coverageSize entries, when set
+    bool checkEnabled = false; // Run checks the pre-decoded engine against the string engine
+    int checkInterval = 1;     // Instructions run by each engine between comparisons
+    function<bool(string &)> readLine; // Source of standard input lines for the program, cin when empty
+    atomic<bool> pauseRequested{false}; // Stops run before its next instruction, may be set from other threads and signal handlers
+    bool hostTimer = false; // The time CSR reads the host clock instead of counting cycles
+    ll cyclesPerTick = 100; // Cycles per tick of the time CSR when it counts cycles, host time ticks every 100 ns
+
+    // Address space layout, the data section and stack move with the next load. Any
+    // address outside them still reads as zero and gets a page when first written
+    ull dataStart = 0x10000;     // Start of the data section
+    ull stackTop = 0x3FFFFFF000; // Initial sp, the stack grows down from it
+    ull stackSize = 0x800000;    // Space reserved for the stack, the heap stops below it
+
+    vector<int> breakpoints;
+    bool atBreak = false; // To check if to stop at breakpoint or start executing from it
+
+    vector<ll> registers;
+    Memory memory; // Paged guest memory
+    Mmu mmu;
+    int currentLine = 0; // Instruction that runs next
+    stack<pair<string, int>> funStack; // Stack for functions
+
+    shared_ptr<Program> program;
+    ll retiredCount = 0;  // Instructions executed since the file was loaded
+    ll dispatchCount = 0; // Times the engine dispatched, a fused pair counts once
+    ll modelledCycles = 0; // Cycles the timing models charged beyond one per instruction, the cycle CSR adds them to retiredCount
+    bool guestExited = false; // Set once the program called exit
+    ll exitCode = 0;
+
+private:
+    // State the two engines have to agree on
+    struct EngineState
+    {
+        vector<ll> registers;
+        int line;
+        bool faulted;
+        stack<pair<string, int>> callStack;
+        ll retired;
+    };
+
+    // Execution engines, in simulator.cpp
+    void runInstruction(string_view instruction, int &lineNumber);
+    void runDecoded(const DecodedInstruction &decoded, string_view instruction, int &lineNumber);
+    void runFused(uint8_t fusion, const DecodedInstruction &first, const DecodedInstruction &second, int &lineNumber);
+    void runRFormat(string_view instruction);
+    void runIFormat(string_view instruction, int &currentLine);
+    void runBFormat(string_view instruction, int &currentLine);
+    void runSFormat(string_view instruction);
+    void runJFormat(string_view instruction, int &currentLine);
+    void runUFormat(string_view instruction);
+    void runSfence(string_view instruction);
+    void runBitManipFormat(string_view instruction);
+    void runCsrFormat(string_view instruction, int &lineNumber);
+    void runCsr(int rd, int csr, bool writes, int &lineNumber);
+    void loadRegister(int rd, ull addr, int bytes, bool isUnsigned);
+    void storeMemory(ull address, ll value, int bytes);
+    void createStack();
+    void handleStack(int lineNumber);
+    void deleteStack();
+
+    // Function to count a taken branch or jump, or a branch that fell through
+    void recordEdge(int from, int to)
+    {
+        coverage[((ull)from * 0x9E3779B97F4A7C15ULL >> 48 ^ (ull)to) & (coverageSize - 1)]++;
+    }
+
+    // Data section, in simulator.cpp
+    bool setData(string_view directive, string_view values);
+    bool setDataValues(string_view values, int size);
+    bool setSpace(string_view values);
+    bool setFill(string_view values);
+    bool setAscii(string_view values, bool terminate);
+    bool setAlign(string_view values, bool byteAlign);
+    bool setIncbin(string_view values);
+
+    // System calls, in ecall.cpp
+    void runEcall(int &lineNumber);
+    void runInputCall(uint8_t kind, int &lineNumber, ull buffer, ull count, ll argument);
+    void runWrite(ll fd, ull buffer, ull count);
+    bool replayInput(uint8_t kind, int &lineNumber, InputEvent &event, bool &diverged);
+    void stopReplay(int &lineNumber, const string &reason);
+    void logInput(const InputEvent &event);
+    bool guestWritable(ull address, ull size);
+    void readLive(ull count, InputEvent &event);
+    bool readTimer(int &lineNumber, ll &value);
+    void captureInputs(bool capture);
+    size_t inputMark();
+    void rewindInputs(size_t mark);
+    void releaseInputs();
+
+    // Drivers, in execution.cpp
+    void printExecuted(int line);
+    void stopAtFault(int line);
+    void stopAtWatch(int line);
+    void finishProgram();
+    bool isBreakpoint(int line);
+    EngineState captureState(bool faulted);
+    void restoreState(const EngineState &state);
+    int runEngine(bool reference, int limit, vector<int> &executed, bool &faulted, ll &dispatches);
+    bool findMemoryDifference(const unordered_map<ull, unique_ptr<Page>> &testPages, ull &address,
+                              unsigned char &testByte, unsigned char &referenceByte);
+    void reportDivergence(const EngineState &start, const EngineState &test, const vector<int> &executed,
+                          bool referenceFault, bool memoryDiffers, ull address, unsigned char testByte, unsigned char referenceByte);
+    ll fastForward(ll count);
+    ll stepRun(ll count, TimingModel *model, BlockProfiler *profiler, OutOfOrderModel *core = nullptr);
+    ll modelRun(ll count, TimingModel &model);
+    bool accessMemory(ull address, unsigned char *data, size_t size, bool write);
+
+    // Loading, in loader.cpp
+    void handleDataSection(string_view line);
+    void decodeLoadedProgram();
+    void setupLayout();
+
+    // Run control
+    int stopLine = -1;    // Line runUntil stops at
+    size_t stopDepth = 0; // Call stack depth below which finish stops
+
+    bool loadFailed = false; // Set when the file had errors, such loads are not cached
+    bool includesFiles = false; // Set when .incbin read other files, whose contents the cache key does not cover
+    string sourceDirectory;     // Directory of the loaded file with a trailing slash, .incbin paths are relative to it
+    string currentDataType;
+    ull dataAddress = 0x10000; // Next free address of the data section
+    ull heapStart = 0;         // First address past the data section, brk never goes below it
+    ull programBreak = 0;      // End of the heap, moved by brk
+
+    // Record/replay state
+    vector<InputEvent> inputLog; // Inputs to feed again, loaded from a log or captured
+    size_t inputPosition = 0;    // Next input of inputLog to feed
+    bool replaying = false;      // inputLog was loaded from a log and is the only source of input
+    bool capturing = false;
+    FILE *recordFile = nullptr;
+    string pendingInput; // Rest of a line of standard input that a read did not take
+};
 
-void runInstruction(const string &instruction, int &lineNumber, const unordered_map<string, int> &labelAddresses);
-void printRegisters();
-void printMemory(string address, int count);
-string binaryToHex(string &binaryInstruction);
-void resetRegisters();
-void resetMemory();
-void setDoubleword(vector<string> dataValues);
-void setHalfword(vector<string> dataValues);
-void setWord(vector<string> dataValues);
-void setByte(vector<string> dataValues);
-void showStack(int extraLines);
+bool branchTaken(const DecodedInstruction &decoded, const vector<ll> &registers);
 string decimalToHex(ll number, int hexDigits);
-void createStack(unordered_map<string,int> &labelAddresses);
-void handleStack(unordered_map<string,int> &labelAddresses,int lineNumber);
-void deleteStack();
\ No newline at end of file
+ll hexToDecimal(string hexStr);
+int findRegister(string_view reg);
+int findCsr(string_view csr);
@@ -0,0 +1,973 @@
+#include <functional>
+#include <iostream>
+#include <list>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "simulator.h"
+#include "dump.h"
+#include "fuzz.h"
+#include "gdbstub.h"
+#include "locality.h"
+#include "ooo.h"
+#include "parallel.h"
+#include "ring.h"
+#include "server.h"
+#include "timing.h"
+
+using namespace std;
+typedef long long ll;
+
+// Behaviour checks against libriscvsim.a, run by make test. Each test prints the checks
+// that failed and the program exits with the number of failures
+
+int failures = 0;
+string scratch; // Temporary directory for the programs and files of the tests
+
+void check(bool condition, const string &what)
+{
+    if (!condition)
+    {
+        cerr << "FAILED: " << what << endl;
+        failures++;
+    }
+}
+
+// Function to write a file into the scratch directory and return its path
+string writeFile(const string &name, const string &contents)
+{
+    string path = scratch + "/" + name;
+    FILE *file = fopen(path.c_str(), "wb");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+    return path;
+}
+
+// Function to read a whole file from the scratch directory
+string readFile(const string &path)
+{
+    string contents;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return contents;
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.append(buffer, size);
+    fclose(file);
+    return contents;
+}
+
+// Function to load a program into a quiet machine
+bool loadQuiet(Simulator &simulator, const string &path)
+{
+    simulator.trace = false;
+    return simulator.load(path);
+}
+
+ull readDword(Simulator &simulator, ull address)
+{
+    ull value = 0;
+    simulator.readMemory(address, &value, 8);
+    return value;
+}
+
+// Sv39 walks through three levels and a superpage, permission checks, and the A and D
+// bits set by the first load and store
+void testSv39()
+{
+    Simulator simulator;
+    Memory &memory = simulator.memory;
+    Mmu &mmu = simulator.mmu;
+    const ull V = 1, R = 2, W = 4, U = 16, A = 64, D = 128;
+    // Root at 0x100000, 0x40000000 goes through two more levels to the page at 0x200000,
+    // 0x80000000 is a 2 MiB superpage at 0x400000 and 0xC0000000 a misaligned one
+    memory.write(0x100000 + 1 * 8, (0x101ULL << 10) | V, 8);
+    memory.write(0x101000, (0x102ULL << 10) | V, 8);
+    memory.write(0x102000, (0x200ULL << 10) | V | R | W | U, 8);
+    memory.write(0x100000 + 2 * 8, (0x103ULL << 10) | V, 8);
+    memory.write(0x103000, (0x400ULL << 10) | V | R | W | U, 8);
+    memory.write(0x100000 + 3 * 8, (0x104ULL << 10) | V, 8);
+    memory.write(0x104000, (0x401ULL << 10) | V | R | U, 8);
+    mmu.satp = (satpModeSv39 << 60) | 0x100;
+    mmu.privilegeMode = PRIV_U;
+    mmu.flushTlb();
+
+    ull physical = 0;
+    check(mmu.translateAddress(0x40000123, ACCESS_LOAD, physical, true) && physical == 0x200123, "Sv39 4 KiB walk");
+    check((memory.read(0x102000, 8) & (A | D)) == A, "Sv39 load sets A only");
+    check(mmu.translateAddress(0x40000008, ACCESS_STORE, physical, true), "Sv39 store to a writable page");
+    check((memory.read(0x102000, 8) & (A | D)) == (A | D), "Sv39 store sets D");
+    check(mmu.translateAddress(0x80123456, ACCESS_LOAD, physical, false) && physical == 0x523456, "Sv39 superpage");
+    check((memory.read(0x103000, 8) & A) == 0, "Sv39 translation without updates leaves A clear");
+    check(!mmu.translateAddress(0xC0000000, ACCESS_LOAD, physical, true), "Sv39 misaligned superpage faults");
+    check(!mmu.translateAddress(0x1000, ACCESS_LOAD, physical, true), "Sv39 invalid entry faults");
+    check(!mmu.translateAddress(0x4000000000ULL, ACCESS_LOAD, physical, true), "Sv39 non canonical address faults");
+
+    // Through the TLBs, and the permission checks of S mode
+    ull value = 0x1122334455667788ULL;
+    check(mmu.writeVirtual(0x40000010, &value, 8) && memory.read(0x200010, 8) == value, "Sv39 write lands in the mapped page");
+    mmu.privilegeMode = PRIV_S;
+    mmu.flushTlb();
+    check(!mmu.translateAddress(0x40000000, ACCESS_LOAD, physical, true), "S mode cannot read U pages without SUM");
+    mmu.statusSum = true;
+    check(mmu.translateAddress(0x40000000, ACCESS_LOAD, physical, true), "S mode reads U pages with SUM");
+}
+
+// A store that faults on either page it covers sets no A or D bit and writes nothing,
+// also when the second page is the one that faults
+void testStoreFault()
+{
+    Simulator simulator;
+    Memory &memory = simulator.memory;
+    Mmu &mmu = simulator.mmu;
+    const ull V = 1, R = 2, W = 4, U = 16, A = 64, D = 128;
+    // 0x40000000 is writable, the page after it read only and the one after that unmapped
+    memory.write(0x100000 + 1 * 8, (0x101ULL << 10) | V, 8);
+    memory.write(0x101000, (0x102ULL << 10) | V, 8);
+    memory.write(0x102000, (0x200ULL << 10) | V | R | W | U, 8);
+    memory.write(0x102008, (0x201ULL << 10) | V | R | U, 8);
+    memory.write(0x102010, (0x202ULL << 10) | V | R | W | U, 8);
+    mmu.satp = (satpModeSv39 << 60) | 0x100;
+    mmu.privilegeMode = PRIV_U;
+    mmu.flushTlb();
+
+    ull value = ~0ULL;
+    check(!mmu.writeVirtual(0x40000ffc, &value, 8) && mmu.faultAddress == 0x40001000, "store into a read only second page faults");
+    check((memory.read(0x102000, 8) & (A | D)) == 0, "faulting store sets no bits on the first page");
+    check(memory.read(0x200ff8, 8) == 0, "faulting store writes nothing");
+    mmu.memoryFault = false;
+    check(!mmu.writeVirtual(0x40002ffc, &value, 8) && (memory.read(0x102010, 8) & (A | D)) == 0,
+          "store into an unmapped second page sets no bits");
+    mmu.memoryFault = false;
+    check(mmu.writeVirtual(0x40000ff8, &value, 8) && (memory.read(0x102000, 8) & (A | D)) == (A | D) &&
+              memory.read(0x200ff8, 8) == value,
+          "store within the writable page sets A and D");
+}
+
+// Loading a changed file must not reuse the cached image of the old one, and programs
+// using .incbin are read again every time
+void testProgramCache()
+{
+    string cacheDirectory = scratch + "/cache";
+    setenv("RISCV_SIM_CACHE_DIR", cacheDirectory.c_str(), 1);
+    string path = writeFile("cached.s", ".data\n.dword 1\n.text\nmain: addi x5, x0, 1\n");
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, path) && readDword(simulator, 0x10000) == 1, "first load of a cached program");
+    }
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, path) && readDword(simulator, 0x10000) == 1, "load from the program cache");
+    }
+    writeFile("cached.s", ".data\n.dword 2\n.text\nmain: addi x5, x0, 2\n");
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, path) && readDword(simulator, 0x10000) == 2, "changed file is decoded again");
+    }
+
+    writeFile("blob.bin", "ABCD");
+    string included = writeFile("included.s", ".data\n.incbin \"blob.bin\"\n.text\nmain: addi x5, x0, 1\n");
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, included) && readDword(simulator, 0x10000) == 0x44434241, ".incbin relative to the source");
+    }
+    writeFile("blob.bin", "WXYZ");
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, included) && readDword(simulator, 0x10000) == 0x5A595857, "changed .incbin file is read again");
+    }
+
+    // A cached label pointing past the program makes the image a miss
+    string labelCache = scratch + "/labelcache";
+    setenv("RISCV_SIM_CACHE_DIR", labelCache.c_str(), 1);
+    string source = ".text\nmain: addi x5, x0, 1\nlate: addi x6, x0, 2\n";
+    string labelled = writeFile("labelled.s", source);
+    {
+        Simulator simulator;
+        loadQuiet(simulator, labelled);
+    }
+    string image;
+    DIR *directory = opendir(labelCache.c_str());
+    for (dirent *entry; directory && (entry = readdir(directory));)
+    {
+        if (entry->d_name[0] != '.')
+            image = labelCache + "/" + entry->d_name;
+    }
+    if (directory)
+        closedir(directory);
+    string contents = readFile(image);
+    // The span of the second label: its offset in the source, its length and its line
+    struct
+    {
+        uint64_t offset;
+        uint32_t length;
+        int32_t line;
+    } span = {source.find("late"), 4, 1};
+    size_t at = contents.find(string((const char *)&span, sizeof(span)));
+    check(at != string::npos, "label found in the cached image");
+    if (at != string::npos)
+    {
+        span.line = 1000;
+        contents.replace(at, sizeof(span), string((const char *)&span, sizeof(span)));
+        writeFile(image.substr(scratch.size() + 1), contents);
+        Simulator simulator;
+        check(loadQuiet(simulator, labelled) && simulator.program->labelAddresses.at("late") == 1,
+              "cached label past the end of the program is decoded again");
+    }
+    setenv("RISCV_SIM_CACHE_DIR", "", 1);
+}
+
+// A fork and its parent see each other's memory as it was at the fork and nothing written since
+void testForkIsolation()
+{
+    string path = writeFile("fork.s", ".data\n.dword 42\n.dword 43\n.text\n"
+                                      "main: lui x11, 0x10\nld x5, 0(x11)\naddi x5, x5, 1\nsd x5, 0(x11)\n");
+    Simulator parent;
+    check(loadQuiet(parent, path), "load for fork");
+    unique_ptr<Simulator> child = parent.fork();
+    child->trace = false;
+    check(child->run() == STOP_EXITED && readDword(*child, 0x10000) == 43, "fork runs on its own");
+    check(readDword(parent, 0x10000) == 42, "parent memory unchanged by the fork");
+    ull value = 7;
+    parent.writeMemory(0x10008, &value, 8);
+    check(readDword(*child, 0x10008) == 43, "fork memory unchanged by the parent");
+    check(parent.run() == STOP_EXITED && readDword(parent, 0x10000) == 43, "parent runs after the fork");
+    check(child->readRegister(5) == 43 && parent.readRegister(5) == 43, "registers of both machines");
+}
+
+// Forks writing the pages they share from several threads at once each end up with
+// their own copies, and the parent keeps its contents
+void testConcurrentForks()
+{
+    Simulator parent;
+    const ull base = 0x100000, pages = 64;
+    for (ull i = 0; i < pages; i++)
+        parent.memory.write(base + i * pageSize, 1000 + i, 8);
+    vector<unique_ptr<Simulator>> children;
+    for (int i = 0; i < 4; i++)
+        children.push_back(parent.fork());
+
+    vector<thread> writers;
+    for (int i = 0; i < 4; i++)
+    {
+        writers.emplace_back([&, i]
+                             {
+                                 Simulator &child = *children[i];
+                                 for (int round = 0; round < 50; round++)
+                                 {
+                                     for (ull page = 0; page < pages; page++)
+                                         child.mmu.writeGuest(base + page * pageSize, &round, 4);
+                                     // A fork of a fork shares the pages again, and dies at once
+                                     unique_ptr<Simulator> grandchild = child.fork();
+                                 }
+                                 ull value = i;
+                                 for (ull page = 0; page < pages; page++)
+                                     child.memory.write(base + page * pageSize + 8, value, 8);
+                             });
+    }
+    for (thread &writer : writers)
+        writer.join();
+
+    bool parentIntact = true, childrenOwn = true;
+    for (ull page = 0; page < pages; page++)
+    {
+        parentIntact = parentIntact && readDword(parent, base + page * pageSize) == 1000 + page &&
+                       readDword(parent, base + page * pageSize + 8) == 0;
+        for (ull i = 0; i < 4; i++)
+            childrenOwn = childrenOwn && readDword(*children[i], base + page * pageSize + 8) == i &&
+                          (readDword(*children[i], base + page * pageSize) & 0xFFFFFFFF) == 49;
+    }
+    check(parentIntact, "parent pages unchanged by concurrent forks");
+    check(childrenOwn, "every fork keeps its own writes");
+    check(parent.memory.sharedPageCount() == 0, "no page shared once every fork copied it");
+}
+
+// Zba and Zbb on edge operands, in both engines
+void testBitManip()
+{
+    string path = writeFile("zb.s", ".data\n.dword 0x0102030405060708\n.dword 0x0100000000008000\n.text\n"
+                                    "main: lui x11, 0x10\n"
+                                    "ld x20, 0(x11)\n"
+                                    "ld x21, 8(x11)\n"
+                                    "clz x5, x0\n"
+                                    "ctz x6, x0\n"
+                                    "clzw x7, x0\n"
+                                    "addi x22, x0, -1\n"
+                                    "cpop x8, x22\n"
+                                    "rev8 x9, x20\n"
+                                    "orc.b x10, x21\n"
+                                    "addi x23, x0, 128\n"
+                                    "sext.b x12, x23\n"
+                                    "zext.h x13, x22\n"
+                                    "rori x14, x20, 8\n"
+                                    "sh3add x15, x23, x23\n"
+                                    "max x16, x22, x0\n"
+                                    "minu x17, x22, x23\n"
+                                    "andn x18, x22, x23\n"
+                                    "ctzw x19, x23\n");
+    for (int checked = 0; checked < 2; checked++)
+    {
+        Simulator simulator;
+        check(loadQuiet(simulator, path), "load Zb program");
+        simulator.checkEnabled = checked;
+        simulator.run();
+        string engine = checked ? " with check on" : "";
+        check(simulator.readRegister(5) == 64, "clz 0" + engine);
+        check(simulator.readRegister(6) == 64, "ctz 0" + engine);
+        check(simulator.readRegister(7) == 32, "clzw 0" + engine);
+        check(simulator.readRegister(8) == 64, "cpop -1" + engine);
+        check((ull)simulator.readRegister(9) == 0x0807060504030201ULL, "rev8" + engine);
+        check((ull)simulator.readRegister(10) == 0xFF0000000000FF00ULL, "orc.b" + engine);
+        check(simulator.readRegister(12) == -128, "sext.b" + engine);
+        check(simulator.readRegister(13) == 0xFFFF, "zext.h" + engine);
+        check((ull)simulator.readRegister(14) == 0x0801020304050607ULL, "rori" + engine);
+        check(simulator.readRegister(15) == 128 * 8 + 128, "sh3add" + engine);
+        check(simulator.readRegister(16) == 0, "max" + engine);
+        check(simulator.readRegister(17) == 128, "minu" + engine);
+        check(simulator.readRegister(18) == ~128LL, "andn" + engine);
+        check(simulator.readRegister(19) == 7, "ctzw" + engine);
+    }
+}
+
+// Reuse distances from the Fenwick tree against a plain LRU stack, over enough accesses
+// to renumber the tree several times
+void testReuseDistance()
+{
+    LocalityProfiler profiler(1000);
+    mt19937_64 random(7);
+    list<ull> stack;
+    ull histogram[reuseBuckets] = {}, cold = 0;
+    for (int i = 0; i < 3000000; i++)
+    {
+        ull line = random() % 4 == 0 ? random() % 300 : random() % 20;
+        profiler.access(line * 64 + random() % 64, nullptr);
+        auto position = stack.begin();
+        ull distance = 0;
+        while (position != stack.end() && *position != line)
+        {
+            position++;
+            distance++;
+        }
+        if (position == stack.end())
+        {
+            cold++;
+        }
+        else
+        {
+            histogram[distance == 0 ? 0 : 64 - __builtin_clzll(distance)]++;
+            stack.erase(position);
+        }
+        stack.push_front(line);
+    }
+    check(profiler.coldCount() == cold, "cold accesses");
+    bool same = true;
+    for (int bucket = 0; bucket < reuseBuckets; bucket++)
+        same = same && profiler.reuseCount(bucket) == histogram[bucket];
+    check(same, "reuse distance histogram matches an LRU stack");
+
+    // The buffer a system call fills is counted once for every line it covers
+    string path = writeFile("locality.s", ".data\n.space 128\n.text\n"
+                                          "main: lui x11, 0x10\n"
+                                          "addi x10, x0, 0\naddi x12, x0, 120\naddi x17, x0, 63\necall\n"
+                                          "ld x5, 64(x11)\n");
+    Simulator simulator;
+    loadQuiet(simulator, path);
+    simulator.readLine = [](string &line)
+    {
+        line = string(99, 'y');
+        return true;
+    };
+    ostringstream report;
+    streambuf *console = cout.rdbuf(report.rdbuf());
+    simulator.analyzeLocality(1000, "");
+    cout.rdbuf(console);
+    check(report.str().find("Accesses: 3, lines touched: 2 ") == 0, "system call buffers and loads are profiled");
+}
+
+// Function to run a program reading every kind of host input and collect what it printed
+string runWithInputs(const string &path, const string &log, bool replay, const string &inputLine, vector<ll> &registers)
+{
+    Simulator simulator;
+    loadQuiet(simulator, path);
+    string output;
+    simulator.outputCapture = &output;
+    simulator.readLine = [&](string &line)
+    {
+        line = inputLine;
+        return true;
+    };
+    if (replay ? !simulator.startReplay(log) : !simulator.startRecording(log))
+        return "";
+    simulator.run();
+    simulator.stopInputLog();
+    registers = simulator.registers;
+    return output;
+}
+
+// Check mode runs every interval on both engines and ends in the state of a plain run,
+// also when the program reads input and writes output inside an interval
+void testCheckMode()
+{
+    string path = writeFile("checked.s", ".data\n.space 64\n.text\n"
+                                         "main: lui x11, 0x10\n"
+                                         "addi x10, x0, 0\naddi x12, x0, 16\naddi x17, x0, 63\necall\n"
+                                         "add x12, x10, x0\naddi x10, x0, 1\naddi x17, x0, 64\necall\n"
+                                         "addi x5, x0, 0\naddi x6, x0, 100\n"
+                                         "loop: sd x5, 16(x11)\nld x7, 16(x11)\nadd x8, x8, x7\naddi x5, x5, 1\nblt x5, x6, loop\n");
+    for (int interval : {1, 7, 1000})
+    {
+        Simulator plain, checked;
+        string plainOutput, checkedOutput;
+        for (Simulator *simulator : {&plain, &checked})
+        {
+            loadQuiet(*simulator, path);
+            simulator->outputCapture = simulator == &plain ? &plainOutput : &checkedOutput;
+            simulator->readLine = [](string &line)
+            {
+                line = "checked input";
+                return true;
+            };
+        }
+        plain.run();
+        checked.checkEnabled = true;
+        checked.checkInterval = interval;
+        ostringstream report;
+        streambuf *console = cout.rdbuf(report.rdbuf());
+        checked.runChecked();
+        cout.rdbuf(console);
+        string what = " with interval " + to_string(interval);
+        check(report.str().find("diverge") == string::npos && report.str().find("stopped") == string::npos,
+              "no divergence" + what);
+        check(checked.registers == plain.registers && checked.readRegister(8) == 4950, "checked registers match" + what);
+        check(checkedOutput == plainOutput && plainOutput == "checked input\n", "checked output matches" + what);
+    }
+}
+
+// The counters read by name or number give the instructions retired before the reading
+// one, writes and unknown CSRs leave rd alone, and both engines agree
+void testCounters()
+{
+    string path = writeFile("counters.s", ".text\n"
+                                          "main: addi x14, x0, 77\nrdinstret x10\naddi x6, x0, 2\ncsrr x11, instret\n"
+                                          "csrrs x12, cycle, x0\ncsrr x13, 0xc02\ncsrrw x14, instret, x5\nrdtime x15\n"
+                                          "csrrsi x16, instret, 0\naddi x17, x0, 55\ncsrr x17, 0x300\n");
+    for (bool checked : {false, true})
+    {
+        Simulator simulator;
+        loadQuiet(simulator, path);
+        simulator.cyclesPerTick = 1;
+        ostringstream report;
+        streambuf *console = cout.rdbuf(report.rdbuf());
+        if (checked)
+            simulator.runChecked();
+        else
+            simulator.run();
+        cout.rdbuf(console);
+        string engine = checked ? " in check mode" : "";
+        check(simulator.readRegister(10) == 1 && simulator.readRegister(11) == 3 && simulator.readRegister(13) == 5 &&
+                  simulator.readRegister(16) == 8,
+              "instret by name and number" + engine);
+        check(simulator.readRegister(12) == 4 && simulator.readRegister(15) == 7, "cycle and time count retired instructions" + engine);
+        check(simulator.readRegister(14) == 77 && simulator.readRegister(17) == 55, "writes and unknown CSRs leave rd alone" + engine);
+        check(report.str().find("diverged") == string::npos, "engines agree on the counters" + engine);
+    }
+}
+
+// A replayed run reads exactly the recorded inputs, whatever the host gives it now
+void testRecordReplay()
+{
+    string path = writeFile("inputs.s", ".data\n.space 64\n.text\n"
+                                        "main: lui x11, 0x10\n"
+                                        "addi x10, x0, 0\naddi x12, x0, 32\naddi x17, x0, 63\necall\n"
+                                        "add x12, x10, x0\naddi x10, x0, 1\naddi x17, x0, 64\necall\n"
+                                        "addi x11, x11, 32\naddi x10, x0, 1\naddi x17, x0, 113\necall\n"
+                                        "ld x20, 0(x11)\nld x21, 8(x11)\n"
+                                        "addi x10, x11, 16\naddi x11, x0, 8\naddi x12, x0, 0\naddi x17, x0, 278\necall\n"
+                                        "ld x22, 0(x10)\n"
+                                        "addi x10, x0, 0\naddi x17, x0, 93\necall\n");
+    string log = scratch + "/inputs.log";
+    vector<ll> recorded, replayed;
+    string first = runWithInputs(path, log, false, "recorded input", recorded);
+    string second = runWithInputs(path, log, true, "something else", replayed);
+    check(first == "recorded input\n", "recorded run echoes its input");
+    check(second == first, "replayed output is byte identical");
+    check(recorded == replayed, "replayed registers, clock and random bytes match");
+}
+
+// parallelFor covers every index once, and the ring hands items over in order
+void testThreads()
+{
+    vector<int> visits(100000, 0);
+    parallelFor(visits.size(), 1000, [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; i++)
+                        visits[i]++;
+                });
+    check(count(visits.begin(), visits.end(), 1) == (ll)visits.size(), "parallelFor visits every index once");
+
+    SpscRing<ll> ring(8);
+    const ll items = 1000000;
+    thread producer([&]
+                    {
+                        for (ll i = 0; i < items; i++)
+                            ring.push(i);
+                        ring.close();
+                    });
+    ll expected = 0, item;
+    bool ordered = true;
+    while (ring.pop(item))
+        ordered = ordered && item == expected++;
+    producer.join();
+    check(ordered && expected == items, "ring delivers every item in order");
+}
+
+// Function to connect to the server, retrying while it starts up
+int connectServer(const string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path.c_str());
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+// Function to send one request line and read its response line
+string serverRequest(int fd, const string &request)
+{
+    string line = request + "\n", response;
+    if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size())
+        return "";
+    char byte;
+    while (read(fd, &byte, 1) == 1 && byte != '\n')
+        response += byte;
+    return response;
+}
+
+// layout moves the data section and stack of the next load, brk grows the heap between
+// them, and mapped files show through guest memory without taking writes to the file
+void testLayoutAndMappings()
+{
+    string path = writeFile("layout.s", ".data\n.dword 9\n.text\n"
+                                        "main: lui x11, 0x200\nld x5, 0(x11)\n"
+                                        "addi x10, x0, 0\naddi x17, x0, 214\necall\nadd x20, x10, x0\n"
+                                        "lui x12, 0x1\nadd x10, x20, x12\necall\nadd x21, x10, x0\nsd x5, 0(x20)\n"
+                                        "lui x10, 0x7FF\necall\nadd x22, x10, x0\n");
+    Simulator simulator;
+    simulator.dataStart = 0x200000;
+    simulator.stackTop = 0x800000;
+    simulator.stackSize = 0x10000;
+    check(loadQuiet(simulator, path) && simulator.readRegister(2) == 0x800000, "stack top moved by the layout");
+    check(simulator.run() == STOP_EXITED && simulator.readRegister(5) == 9, "data section moved by the layout");
+    check(simulator.readRegister(20) == 0x201000, "heap starts on the page after the data");
+    check(simulator.readRegister(21) == 0x202000 && readDword(simulator, 0x201000) == 9, "brk grows the heap");
+    check(simulator.readRegister(22) == 0x202000, "brk into the stack is refused");
+
+    Simulator duplicate;
+    duplicate.stackTop = 0x800000;
+    check(loadQuiet(duplicate, writeFile("duplicate.s", ".text\nmain: addi x5, x0, 1\nmain: addi x6, x0, 2\n")) &&
+              duplicate.program->instructionList.size() == 1 && duplicate.readRegister(2) == 0x800000,
+          "duplicate label ends the program but still sets up the stack");
+
+    string blob = writeFile("blob.bin", string(5000, 'x') + "tail");
+    string mapped = writeFile("mapped.s", ".text\nmain: lui x11, 0x40000\nld x5, 0(x11)\nlui x12, 0x1\nadd x12, x11, x12\n"
+                                          "ld x6, 904(x12)\nsd x0, 0(x11)\nld x7, 0(x11)\n");
+    Simulator reader;
+    check(loadQuiet(reader, mapped) && reader.mapFile(blob, 0x40000000, false), "map a file read only");
+    check(reader.run() == STOP_FAULT && reader.readRegister(5) == 0x7878787878787878LL &&
+              reader.readRegister(6) == 0x6c696174,
+          "mapped file is read, a store to it faults");
+    Simulator writer;
+    check(loadQuiet(writer, mapped) && writer.mapFile(blob, 0x40000000, true), "map a file writable");
+    check(writer.run() == STOP_EXITED && writer.readRegister(7) == 0, "store to a writable mapping lands in memory");
+    check(readFile(blob) == string(5000, 'x') + "tail", "mapped file itself is never written");
+    check(!writer.mapFile(blob, 0x40000800, false) && !writer.mapFile(blob, 0x40001000, false),
+          "misaligned and overlapping mappings are refused");
+}
+
+// Memory dumps are streamed, go through Sv39 without setting A bits, never allocate the
+// pages they read, and refuse ranges that wrap
+void testDump()
+{
+    Simulator simulator;
+    Memory &memory = simulator.memory;
+    Mmu &mmu = simulator.mmu;
+    const ull V = 1, R = 2, W = 4, U = 16, A = 64;
+    memory.write(0x200000, 0x0807060504030201ULL, 8);
+    memory.write(0x100000 + 1 * 8, (0x101ULL << 10) | V, 8);
+    memory.write(0x101000, (0x102ULL << 10) | V, 8);
+    memory.write(0x102000, (0x200ULL << 10) | V | R | W | U, 8);
+
+    size_t pages = memory.allPages().size();
+    string raw = scratch + "/dump.bin", json = scratch + "/dump.json";
+    check(dumpMemory(mmu, memory, 0x1000, 3 * pageSize, raw) && readFile(raw) == string(3 * pageSize, '\0'),
+          "untouched memory dumps as zeros");
+    check(memory.allPages().size() == pages, "dump does not allocate pages");
+    check(!dumpMemory(mmu, memory, 0xFFFFFFFFFFFFFFF0, 0x20, raw), "wrapping range is refused");
+
+    mmu.satp = (satpModeSv39 << 60) | 0x100;
+    mmu.privilegeMode = PRIV_U;
+    mmu.flushTlb();
+    check(dumpMemory(mmu, memory, 0x40000002, 4, raw) && readFile(raw) == "\x03\x04\x05\x06", "dump translates through Sv39");
+    check(dumpMemory(mmu, memory, 0x40000000, 2, json) &&
+              readFile(json) == "{\"start\":\"0x0000000040000000\",\"length\":2,\"data\":\"0102\"}\n",
+          "JSON dump");
+    check((memory.read(0x102000, 8) & A) == 0, "dump leaves the A bit clear");
+    check(!dumpMemory(mmu, memory, 0x40000ff8, 16, raw), "dump stops at an unmapped page");
+}
+
+// until stops before the target line, finish right after the function returns, and a
+// pause request from another thread stops a run before its next instruction
+void testRunControl()
+{
+    string path = writeFile("control.s", ".text\n"
+                                         "main: addi x5, x0, 1\njal x1, func\naddi x6, x0, 2\nbeq x0, x0, done\n"
+                                         "func: addi x7, x0, 3\naddi x8, x0, 4\njalr x0, 0(x1)\n"
+                                         "done: addi x9, x0, 5\n");
+    Simulator simulator;
+    loadQuiet(simulator, path);
+    check(simulator.runUntil(4) == STOP_TARGET && simulator.readPc() == 16 && simulator.readRegister(5) == 1 &&
+              simulator.readRegister(7) == 0,
+          "until stops before the target");
+    check(simulator.finish() == STOP_TARGET && simulator.readPc() == 8 && simulator.readRegister(8) == 4 &&
+              simulator.readRegister(6) == 0,
+          "finish stops after the return");
+    simulator.pauseRequested = true;
+    check(simulator.run() == STOP_PAUSED && simulator.readPc() == 8 && !simulator.pauseRequested,
+          "pending pause stops before the next instruction");
+    check(simulator.run() == STOP_EXITED && simulator.readRegister(9) == 5, "run resumes after a pause");
+
+    Simulator spinning;
+    loadQuiet(spinning, writeFile("spin.s", ".text\nmain: addi x5, x5, 1\njal x0, main\n"));
+    thread pauser([&]
+                  {
+                      usleep(50000);
+                      spinning.pauseRequested = true;
+                  });
+    StopReason reason = spinning.run();
+    pauser.join();
+    check(reason == STOP_PAUSED && spinning.readRegister(5) > 0, "pause from another thread stops a running program");
+}
+
+// Sampling fast-forwards, warms and measures in turn, ends in the same state as a plain
+// run and only counts complete measurement windows
+void testSampling()
+{
+    SampleSummary summary = summarizeSamples({1, 2, 3, 4});
+    check(fabs(summary.mean - 2.5) < 1e-9 && fabs(summary.halfWidth - 3.182 * sqrt(5.0 / 12)) < 1e-9,
+          "mean and 95% confidence interval of samples");
+
+    string path = writeFile("sampled.s", ".text\nmain: addi x5, x0, 0\nlui x6, 0x3\nloop: addi x5, x5, 1\nblt x5, x6, loop\n");
+    Simulator plain, sampled;
+    loadQuiet(plain, path);
+    loadQuiet(sampled, path);
+    plain.run();
+    ostringstream report;
+    streambuf *console = cout.rdbuf(report.rdbuf());
+    sampled.sample(1000, 100, 500);
+    cout.rdbuf(console);
+    check(sampled.registers == plain.registers && sampled.retiredCount == plain.retiredCount && plain.retiredCount == 24578,
+          "sampled run ends like a plain run");
+    check(report.str().find("Measured 15 windows of 500 instructions out of 24578 ") == 0, "only complete windows are measured");
+    check(report.str().find("CPI") != string::npos && report.str().find("Estimated cycles") != string::npos, "sampling report");
+}
+
+// The fuzzer finds the input byte that makes a routine exit with an error, saves it,
+// and leaves the machine it forked from as it was
+void testFuzzer()
+{
+    string path = writeFile("fuzzed.s", ".text\n"
+                                        "main: addi x5, x0, 1\nbeq x0, x0, end\n"
+                                        "parse: beq x11, x0, return\nlbu x6, 0(x10)\naddi x7, x0, 70\nbne x6, x7, return\n"
+                                        "addi x10, x0, 3\naddi x17, x0, 93\necall\n"
+                                        "return: jalr x0, 0(x1)\n"
+                                        "end: addi x6, x0, 2\n");
+    Simulator simulator;
+    loadQuiet(simulator, path);
+    string findings = scratch + "/findings";
+    mkdir(findings.c_str(), 0755);
+    Fuzzer fuzzer(simulator, "parse", simulator.program->labelAddresses.at("parse"), 0x20000, 8, findings);
+    fuzzer.run(5000);
+    ostringstream report;
+    streambuf *console = cout.rdbuf(report.rdbuf());
+    fuzzer.printReport();
+    cout.rdbuf(console);
+    check(report.str().find("Ran 5000 cases") == 0, "fuzzer runs the requested cases");
+    check(report.str().find("non-zero exits: 0") == string::npos && readFile(findings + "/exit-0.bin")[0] == 'F',
+          "fuzzer finds and saves the failing input");
+    check(simulator.readPc() == 0 && readDword(simulator, 0x20000) == 0 && simulator.run() == STOP_EXITED &&
+              simulator.exitCode == 0 && simulator.readRegister(6) == 2,
+          "fuzzed machine is unchanged");
+}
+
+// Function to time a stream of instructions on the out-of-order model, instruction i
+// is given by make(i)
+ull outOfOrderCycles(int count, const function<RetiredInstruction(int)> &make)
+{
+    OutOfOrderModel core{OutOfOrderConfig()};
+    for (int i = 0; i < count; i++)
+        core.execute(make(i));
+    return core.cycles();
+}
+
+// Independent instructions retire at the machine width, dependent ones at the latency
+// of their producer, and a load that follows a store to its word is forwarded. The
+// margins cover filling the pipeline and the first cache misses
+void testOutOfOrder()
+{
+    const int count = 4000;
+    OutOfOrderConfig config;
+    ull independent = outOfOrderCycles(count, [](int i)
+                                       { return RetiredInstruction{i % 16, OP_ADDI, (uint8_t)(5 + i % 8), 0, 0, false, 0, nullptr}; });
+    check(independent >= count / config.retireWidth && independent < count / config.retireWidth + 200,
+          "independent instructions retire at full width");
+    ull chain = outOfOrderCycles(count, [](int i)
+                                 { return RetiredInstruction{i % 16, OP_ADDI, 5, 5, 0, false, 0, nullptr}; });
+    check(chain >= (ull)count * config.aluLatency && chain < (ull)count * config.aluLatency + 200,
+          "dependent chain runs at the ALU latency");
+    ull pointerChase = outOfOrderCycles(count, [](int i)
+                                        { return RetiredInstruction{i % 16, OP_LD, 5, 5, 0, false, 0x10000, nullptr}; });
+    check(pointerChase >= (ull)count * config.loadLatency && pointerChase < (ull)count * config.loadLatency + 400,
+          "dependent loads wait for the load latency");
+    ull forwarded = outOfOrderCycles(count, [](int i)
+                                     { return i % 2 == 0 ? RetiredInstruction{i % 16, OP_SD, 0, 6, 5, false, 0x10000, nullptr}
+                                                         : RetiredInstruction{i % 16, OP_LD, 5, 6, 0, false, 0x10000, nullptr}; });
+    check(forwarded < pointerChase, "loads after a store to the same word are forwarded");
+
+    string path = writeFile("modelled.s", ".text\nmain: addi x5, x0, 0\naddi x6, x0, 1000\nloop: addi x5, x5, 1\nblt x5, x6, loop\n");
+    Simulator plain, modelled;
+    loadQuiet(plain, path);
+    loadQuiet(modelled, path);
+    plain.run();
+    ostringstream report;
+    streambuf *console = cout.rdbuf(report.rdbuf());
+    modelled.simulateOutOfOrder(config);
+    cout.rdbuf(console);
+    check(modelled.registers == plain.registers && modelled.retiredCount == plain.retiredCount,
+          "program run through the model ends like a plain run");
+}
+
+// Intervals cover every instruction exactly once, replay the inputs the functional pass
+// read even when the host would now give others, and with enough warm-up come close to
+// simulating the whole run in one piece
+void testIntervals()
+{
+    string path = writeFile("intervals.s", ".data\n.space 64\n.text\n"
+                                           "main: lui x11, 0x10\naddi x10, x0, 0\naddi x12, x0, 64\naddi x17, x0, 63\necall\n"
+                                           "slli x6, x10, 8\naddi x5, x0, 0\nloop: addi x5, x5, 1\nblt x5, x6, loop\n");
+    int reads = 0;
+    auto simulate = [&](ll length, ll warm, Simulator &simulator)
+    {
+        loadQuiet(simulator, path);
+        // Forks share the counter, so a checkpoint that read the host again would be seen
+        reads = 0;
+        simulator.readLine = [&reads](string &line)
+        {
+            line = string(10 + reads++, 'z');
+            return true;
+        };
+        ostringstream report;
+        streambuf *console = cout.rdbuf(report.rdbuf());
+        simulator.simulateIntervals(length, warm);
+        cout.rdbuf(console);
+        return report.str();
+    };
+    auto cycles = [](const string &report)
+    {
+        size_t at = report.find("cycles: ");
+        return at == string::npos ? 0 : stoull(report.substr(at + 8));
+    };
+
+    Simulator whole, split;
+    string wholeReport = simulate(1000000, 0, whole);
+    string splitReport = simulate(1000, 500, split);
+    ll retired = whole.retiredCount;
+    check(retired == 7 + 2 * 11 * 256 && split.registers == whole.registers, "functional pass runs the whole program");
+    check(reads == 1, "intervals replay the input instead of reading the host");
+    check(splitReport.find("Simulated " + to_string((retired + 999) / 1000) + " intervals of 1000 ") == 0 &&
+              splitReport.find("Instructions: " + to_string(retired) + ",") != string::npos,
+          "intervals cover every instruction once with the recorded input");
+    ull wholeCycles = cycles(wholeReport), splitCycles = cycles(splitReport);
+    check(wholeCycles > 0 && splitCycles >= wholeCycles && splitCycles < wholeCycles * 1.05,
+          "warmed intervals come close to one whole run");
+}
+
+// Watchpoints stop after the access that touches their range, including ranges that
+// cover a terabyte or end at the top of the address space
+void testWatchpoints()
+{
+    string path = writeFile("watch.s", ".data\n.dword 5\n.text\n"
+                                       "main: lui x11, 0x10\nld x5, 0(x11)\naddi x5, x5, 1\nsd x5, 8(x11)\naddi x6, x0, 1\n");
+    Simulator simulator;
+    check(loadQuiet(simulator, path), "load for watchpoints");
+    simulator.mmu.watchpoints.push_back({1, 0x1000, 1ULL << 40, WATCH_WRITE});
+    simulator.mmu.watchpoints.push_back({2, 0xFFFFFFFFFFFFFFF0, 16, WATCH_ACCESS});
+    simulator.mmu.updateWatchedPages();
+    check(simulator.run() == STOP_WATCHPOINT, "store into a terabyte range stops");
+    check(simulator.mmu.lastWatch.id == 1 && simulator.mmu.lastWatch.address == 0x10008 &&
+              simulator.mmu.lastWatch.newValue == 6,
+          "store watch reports address and value");
+    check(simulator.readRegister(6) == 0, "stop comes right after the store");
+    check(simulator.run() == STOP_EXITED && simulator.readRegister(6) == 1, "run resumes after a watchpoint");
+
+    Simulator reader;
+    loadQuiet(reader, path);
+    reader.mmu.watchpoints.push_back({1, 0x10004, 1, WATCH_READ});
+    reader.mmu.updateWatchedPages();
+    check(reader.run() == STOP_WATCHPOINT && reader.mmu.lastWatch.access == ACCESS_LOAD &&
+              reader.readRegister(5) == 5,
+          "load overlapping a read watch stops");
+    reader.mmu.watchpoints.clear();
+    reader.mmu.updateWatchedPages();
+    check(reader.run() == STOP_EXITED, "no stop once the watch is deleted");
+}
+
+// Function to frame a GDB remote packet with its checksum
+string gdbPacket(const string &data)
+{
+    unsigned char checksum = 0;
+    for (char c : data)
+        checksum += c;
+    char trailer[4];
+    snprintf(trailer, sizeof(trailer), "#%02x", checksum);
+    return "$" + data + trailer;
+}
+
+// Function to send one GDB packet and read the ack and the reply packet, returning the
+// ack followed by the data of the reply
+string gdbRequest(int fd, const string &packet)
+{
+    if (send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) != (ssize_t)packet.size())
+        return "";
+    string reply;
+    char byte;
+    if (read(fd, &byte, 1) != 1)
+        return "";
+    reply += byte;
+    if (byte != '+')
+        return reply;
+    while (read(fd, &byte, 1) == 1 && byte != '#')
+    {
+        if (byte != '$')
+            reply += byte;
+    }
+    char checksum[2];
+    if (read(fd, checksum, 2) != 2)
+        return "";
+    return reply;
+}
+
+// The stub answers intact packets, asks again for damaged ones, reads memory and steps
+void testGdbStub()
+{
+    string path = writeFile("gdb.s", ".data\n.dword 0x1122334455667788\n.text\nmain: addi x5, x0, 1\naddi x6, x0, 2\n");
+    Simulator simulator;
+    loadQuiet(simulator, path);
+    string endpoint = scratch + "/gdb.sock";
+    bool served = false;
+    thread stub([&]
+                { served = runGdbServer(endpoint, simulator); });
+    int fd = connectServer(endpoint);
+    check(fd >= 0, "connect to the gdb stub");
+    if (fd >= 0)
+    {
+        check(gdbRequest(fd, "$?#00") == "-", "damaged packet is answered with -");
+        check(gdbRequest(fd, gdbPacket("?")) == "+S05", "intact packet is acked and answered");
+        check(gdbRequest(fd, gdbPacket("m10000,4")) == "+88776655", "memory read");
+        check(gdbRequest(fd, gdbPacket("m10000,fffffffff")) == "+E14", "oversized memory read is refused");
+        check(gdbRequest(fd, gdbPacket("s")) == "+S05" && gdbRequest(fd, gdbPacket("p20")) == "+0400000000000000",
+              "single step moves the pc");
+        check(gdbRequest(fd, gdbPacket("p5")) == "+0100000000000000", "register read after a step");
+        string kill = gdbPacket("k");
+        check(send(fd, kill.data(), kill.size(), MSG_NOSIGNAL) == (ssize_t)kill.size(), "kill the session");
+    }
+    stub.join();
+    if (fd >= 0)
+        close(fd);
+    check(served, "gdb session ends on kill");
+    check(listenOn("0") < 0 && listenOn("65536") < 0 && listenOn("99999999999999999999") < 0, "ports out of range are refused");
+}
+
+// Requests run a program, malformed ones get an error and leave the session usable
+void testServer()
+{
+    string program = writeFile("serve.s", ".text\nmain: addi x5, x0, 7\naddi x6, x5, 1\n");
+    string path = scratch + "/serve.sock";
+    bool served = false;
+    thread server([&]
+                  { served = runServer(path, 2); });
+    int fd = connectServer(path);
+    check(fd >= 0, "connect to the server");
+    if (fd >= 0)
+    {
+        string load = serverRequest(fd, "{\"id\":1,\"cmd\":\"load\",\"file\":\"" + program + "\"}");
+        check(load.find("\"id\":1,\"ok\":true") != string::npos, "server loads a program");
+        check(serverRequest(fd, "{\"cmd\":\"x\\uZZZZ\"}") == "{\"ok\":false,\"error\":\"Malformed request\"}",
+              "bad \\u escape is a malformed request");
+        check(serverRequest(fd, "{\"cmd\":\"step\",\"count\":\"lots\"}").find("Invalid number") != string::npos,
+              "bad count is an invalid number");
+        check(serverRequest(fd, "{\"cmd\":\"run\"}").find("\"reason\":\"exited\"") != string::npos, "server runs to the end");
+        check(serverRequest(fd, "{\"cmd\":\"regs\"}").find("\"0x0000000000000008\"") != string::npos, "server reads registers");
+        close(fd);
+    }
+    raise(SIGINT);
+    server.join();
+    check(served, "server stops on an interrupt");
+}
+
+int main()
+{
+    char directory[] = "/tmp/riscv_tests_XXXXXX";
+    if (!mkdtemp(directory))
+    {
+        cerr << "Error: Cannot create a temporary directory" << endl;
+        return 1;
+    }
+    scratch = directory;
+
+    testSv39();
+    testStoreFault();
+    testProgramCache();
+    testForkIsolation();
+    testConcurrentForks();
+    testBitManip();
+    testReuseDistance();
+    testCheckMode();
+    testCounters();
+    testRecordReplay();
+    testLayoutAndMappings();
+    testDump();
+    testSampling();
+    testFuzzer();
+    testOutOfOrder();
+    testIntervals();
+    testRunControl();
+    testWatchpoints();
+    testThreads();
+    testGdbStub();
+    testServer();
+
+    string remove = "rm -rf " + scratch;
+    if (system(remove.c_str()) != 0)
+        cerr << "Error: Cannot remove " << scratch << endl;
+    cout << (failures ? to_string(failures) + " checks failed" : "All checks passed") << endl;
+    return failures;
+}
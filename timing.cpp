@@ -0,0 +1,201 @@
+#include <cmath>
+#include "timing.h"
+#include "simulator.h"
+
+using namespace std;
+
+// Latencies in cycles, on top of the cycle every instruction takes
+const int secondLevelLatency = 10;
+const int mainMemoryLatency = 100;
+const int mispredictPenalty = 3;
+const int loadUseStall = 1;
+
+CacheModel::CacheModel(int sizeBytes, int ways, int lineBytes) : ways(ways)
+{
+    lineBits = 0;
+    while ((1 << lineBits) < lineBytes)
+        lineBits++;
+    sets = sizeBytes / (ways * lineBytes);
+    tags.assign(sets * ways, ~0ULL);
+    lastUsed.assign(sets * ways, 0);
+}
+
+bool CacheModel::access(ull address)
+{
+    ull line = address >> lineBits;
+    int base = (line % sets) * ways;
+    int victim = base;
+    useClock++;
+    for (int way = base; way < base + ways; way++)
+    {
+        if (tags[way] == line)
+        {
+            lastUsed[way] = useClock;
+            return true;
+        }
+        if (lastUsed[way] < lastUsed[victim])
+            victim = way;
+    }
+    tags[victim] = line;
+    lastUsed[victim] = useClock;
+    return false;
+}
+
+void CacheModel::clear()
+{
+    fill(tags.begin(), tags.end(), ~0ULL);
+    fill(lastUsed.begin(), lastUsed.end(), 0);
+    useClock = 0;
+}
+
+BranchPredictor::BranchPredictor(int tableBits) : tableBits(tableBits), counters(1 << tableBits, 1)
+{
+}
+
+bool BranchPredictor::predictBranch(ull pc, bool taken)
+{
+    ull mask = (1ULL << tableBits) - 1;
+    uint8_t &counter = counters[((pc >> 2) ^ history) & mask];
+    bool correct = (counter >= 2) == taken;
+    if (taken && counter < 3)
+        counter++;
+    else if (!taken && counter > 0)
+        counter--;
+    history = ((history << 1) | taken) & mask;
+    return correct;
+}
+
+void BranchPredictor::call(ull returnAddress)
+{
+    // Deep recursion drops the oldest entries like a fixed size hardware stack
+    if (returnStack.size() == 16)
+        returnStack.erase(returnStack.begin());
+    returnStack.push_back(returnAddress);
+}
+
+bool BranchPredictor::predictReturn(ull target)
+{
+    if (returnStack.empty())
+        return false;
+    ull predicted = returnStack.back();
+    returnStack.pop_back();
+    return predicted == target;
+}
+
+void BranchPredictor::clear()
+{
+    fill(counters.begin(), counters.end(), 1);
+    history = 0;
+    returnStack.clear();
+}
+
+// 32 KiB 8 way first level caches in front of a 256 KiB 8 way second level, 64 byte lines
+TimingModel::TimingModel()
+    : instructionCache(32 << 10, 8, 64), dataCache(32 << 10, 8, 64), secondLevel(256 << 10, 8, 64), predictor(12)
+{
+}
+
+int TimingModel::memoryLatency(ull address, CacheModel &firstLevel, ull &misses)
+{
+    if (firstLevel.access(address))
+        return 0;
+    misses++;
+    return secondLevel.access(address) ? secondLevelLatency : mainMemoryLatency;
+}
+
+// Function to describe an instruction for the timing models, it has to be called before
+// the instruction runs
+RetiredInstruction describeInstruction(const DecodedInstruction &decoded, int line, const vector<ll> &registers, const string *function)
+{
+    RetiredInstruction instruction = {line, decoded.op, decoded.rd, decoded.rs1, decoded.rs2, false, 0, function};
+    uint8_t op = decoded.op;
+    if ((op >= OP_LB && op <= OP_LWU) || (op >= OP_SB && op <= OP_SD))
+        instruction.address = registers[decoded.rs1] + (ull)decoded.imm;
+    else if (op >= OP_BEQ && op <= OP_BGEU)
+        instruction.taken = branchTaken(decoded, registers);
+    else if (op == OP_JALR)
+        instruction.address = registers[decoded.rs1];
+    return instruction;
+}
+
+// Function to account for one instruction
+void TimingModel::execute(const RetiredInstruction &instruction)
+{
+    ull pc = (ull)instruction.line * 4;
+    ull cycles = 1 + memoryLatency(pc, instructionCache, stats.instructionMisses);
+    uint8_t op = instruction.op;
+
+    // Waiting for the previous load when one of its sources is its destination
+    if (pendingLoad > 0 && (instruction.rs1 == pendingLoad || instruction.rs2 == pendingLoad))
+        cycles += loadUseStall;
+    pendingLoad = -1;
+
+    if ((op >= OP_LB && op <= OP_LWU) || (op >= OP_SB && op <= OP_SD))
+    {
+        stats.memoryAccesses++;
+        cycles += memoryLatency(instruction.address, dataCache, stats.dataMisses);
+        if (op <= OP_LWU)
+            pendingLoad = instruction.rd;
+    }
+    else if (op >= OP_BEQ && op <= OP_BGEU)
+    {
+        stats.branches++;
+        if (!predictor.predictBranch(pc, instruction.taken))
+        {
+            stats.mispredictions++;
+            cycles += mispredictPenalty;
+        }
+    }
+    else if (op == OP_JAL && instruction.rd != 0)
+    {
+        predictor.call(pc + 4);
+    }
+    else if (op == OP_JALR)
+    {
+        stats.branches++;
+        if (!predictor.predictReturn(instruction.address))
+        {
+            stats.mispredictions++;
+            cycles += mispredictPenalty;
+        }
+    }
+
+    stats.instructions++;
+    stats.cycles += cycles;
+}
+
+void TimingModel::clear()
+{
+    instructionCache.clear();
+    dataCache.clear();
+    secondLevel.clear();
+    predictor.clear();
+    pendingLoad = -1;
+    stats = {};
+}
+
+// Function to compute the mean of the samples and its 95% confidence interval using
+// Student's t distribution, windows are assumed to be independent
+SampleSummary summarizeSamples(const vector<double> &samples)
+{
+    static const double tTable[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    SampleSummary summary = {0, 0};
+    size_t count = samples.size();
+    if (count == 0)
+        return summary;
+    for (double sample : samples)
+        summary.mean += sample;
+    summary.mean /= count;
+    if (count < 2)
+        return summary;
+
+    double variance = 0;
+    for (double sample : samples)
+        variance += (sample - summary.mean) * (sample - summary.mean);
+    variance /= count - 1;
+    double t = count - 1 <= 30 ? tTable[count - 1] : 1.96;
+    summary.halfWidth = t * sqrt(variance / count);
+    return summary;
+}
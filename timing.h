@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "decoder.h"
+
+using namespace std;
+typedef long long ll;
+typedef unsigned long long ull;
+
+// Set associative cache with LRU replacement, only tags are modelled
+class CacheModel
+{
+public:
+    CacheModel(int sizeBytes, int ways, int lineBytes);
+    bool access(ull address); // Returns true on a hit, a miss fills the line
+    void clear();
+
+private:
+    int sets;
+    int ways;
+    int lineBits;
+    ull useClock = 0;
+    vector<ull> tags;     // sets * ways tags, ~0 when empty
+    vector<ull> lastUsed; // Value of useClock at the last access of each way
+};
+
+// Gshare conditional branch predictor with two bit counters, plus a return address
+// stack for jalr
+class BranchPredictor
+{
+public:
+    explicit BranchPredictor(int tableBits);
+    bool predictBranch(ull pc, bool taken); // Returns true when the prediction was right
+    void call(ull returnAddress);
+    bool predictReturn(ull target);
+    void clear();
+
+private:
+    int tableBits;
+    ull history = 0;
+    vector<uint8_t> counters;
+    vector<ull> returnStack;
+};
+
+// One retired instruction as the timing models see it, described before it runs so
+// that the address and branch outcome come from the registers it reads
+struct RetiredInstruction
+{
+    int line;
+    uint8_t op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    bool taken;              // Outcome of a conditional branch
+    ull address;             // Effective address of a load or store, target of jalr
+    const string *function;  // Function on top of the call stack, may be null
+};
+
+RetiredInstruction describeInstruction(const DecodedInstruction &decoded, int line, const vector<ll> &registers, const string *function);
+
+// Events counted by the timing model
+struct TimingStats
+{
+    ull instructions;
+    ull cycles;
+    ull memoryAccesses;
+    ull dataMisses;
+    ull instructionMisses;
+    ull branches;
+    ull mispredictions;
+};
+
+// In-order pipeline that completes one instruction per cycle, plus stalls for cache
+// misses, mispredicted branches and loads whose result is used right away
+class TimingModel
+{
+public:
+    TimingModel();
+    void execute(const RetiredInstruction &instruction);
+    void clear();
+    void clearStats() { stats = {}; }
+
+    TimingStats stats = {};
+
+private:
+    int memoryLatency(ull address, CacheModel &firstLevel, ull &misses);
+
+    CacheModel instructionCache;
+    CacheModel dataCache;
+    CacheModel secondLevel;
+    BranchPredictor predictor;
+    int pendingLoad = -1; // Destination of the previous instruction when it was a load
+};
+
+// Summary of samples taken from equally sized measurement windows
+struct SampleSummary
+{
+    double mean;
+    double halfWidth; // Half width of the 95% confidence interval of the mean
+};
+
+SampleSummary summarizeSamples(const vector<double> &samples);